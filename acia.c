@@ -13,26 +13,20 @@
 #include "mem.h"
 #include "panic.h"
 
-#define ACIA_TRACE_BUFFER_SIZE 1024
-#define ACIA_TRACE_MAX 80
 
-static char acia_trace_buffer[ACIA_TRACE_BUFFER_SIZE][ACIA_TRACE_MAX];
-static int acia_trace_buffer_n = 0;
 
-
-
-static void acia_trace(const char *format, ...)
+static void acia_trace(acia_t *acia, const char *format, ...)
 {
   va_list args;
 
   va_start(args, format);
-  vsnprintf(acia_trace_buffer[acia_trace_buffer_n],
+  vsnprintf(acia->trace_buffer[acia->trace_buffer_n],
     ACIA_TRACE_MAX, format, args);
   va_end(args);
 
-  acia_trace_buffer_n++;
-  if (acia_trace_buffer_n >= ACIA_TRACE_BUFFER_SIZE) {
-    acia_trace_buffer_n = 0;
+  acia->trace_buffer_n++;
+  if (acia->trace_buffer_n >= ACIA_TRACE_BUFFER_SIZE) {
+    acia->trace_buffer_n = 0;
   }
 }
 
@@ -102,7 +96,7 @@ static void acia_update_tty_settings(acia_t *acia)
   }
 
   if (tcgetattr(acia->tty_fd, &tios) == -1) {
-    panic("tcgetattr() failed with errno: %d\n", errno);
+    panic(acia->mem->machine, "tcgetattr() failed with errno: %d\n", errno);
     return;
   }
 
@@ -158,7 +152,7 @@ static void acia_update_tty_settings(acia_t *acia)
   }
 
   if (tcsetattr(acia->tty_fd, TCSANOW, &tios) == -1) {
-    panic("tcsetattr() failed with errno: %d\n", errno);
+    panic(acia->mem->machine, "tcsetattr() failed with errno: %d\n", errno);
     return;
   }
 }
@@ -177,23 +171,23 @@ static uint8_t acia_read(void *acia, uint16_t address)
       if (((acia_t *)acia)->rx_fifo_tail == ((acia_t *)acia)->rx_fifo_head) {
         ((acia_t *)acia)->status &= ~0x08; /* Receive Data Register Not Full */
       }
-      acia_trace("[R] <<< 0x%02x\n", byte);
+      acia_trace(acia, "[R] <<< 0x%02x\n", byte);
       return byte;
     } else {
-      acia_trace("[R] RX Empty\n");
+      acia_trace(acia, "[R] RX Empty\n");
       return 0;
     }
 
   case 0x1:
-    /* acia_trace("[R] Status=0x%02x\n", ((acia_t *)acia)->status); */
+    /* acia_trace(acia, "[R] Status=0x%02x\n", ((acia_t *)acia)->status); */
     return ((acia_t *)acia)->status;
 
   case 0x2:
-    acia_trace("[R] Command=0x%02x\n", ((acia_t *)acia)->command);
+    acia_trace(acia, "[R] Command=0x%02x\n", ((acia_t *)acia)->command);
     return ((acia_t *)acia)->command;
 
   case 0x3:
-    acia_trace("[R] Control=0x%02x\n", ((acia_t *)acia)->control);
+    acia_trace(acia, "[R] Control=0x%02x\n", ((acia_t *)acia)->control);
     return ((acia_t *)acia)->control;
 
   default:
@@ -209,23 +203,23 @@ static void acia_write(void *acia, uint16_t address, uint8_t value)
 
   switch (address) {
   case 0x0:
-    acia_trace("[W] >>> 0x%02x\n", value);
+    acia_trace(acia, "[W] >>> 0x%02x\n", value);
     acia_tx_fifo_write(acia, value);
     break;
 
   case 0x1:
-    acia_trace("[W] Reset\n");
+    acia_trace(acia, "[W] Reset\n");
     ((acia_t *)acia)->command &= ~0x1F; /* Clear lower 5 bits. */
     break;
 
   case 0x2:
-    acia_trace("[W] Command=0x%02x\n", value);
+    acia_trace(acia, "[W] Command=0x%02x\n", value);
     ((acia_t *)acia)->command = value;
     acia_update_tty_settings(acia);
     break;
 
   case 0x3:
-    acia_trace("[W] Control=0x%02x\n", value);
+    acia_trace(acia, "[W] Control=0x%02x\n", value);
     ((acia_t *)acia)->control = value;
     acia_update_tty_settings(acia);
     break;
@@ -237,13 +231,45 @@ static void acia_write(void *acia, uint16_t address, uint8_t value)
 
 
 
-int acia_init(acia_t *acia, mem_t *mem, uint16_t base_address,
-  const char *tty_device)
+/* Service the TTY, only scheduled when one is assigned. */
+static void acia_poll(void *cookie, uint64_t now)
+{
+  acia_t *acia = cookie;
+  struct pollfd fds[1];
+  uint8_t byte;
+  (void)now;
+
+  fds[0].fd = acia->tty_fd;
+  fds[0].events = POLLIN;
+
+  /* Non-blocking read. */
+  if (poll(fds, 1, 0) > 0) {
+    if (read(acia->tty_fd, &byte, 1) == 1) {
+      acia_rx_fifo_write(acia, byte);
+      acia->status |= 0x08; /* Receive Data Register Full */
+    }
+  }
+
+  /* Blocking write. */
+  if (acia_tx_fifo_read(acia, &byte)) {
+    write(acia->tty_fd, &byte, 1);
+  }
+
+  sched_add(acia->sched, &acia->poll, acia->poll.deadline + ACIA_POLL_CYCLES);
+}
+
+
+
+int acia_init(acia_t *acia, mem_t *mem, sched_t *sched,
+  uint16_t base_address, const char *tty_device)
 {
   int i;
 
   memset(acia, 0, sizeof(acia_t));
   acia->base_address = base_address;
+  acia->mem = mem;
+  acia->sched = sched;
+  sched_event_init(&acia->poll, acia_poll, acia);
   acia->status |= 0x10; /* Transmit Data Register Empty */
 
   for (i = (base_address % 0xC000); i < (base_address % 0xC000) + 0x4; i++) {
@@ -261,67 +287,33 @@ int acia_init(acia_t *acia, mem_t *mem, uint16_t base_address,
       return -1;
     }
     /* NOTE: acia->tty_fd is never closed! */
+    sched_add(sched, &acia->poll, sched->now + ACIA_POLL_CYCLES);
   } else {
     acia->tty_fd = -1;
   }
 
   for (i = 0; i < ACIA_TRACE_BUFFER_SIZE; i++) {
-    acia_trace_buffer[i][0] = '\0';
+    acia->trace_buffer[i][0] = '\0';
   }
-  acia_trace_buffer_n = 0;
+  acia->trace_buffer_n = 0;
 
   return 0;
 }
 
 
 
-void acia_execute(acia_t *acia)
-{
-  struct pollfd fds[1];
-  uint8_t byte;
-
-  if (acia->tty_fd == -1) {
-    return;
-  }
-
-  /* Only run every X cycle. */
-  acia->cycle++;
-  if (acia->cycle < 1000) {
-    return;
-  }
-  acia->cycle = 0;
-
-  fds[0].fd = acia->tty_fd;
-  fds[0].events = POLLIN;
-
-  /* Non-blocking read. */
-  if (poll(fds, 1, 0) > 0) {
-    if (read(acia->tty_fd, &byte, 1) == 1) {
-      acia_rx_fifo_write(acia, byte);
-      acia->status |= 0x08; /* Receive Data Register Full */
-    }
-  }
-
-  /* Blocking write. */
-  if (acia_tx_fifo_read(acia, &byte)) {
-    write(acia->tty_fd, &byte, 1);
-  }
-}
-
-
-
-void acia_trace_dump(FILE *fh)
+void acia_trace_dump(acia_t *acia, FILE *fh)
 {
   int i;
 
-  for (i = acia_trace_buffer_n; i < ACIA_TRACE_BUFFER_SIZE; i++) {
-    if (acia_trace_buffer[i][0] != '\0') {
-      fprintf(fh, acia_trace_buffer[i]);
+  for (i = acia->trace_buffer_n; i < ACIA_TRACE_BUFFER_SIZE; i++) {
+    if (acia->trace_buffer[i][0] != '\0') {
+      fprintf(fh, acia->trace_buffer[i]);
     }
   }
-  for (i = 0; i < acia_trace_buffer_n; i++) {
-    if (acia_trace_buffer[i][0] != '\0') {
-      fprintf(fh, acia_trace_buffer[i]);
+  for (i = 0; i < acia->trace_buffer_n; i++) {
+    if (acia->trace_buffer[i][0] != '\0') {
+      fprintf(fh, acia->trace_buffer[i]);
     }
   }
 }
@@ -5,9 +5,14 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "mem.h"
+#include "sched.h"
 
 #define ACIA_RX_FIFO_SIZE 1024
 #define ACIA_TX_FIFO_SIZE 1024
+#define ACIA_POLL_CYCLES 1000 /* Interval for servicing the TTY. */
+
+#define ACIA_TRACE_BUFFER_SIZE 1024
+#define ACIA_TRACE_MAX 80
 
 typedef struct acia_s {
   uint16_t base_address;
@@ -23,12 +28,16 @@ typedef struct acia_s {
   int rx_fifo_tail;
   int tx_fifo_tail;
 
-  int cycle;
+  mem_t *mem;
+  sched_t *sched;
+  sched_event_t poll;
+
+  char trace_buffer[ACIA_TRACE_BUFFER_SIZE][ACIA_TRACE_MAX];
+  int trace_buffer_n;
 } acia_t;
 
-int acia_init(acia_t *acia, mem_t *mem, uint16_t base_address,
-  const char *tty_device);
-void acia_execute(acia_t *acia);
-void acia_trace_dump(FILE *fh);
+int acia_init(acia_t *acia, mem_t *mem, sched_t *sched,
+  uint16_t base_address, const char *tty_device);
+void acia_trace_dump(acia_t *acia, FILE *fh);
 
 #endif /* _ACIA_H */
@@ -1,27 +1,26 @@
 #include "console.h"
 #include <ctype.h>
 #include <curses.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "mem.h"
-#include "panic.h"
+#include "sched.h"
 #include "w65c02.h"
 #ifdef HIRES_GUI_WINDOW
 #include "gui.h"
 #endif /* HIRES_GUI_WINDOW */
 
-typedef enum {
-  CONSOLE_DRAW_UNKNOWN,
-  CONSOLE_DRAW_TEXT_80_COLUMN,
-  CONSOLE_DRAW_TEXT_40_COLUMN,
-  CONSOLE_DRAW_HIRES_DOUBLE,
-  CONSOLE_DRAW_HIRES_80_COLUMN,
-  CONSOLE_DRAW_HIRES_40_COLUMN,
-  CONSOLE_DRAW_LORES_DOUBLE,
-  CONSOLE_DRAW_LORES_80_COLUMN,
-  CONSOLE_DRAW_LORES_40_COLUMN,
-} console_draw_t;
+#define CONSOLE_FRAME_CYCLES 17030 /* NTSC, 262 lines of 65 cycles. */
+#define CONSOLE_VBL_CYCLES 12480 /* Into the frame, after 192 visible lines. */
+#define CONSOLE_POLL_NS 10000000 /* Keyboard polling when the screen is idle. */
+#define CONSOLE_FRAME_NS 16647000 /* 17030 cycles at 1.023 MHz. */
+#define CONSOLE_FRAME_SKIP_MAX 5 /* Show at least every 6th frame, 10 FPS. */
 
 /* Using colors from the default xterm/rxvt 256 color palette. */
 static const int console_color_map[16][2] = {
@@ -95,59 +94,77 @@ static const uint8_t console_alternate_char_set[256] = {
 
 
 
-static uint8_t console_key = 0;
-static bool console_open_apple   = false;
-static bool console_solid_apple  = false;
-static bool console_80_40_switch = false;
-static bool console_mouse_button = false;
+/* Set the VBL interrupt flag at the start of each vertical blank, if the
+   interrupt is enabled in the IOU. */
+static void console_vbl(void *console, uint64_t now)
+{
+  uint64_t next;
+
+  if (((console_t *)console)->mem->iou_vbl_mask) {
+    ((console_t *)console)->vbl_flag = true;
+  }
+
+  next = now - (now % CONSOLE_FRAME_CYCLES) + CONSOLE_VBL_CYCLES;
+  if (next <= now) {
+    next += CONSOLE_FRAME_CYCLES;
+  }
+  sched_add(((console_t *)console)->sched, &((console_t *)console)->vbl,
+    next);
+}
 
 
 
-static void console_io_write(void* dummy, uint16_t address, uint8_t value)
+static void console_io_write(void *console, uint16_t address, uint8_t value)
 {
-  (void)dummy;
   (void)value;
 
   switch (address) {
   case 0xC010:
-    console_key &= ~0x80; /* Clear keyboard strobe. */
+    ((console_t *)console)->key &= ~0x80; /* Clear keyboard strobe. */
+    break;
+
+  case 0xC070:
+    ((console_t *)console)->vbl_flag = false;
     break;
   }
 }
 
 
 
-static uint8_t console_io_read(void *dummy, uint16_t address)
+static uint8_t console_io_read(void *console, uint16_t address)
 {
-  (void)dummy;
-
   switch (address) {
   case 0xC000:
-    return console_key;
+    return ((console_t *)console)->key;
 
   case 0xC010:
-    if (console_key & 0x80) {
-      console_key &= ~0x80; /* Clear keyboard strobe. */
+    if (((console_t *)console)->key & 0x80) {
+      ((console_t *)console)->key &= ~0x80; /* Clear keyboard strobe. */
       return 0x80;
     } else {
       return 0x00;
     }
 
   case 0xC019:
-    /* NOTE: Reset of Vertical Blanking Interrupt not implemented. */
-    return 0;
+    /* The IIc has the VBL interrupt flag here, not the VBL signal. */
+    return ((console_t *)console)->vbl_flag << 7;
 
   case 0xC060:
-    return console_80_40_switch << 7;
+    return ((console_t *)console)->switch_80_40 << 7;
 
   case 0xC061:
-    return console_open_apple << 7;
+    return ((console_t *)console)->open_apple << 7;
 
   case 0xC062:
-    return console_solid_apple << 7;
+    return ((console_t *)console)->solid_apple << 7;
 
   case 0xC063:
-    return !console_mouse_button << 7; /* Button NOT pressed. */
+    /* Button NOT pressed. */
+    return !((console_t *)console)->mouse_button << 7;
+
+  case 0xC070:
+    ((console_t *)console)->vbl_flag = false;
+    return 0;
 
   default:
     return 0;
@@ -156,135 +173,162 @@ static uint8_t console_io_read(void *dummy, uint16_t address)
 
 
 
-void console_pause(void)
+/* Park the render thread and hand the terminal to the debugger. */
+void console_pause(console_t *console)
 {
+  pthread_mutex_lock(&console->mutex);
+  console->paused = true;
+  pthread_cond_broadcast(&console->cond);
+  while (console->running && ! console->parked) {
+    pthread_cond_wait(&console->cond, &console->mutex);
+  }
+  pthread_mutex_unlock(&console->mutex);
+
   endwin();
   timeout(-1);
 }
 
 
 
-void console_resume(void)
+void console_resume(console_t *console)
 {
   timeout(0);
   refresh();
+
+  pthread_mutex_lock(&console->mutex);
+  console->paused = false;
+  pthread_cond_broadcast(&console->cond);
+  pthread_mutex_unlock(&console->mutex);
 }
 
 
 
-void console_exit(void)
+void console_exit(console_t *console)
 {
+  if (! console->running) {
+    return; /* Never started, or already stopped. */
+  }
+
+  pthread_mutex_lock(&console->mutex);
+  console->stop = true;
+  pthread_cond_broadcast(&console->cond);
+  pthread_mutex_unlock(&console->mutex);
+  pthread_join(console->thread, NULL);
+  console->running = false;
+  pthread_mutex_destroy(&console->mutex);
+  pthread_cond_destroy(&console->cond);
+
   curs_set(1);
   endwin();
 }
 
 
 
-int console_init(mem_t *mem, bool gui_enable)
+static void console_put(console_t *console, int row, int col, chtype ch)
 {
-  (void)gui_enable;
-  int color_no;
-
-#ifdef HIRES_GUI_WINDOW
-  if (gui_enable) {
-    if (gui_init() != 0) {
-      return -1;
-    }
+  if (row < CONSOLE_ROWS && col < CONSOLE_COLS) {
+    console->cell[row][col] = ch;
   }
-#endif /* HIRES_GUI_WINDOW */
+}
 
-  initscr();
-  atexit(console_exit);
-  noecho();
-  keypad(stdscr, TRUE);
-  timeout(0);
-  curs_set(0);
 
-  if (has_colors() && can_change_color()) {
-    start_color();
-    use_default_colors();
-    for (color_no = 0; color_no < 16; color_no++) {
-      init_pair(color_no + 1,
-        console_color_map[color_no][1],
-        console_color_map[color_no][0]);
+
+/* Set all cells to blank, as curses has them after clear(). */
+static void console_blank(console_t *console)
+{
+  int row;
+  int col;
+
+  for (row = 0; row < CONSOLE_ROWS; row++) {
+    for (col = 0; col < CONSOLE_COLS; col++) {
+      console->cell[row][col] = ' ';
+      console->shown[row][col] = ' ';
     }
   }
+}
 
-  mem->io_read[0x00].func = console_io_read;
-  mem->io_read[0x10].func = console_io_read;
-  mem->io_read[0x19].func = console_io_read;
-  mem->io_read[0x60].func = console_io_read;
-  mem->io_read[0x61].func = console_io_read;
-  mem->io_read[0x62].func = console_io_read;
-  mem->io_read[0x63].func = console_io_read;
-  mem->io_write[0x10].func = console_io_write;
 
-  return 0;
+
+/* Send the changed spans of each row to curses, with the attributes of
+   each cell included so runs of them need no attron() and attroff(). */
+static void console_flush(console_t *console)
+{
+  int row;
+  int col;
+  int start;
+
+  for (row = 0; row < CONSOLE_ROWS; row++) {
+    col = 0;
+    while (col < CONSOLE_COLS) {
+      if (console->cell[row][col] == console->shown[row][col]) {
+        col++;
+        continue;
+      }
+      start = col;
+      while (col < CONSOLE_COLS &&
+        console->cell[row][col] != console->shown[row][col]) {
+        console->shown[row][col] = console->cell[row][col];
+        col++;
+      }
+      mvaddchnstr(row, start, &console->cell[row][start], col - start);
+    }
+  }
 }
 
 
 
-static void console_draw_text(mem_t *mem, int row, int col, uint8_t c)
+static void console_draw_text(console_t *console, int row, int col,
+  uint8_t c)
 {
   bool reverse = false;
 
   reverse = (c >> 7) == 0;
 
-  if (mem->video_alt_char_set) {
+  if (console->front.video_alt_char_set) {
     if (c >= 0x40 && c <= 0x5F) {
       reverse = false; /* Disable for MouseText characters. */
     }
-    if (reverse) {
-      attron(A_REVERSE);
-    }
-    mvaddch(row, col, console_alternate_char_set[c]);
-    if (reverse) {
-      attroff(A_REVERSE);
-    }
+    console_put(console, row, col, console_alternate_char_set[c] |
+      (reverse ? A_REVERSE : A_NORMAL));
 
   } else {
-    if (reverse) {
-      attron(A_REVERSE);
-    }
-    mvaddch(row, col, console_primary_char_set[c]);
-    if (reverse) {
-      attroff(A_REVERSE);
-    }
+    console_put(console, row, col, console_primary_char_set[c] |
+      (reverse ? A_REVERSE : A_NORMAL));
   }
 }
 
 
 
-static void console_draw_lores_pixel(int row, int col, int color)
+static void console_draw_lores_pixel(console_t *console, int row, int col,
+  int color)
 {
   if (has_colors() && can_change_color()) {
-    attron(COLOR_PAIR(color + 1));
-    mvaddch(row, col, ' ');
-    attroff(COLOR_PAIR(color + 1));
+    console_put(console, row, col, ' ' | COLOR_PAIR(color + 1));
 
   } else {
     if (color > 0) {
-      mvaddch(row, col, '#'); /* Any color. */
+      console_put(console, row, col, '#'); /* Any color. */
     } else {
-      mvaddch(row, col, ' '); /* Just black. */
+      console_put(console, row, col, ' '); /* Just black. */
     }
   }
 }
 
 
 
-static void console_draw_hires_pixels(int row, int col, uint8_t byte)
+static void console_draw_hires_pixels(console_t *console, int row, int col,
+  uint8_t byte)
 {
   /* Truncate the output to 192/4=48 rows and 280/4=70 columns. */
   if ((byte & 0x0F) > 0) {
-    mvaddch(row / 4, (col / 4), '#');
+    console_put(console, row / 4, (col / 4), '#');
   } else {
-    mvaddch(row / 4, (col / 4), ' ');
+    console_put(console, row / 4, (col / 4), ' ');
   }
   if ((byte & 0x70) > 0) {
-    mvaddch(row / 4, (col / 4) + 1, '#');
+    console_put(console, row / 4, (col / 4) + 1, '#');
   } else {
-    mvaddch(row / 4, (col / 4) + 1, ' ');
+    console_put(console, row / 4, (col / 4) + 1, ' ');
   }
 
 #ifdef HIRES_GUI_WINDOW
@@ -298,13 +342,14 @@ static void console_draw_hires_pixels(int row, int col, uint8_t byte)
 
 
 
-static void console_draw_double_hires_pixels(int row, int col, uint8_t byte)
+static void console_draw_double_hires_pixels(console_t *console, int row,
+  int col, uint8_t byte)
 {
   /* Truncate the output to 192/4=48 rows and 560/8=70 columns. */
   if ((byte & 0x7F) > 0) {
-    mvaddch(row / 4, (col / 8), '#');
+    console_put(console, row / 4, (col / 8), '#');
   } else {
-    mvaddch(row / 4, (col / 8), ' ');
+    console_put(console, row / 4, (col / 8), ' ');
   }
 
 #ifdef HIRES_GUI_WINDOW
@@ -317,38 +362,48 @@ static void console_draw_double_hires_pixels(int row, int col, uint8_t byte)
 
 
 
-static void console_draw_text_40_column(mem_t *mem)
+static void console_draw_text_40_column(console_t *console,
+  const bool dirty[24])
 {
+  console_frame_t *frame = &console->front;
   uint16_t address;
   int row;
   int col;
 
   for (row = 0; row < 24; row++) {
+    if (! dirty[row]) {
+      continue;
+    }
     for (col = 0; col < 40; col++) {
       address = console_row_address_map[row] + col;
-      if (mem->page2 == true) {
+      if (frame->page2 == true) {
         address += 0x400;
       }
-      console_draw_text(mem, row, col, mem->main[address]);
+      console_draw_text(console, row, col, frame->main[address]);
     }
   }
 }
 
 
 
-static void console_draw_text_80_column(mem_t *mem)
+static void console_draw_text_80_column(console_t *console,
+  const bool dirty[24])
 {
+  console_frame_t *frame = &console->front;
   uint16_t address;
   int row;
   int col;
 
   for (row = 0; row < 24; row++) {
+    if (! dirty[row]) {
+      continue;
+    }
     for (col = 0; col < 80; col++) {
       address = console_row_address_map[row] + (col / 2);
       if (col % 2 == 0) {
-        console_draw_text(mem, row, col, mem->aux[address]);
+        console_draw_text(console, row, col, frame->aux[address]);
       } else {
-        console_draw_text(mem, row, col, mem->main[address]);
+        console_draw_text(console, row, col, frame->main[address]);
       }
     }
   }
@@ -356,23 +411,30 @@ static void console_draw_text_80_column(mem_t *mem)
 
 
 
-static void console_draw_lores_40_column(mem_t *mem)
+static void console_draw_lores_40_column(console_t *console,
+  const bool dirty[24])
 {
+  console_frame_t *frame = &console->front;
   uint16_t address;
   int row;
   int col;
 
   for (row = 0; row < 24; row++) {
+    if (! dirty[row]) {
+      continue;
+    }
     for (col = 0; col < 40; col++) {
       address = console_row_address_map[row] + col;
-      if (mem->page2 == true) {
+      if (frame->page2 == true) {
         address += 0x400;
       }
-      if (row >= 20 && mem->video_mixed_mode) {
-        console_draw_text(mem, row + 20, col, mem->main[address]);
+      if (row >= 20 && frame->video_mixed_mode) {
+        console_draw_text(console, row + 20, col, frame->main[address]);
       } else {
-        console_draw_lores_pixel((row * 2), col, mem->main[address] % 0x10);
-        console_draw_lores_pixel((row * 2) + 1, col, mem->main[address] / 0x10);
+        console_draw_lores_pixel(console, (row * 2), col,
+          frame->main[address] % 0x10);
+        console_draw_lores_pixel(console, (row * 2) + 1, col,
+          frame->main[address] / 0x10);
       }
     }
   }
@@ -380,25 +442,32 @@ static void console_draw_lores_40_column(mem_t *mem)
 
 
 
-static void console_draw_lores_80_column(mem_t *mem)
+static void console_draw_lores_80_column(console_t *console,
+  const bool dirty[24])
 {
+  console_frame_t *frame = &console->front;
   uint16_t address;
   int row;
   int col;
 
   for (row = 0; row < 24; row++) {
+    if (! dirty[row]) {
+      continue;
+    }
     for (col = 0; col < 80; col++) {
       address = console_row_address_map[row] + (col / 2);
-      if (row >= 20 && mem->video_mixed_mode) {
+      if (row >= 20 && frame->video_mixed_mode) {
         if (col % 2 == 0) {
-          console_draw_text(mem, row + 20, col, mem->aux[address]);
+          console_draw_text(console, row + 20, col, frame->aux[address]);
         } else {
-          console_draw_text(mem, row + 20, col, mem->main[address]);
+          console_draw_text(console, row + 20, col, frame->main[address]);
         }
       } else {
         /* The pixels are repeated/doubled in width in this mode. */
-        console_draw_lores_pixel((row * 2), col, mem->main[address] % 0x10);
-        console_draw_lores_pixel((row * 2) + 1, col, mem->main[address] / 0x10);
+        console_draw_lores_pixel(console, (row * 2), col,
+          frame->main[address] % 0x10);
+        console_draw_lores_pixel(console, (row * 2) + 1, col,
+          frame->main[address] / 0x10);
       }
     }
   }
@@ -406,41 +475,46 @@ static void console_draw_lores_80_column(mem_t *mem)
 
 
 
-static void console_draw_hires_40_column(mem_t *mem)
+static void console_draw_hires_40_column(console_t *console,
+  const bool dirty[24])
 {
+  console_frame_t *frame = &console->front;
   uint16_t address;
   int row;
   int col;
 
   for (row = 0; row < 24; row++) {
+    if (! dirty[row]) {
+      continue;
+    }
     for (col = 0; col < 40; col++) {
-      if (row >= 20 && mem->video_mixed_mode) {
+      if (row >= 20 && frame->video_mixed_mode) {
         address = console_row_address_map[row] + col;
-        if (mem->page2 == true) {
+        if (frame->page2 == true) {
           address += 0x400;
         }
-        console_draw_text(mem, row + 20, col, mem->main[address]);
+        console_draw_text(console, row + 20, col, frame->main[address]);
       } else {
         address = console_hires_row_address_map[row] + col;
-        if (mem->page2 == true) {
+        if (frame->page2 == true) {
           address += 0x2000;
         }
-        console_draw_hires_pixels((row * 8),     (col * 7),
-          mem->main[address]);
-        console_draw_hires_pixels((row * 8) + 1, (col * 7),
-          mem->main[address + 0x0400]);
-        console_draw_hires_pixels((row * 8) + 2, (col * 7),
-          mem->main[address + 0x0800]);
-        console_draw_hires_pixels((row * 8) + 3, (col * 7),
-          mem->main[address + 0x0C00]);
-        console_draw_hires_pixels((row * 8) + 4, (col * 7),
-          mem->main[address + 0x1000]);
-        console_draw_hires_pixels((row * 8) + 5, (col * 7),
-          mem->main[address + 0x1400]);
-        console_draw_hires_pixels((row * 8) + 6, (col * 7),
-          mem->main[address + 0x1800]);
-        console_draw_hires_pixels((row * 8) + 7, (col * 7),
-          mem->main[address + 0x1C00]);
+        console_draw_hires_pixels(console, (row * 8),     (col * 7),
+          frame->main[address]);
+        console_draw_hires_pixels(console, (row * 8) + 1, (col * 7),
+          frame->main[address + 0x0400]);
+        console_draw_hires_pixels(console, (row * 8) + 2, (col * 7),
+          frame->main[address + 0x0800]);
+        console_draw_hires_pixels(console, (row * 8) + 3, (col * 7),
+          frame->main[address + 0x0C00]);
+        console_draw_hires_pixels(console, (row * 8) + 4, (col * 7),
+          frame->main[address + 0x1000]);
+        console_draw_hires_pixels(console, (row * 8) + 5, (col * 7),
+          frame->main[address + 0x1400]);
+        console_draw_hires_pixels(console, (row * 8) + 6, (col * 7),
+          frame->main[address + 0x1800]);
+        console_draw_hires_pixels(console, (row * 8) + 7, (col * 7),
+          frame->main[address + 0x1C00]);
       }
     }
   }
@@ -448,40 +522,45 @@ static void console_draw_hires_40_column(mem_t *mem)
 
 
 
-static void console_draw_hires_80_column(mem_t *mem)
+static void console_draw_hires_80_column(console_t *console,
+  const bool dirty[24])
 {
+  console_frame_t *frame = &console->front;
   uint16_t address;
   int row;
   int col;
 
   for (row = 0; row < 24; row++) {
+    if (! dirty[row]) {
+      continue;
+    }
     for (col = 0; col < 80; col++) {
-      if (row >= 20 && mem->video_mixed_mode) {
+      if (row >= 20 && frame->video_mixed_mode) {
         address = console_row_address_map[row] + (col / 2);
         if (col % 2 == 0) {
-          console_draw_text(mem, row + 20, col, mem->aux[address]);
+          console_draw_text(console, row + 20, col, frame->aux[address]);
         } else {
-          console_draw_text(mem, row + 20, col, mem->main[address]);
+          console_draw_text(console, row + 20, col, frame->main[address]);
         }
       } else {
         if (col % 2 == 0) {
           address = console_hires_row_address_map[row] + (col / 2);
-          console_draw_hires_pixels((row * 8),     ((col / 2) * 7),
-            mem->main[address]);
-          console_draw_hires_pixels((row * 8) + 1, ((col / 2) * 7),
-            mem->main[address + 0x0400]);
-          console_draw_hires_pixels((row * 8) + 2, ((col / 2) * 7),
-            mem->main[address + 0x0800]);
-          console_draw_hires_pixels((row * 8) + 3, ((col / 2) * 7),
-            mem->main[address + 0x0C00]);
-          console_draw_hires_pixels((row * 8) + 4, ((col / 2) * 7),
-            mem->main[address + 0x1000]);
-          console_draw_hires_pixels((row * 8) + 5, ((col / 2) * 7),
-            mem->main[address + 0x1400]);
-          console_draw_hires_pixels((row * 8) + 6, ((col / 2) * 7),
-            mem->main[address + 0x1800]);
-          console_draw_hires_pixels((row * 8) + 7, ((col / 2) * 7),
-            mem->main[address + 0x1C00]);
+          console_draw_hires_pixels(console, (row * 8),     ((col / 2) * 7),
+            frame->main[address]);
+          console_draw_hires_pixels(console, (row * 8) + 1, ((col / 2) * 7),
+            frame->main[address + 0x0400]);
+          console_draw_hires_pixels(console, (row * 8) + 2, ((col / 2) * 7),
+            frame->main[address + 0x0800]);
+          console_draw_hires_pixels(console, (row * 8) + 3, ((col / 2) * 7),
+            frame->main[address + 0x0C00]);
+          console_draw_hires_pixels(console, (row * 8) + 4, ((col / 2) * 7),
+            frame->main[address + 0x1000]);
+          console_draw_hires_pixels(console, (row * 8) + 5, ((col / 2) * 7),
+            frame->main[address + 0x1400]);
+          console_draw_hires_pixels(console, (row * 8) + 6, ((col / 2) * 7),
+            frame->main[address + 0x1800]);
+          console_draw_hires_pixels(console, (row * 8) + 7, ((col / 2) * 7),
+            frame->main[address + 0x1C00]);
         }
       }
     }
@@ -490,32 +569,37 @@ static void console_draw_hires_80_column(mem_t *mem)
 
 
 
-static void console_draw_lores_double(mem_t *mem)
+static void console_draw_lores_double(console_t *console,
+  const bool dirty[24])
 {
+  console_frame_t *frame = &console->front;
   uint16_t address;
   int row;
   int col;
 
   for (row = 0; row < 24; row++) {
+    if (! dirty[row]) {
+      continue;
+    }
     for (col = 0; col < 80; col++) {
       address = console_row_address_map[row] + (col / 2);
-      if (row >= 20 && mem->video_mixed_mode) {
+      if (row >= 20 && frame->video_mixed_mode) {
         if (col % 2 == 0) {
-          console_draw_text(mem, row + 20, col, mem->aux[address]);
+          console_draw_text(console, row + 20, col, frame->aux[address]);
         } else {
-          console_draw_text(mem, row + 20, col, mem->main[address]);
+          console_draw_text(console, row + 20, col, frame->main[address]);
         }
       } else {
         if (col % 2 == 0) {
-          console_draw_lores_pixel((row * 2), col,
-            mem->aux[address] % 0x10);
-          console_draw_lores_pixel((row * 2) + 1, col,
-            mem->aux[address] / 0x10);
+          console_draw_lores_pixel(console, (row * 2), col,
+            frame->aux[address] % 0x10);
+          console_draw_lores_pixel(console, (row * 2) + 1, col,
+            frame->aux[address] / 0x10);
         } else {
-          console_draw_lores_pixel((row * 2), col,
-            mem->main[address] % 0x10);
-          console_draw_lores_pixel((row * 2) + 1, col,
-            mem->main[address] / 0x10);
+          console_draw_lores_pixel(console, (row * 2), col,
+            frame->main[address] % 0x10);
+          console_draw_lores_pixel(console, (row * 2) + 1, col,
+            frame->main[address] / 0x10);
         }
       }
     }
@@ -524,57 +608,62 @@ static void console_draw_lores_double(mem_t *mem)
 
 
 
-static void console_draw_hires_double(mem_t *mem)
+static void console_draw_hires_double(console_t *console,
+  const bool dirty[24])
 {
+  console_frame_t *frame = &console->front;
   uint16_t address;
   int row;
   int col;
 
   for (row = 0; row < 24; row++) {
+    if (! dirty[row]) {
+      continue;
+    }
     for (col = 0; col < 80; col++) {
       address = console_row_address_map[row] + (col / 2);
-      if (row >= 20 && mem->video_mixed_mode) {
+      if (row >= 20 && frame->video_mixed_mode) {
         if (col % 2 == 0) {
-          console_draw_text(mem, row + 20, col, mem->aux[address]);
+          console_draw_text(console, row + 20, col, frame->aux[address]);
         } else {
-          console_draw_text(mem, row + 20, col, mem->main[address]);
+          console_draw_text(console, row + 20, col, frame->main[address]);
         }
       } else {
         address = console_hires_row_address_map[row] + (col / 2);
         if (col % 2 == 0) {
-          console_draw_double_hires_pixels((row * 8),     (col * 7),
-            mem->aux[address]);
-          console_draw_double_hires_pixels((row * 8) + 1, (col * 7),
-            mem->aux[address + 0x0400]);
-          console_draw_double_hires_pixels((row * 8) + 2, (col * 7),
-            mem->aux[address + 0x0800]);
-          console_draw_double_hires_pixels((row * 8) + 3, (col * 7),
-            mem->aux[address + 0x0C00]);
-          console_draw_double_hires_pixels((row * 8) + 4, (col * 7),
-            mem->aux[address + 0x1000]);
-          console_draw_double_hires_pixels((row * 8) + 5, (col * 7),
-            mem->aux[address + 0x1400]);
-          console_draw_double_hires_pixels((row * 8) + 6, (col * 7),
-            mem->aux[address + 0x1800]);
-          console_draw_double_hires_pixels((row * 8) + 7, (col * 7),
-            mem->aux[address + 0x1C00]);
+          console_draw_double_hires_pixels(console, (row * 8),     (col * 7),
+            frame->aux[address]);
+          console_draw_double_hires_pixels(console, (row * 8) + 1, (col * 7),
+            frame->aux[address + 0x0400]);
+          console_draw_double_hires_pixels(console, (row * 8) + 2, (col * 7),
+            frame->aux[address + 0x0800]);
+          console_draw_double_hires_pixels(console, (row * 8) + 3, (col * 7),
+            frame->aux[address + 0x0C00]);
+          console_draw_double_hires_pixels(console, (row * 8) + 4, (col * 7),
+            frame->aux[address + 0x1000]);
+          console_draw_double_hires_pixels(console, (row * 8) + 5, (col * 7),
+            frame->aux[address + 0x1400]);
+          console_draw_double_hires_pixels(console, (row * 8) + 6, (col * 7),
+            frame->aux[address + 0x1800]);
+          console_draw_double_hires_pixels(console, (row * 8) + 7, (col * 7),
+            frame->aux[address + 0x1C00]);
         } else {
-          console_draw_double_hires_pixels((row * 8),     (col * 7),
-            mem->main[address]);
-          console_draw_double_hires_pixels((row * 8) + 1, (col * 7),
-            mem->main[address + 0x0400]);
-          console_draw_double_hires_pixels((row * 8) + 2, (col * 7),
-            mem->main[address + 0x0800]);
-          console_draw_double_hires_pixels((row * 8) + 3, (col * 7),
-            mem->main[address + 0x0C00]);
-          console_draw_double_hires_pixels((row * 8) + 4, (col * 7),
-            mem->main[address + 0x1000]);
-          console_draw_double_hires_pixels((row * 8) + 5, (col * 7),
-            mem->main[address + 0x1400]);
-          console_draw_double_hires_pixels((row * 8) + 6, (col * 7),
-            mem->main[address + 0x1800]);
-          console_draw_double_hires_pixels((row * 8) + 7, (col * 7),
-            mem->main[address + 0x1C00]);
+          console_draw_double_hires_pixels(console, (row * 8),     (col * 7),
+            frame->main[address]);
+          console_draw_double_hires_pixels(console, (row * 8) + 1, (col * 7),
+            frame->main[address + 0x0400]);
+          console_draw_double_hires_pixels(console, (row * 8) + 2, (col * 7),
+            frame->main[address + 0x0800]);
+          console_draw_double_hires_pixels(console, (row * 8) + 3, (col * 7),
+            frame->main[address + 0x0C00]);
+          console_draw_double_hires_pixels(console, (row * 8) + 4, (col * 7),
+            frame->main[address + 0x1000]);
+          console_draw_double_hires_pixels(console, (row * 8) + 5, (col * 7),
+            frame->main[address + 0x1400]);
+          console_draw_double_hires_pixels(console, (row * 8) + 6, (col * 7),
+            frame->main[address + 0x1800]);
+          console_draw_double_hires_pixels(console, (row * 8) + 7, (col * 7),
+            frame->main[address + 0x1C00]);
         }
       }
     }
@@ -583,18 +672,66 @@ static void console_draw_hires_double(mem_t *mem)
 
 
 
-static console_draw_t console_draw_mode(mem_t* mem)
+static bool console_page_dirty(console_frame_t *frame, uint16_t address)
+{
+  return frame->dirty[0][address >> 8] || frame->dirty[1][address >> 8];
+}
+
+
+
+/* Find the rows with video memory written since the last draw, on either
+   page and in either bank, or all of them. Returns false if there are
+   none, so the frame can be skipped. */
+static bool console_rows_dirty(console_frame_t *frame, bool all, bool dirty[24])
+{
+  uint16_t address;
+  bool any = false;
+  int row;
+  int line;
+
+  for (row = 0; row < 24; row++) {
+    dirty[row] = all;
+    if (frame->video_text_mode || ! frame->hires ||
+        (row >= 20 && frame->video_mixed_mode)) {
+      address = console_row_address_map[row];
+      dirty[row] |= console_page_dirty(frame, address) ||
+                    console_page_dirty(frame, address + 0x400);
+    } else {
+      for (line = 0; line < 8; line++) {
+        address = console_hires_row_address_map[row] + (line * 0x400);
+        dirty[row] |= console_page_dirty(frame, address) ||
+                      console_page_dirty(frame, address + 0x2000);
+      }
+    }
+    any |= dirty[row];
+  }
+
+  return any;
+}
+
+
+
+static uint8_t console_video_switches(console_frame_t *frame)
 {
-  if (mem->video_text_mode) {
-    if (mem->video_80_column) {
+  return frame->video_80_column << 0 | frame->video_text_mode << 1 |
+         frame->video_mixed_mode << 2 | frame->video_alt_char_set << 3 |
+         frame->page2 << 4 | frame->hires << 5 | frame->iou_dhires << 6;
+}
+
+
+
+static console_draw_t console_draw_mode(console_frame_t *frame)
+{
+  if (frame->video_text_mode) {
+    if (frame->video_80_column) {
       return CONSOLE_DRAW_TEXT_80_COLUMN;
     } else {
       return CONSOLE_DRAW_TEXT_40_COLUMN;
     }
   } else { /* Graphics */
-    if (mem->hires) { /* HiRes */
-      if (mem->video_80_column) {
-        if (mem->iou_dhires) { /* Double HiRes */
+    if (frame->hires) { /* HiRes */
+      if (frame->video_80_column) {
+        if (frame->iou_dhires) { /* Double HiRes */
           return CONSOLE_DRAW_HIRES_DOUBLE;
         } else {
           return CONSOLE_DRAW_HIRES_80_COLUMN;
@@ -603,8 +740,8 @@ static console_draw_t console_draw_mode(mem_t* mem)
         return CONSOLE_DRAW_HIRES_40_COLUMN;
       }
     } else { /* LoRes */
-      if (mem->video_80_column) {
-        if (mem->iou_dhires) { /* Double LoRes */
+      if (frame->video_80_column) {
+        if (frame->iou_dhires) { /* Double LoRes */
           return CONSOLE_DRAW_LORES_DOUBLE;
         } else {
           return CONSOLE_DRAW_LORES_80_COLUMN;
@@ -618,83 +755,332 @@ static console_draw_t console_draw_mode(mem_t* mem)
 
 
 
-void console_execute(w65c02_t *cpu, mem_t *mem)
+/* Draw the rows of the front frame with changes since the last call, or
+   all of them after a video mode or soft switch change. */
+static void console_output(console_t *console)
 {
-  static int cycle = 0;
-  static console_draw_t last_draw = CONSOLE_DRAW_UNKNOWN;
+  console_frame_t *frame = &console->front;
   console_draw_t next_draw;
-  int c;
-
-  /* Only run every X cycle. */
-  cycle++;
-  if (cycle % 10000 != 0) {
-    return;
-  }
+  bool dirty[24];
 
-  /* Output */
-  next_draw = console_draw_mode(mem);
-  if (next_draw != last_draw) {
+  next_draw = console_draw_mode(frame);
+  if (next_draw != console->last_draw) {
     clear(); /* Clear the screen to avoid garbage if there is a resizing. */
+    console_blank(console);
   }
+  if (! console_rows_dirty(frame, next_draw != console->last_draw ||
+    console_video_switches(frame) != console->last_switches, dirty)) {
+    return; /* Nothing changed. */
+  }
+  console->last_switches = console_video_switches(frame);
   switch (next_draw) {
   case CONSOLE_DRAW_TEXT_80_COLUMN:
-    console_draw_text_80_column(mem);
+    console_draw_text_80_column(console, dirty);
     break;
   case CONSOLE_DRAW_TEXT_40_COLUMN:
-    console_draw_text_40_column(mem);
+    console_draw_text_40_column(console, dirty);
     break;
   case CONSOLE_DRAW_HIRES_DOUBLE:
-    console_draw_hires_double(mem);
+    console_draw_hires_double(console, dirty);
     break;
   case CONSOLE_DRAW_HIRES_80_COLUMN:
-    console_draw_hires_80_column(mem);
+    console_draw_hires_80_column(console, dirty);
     break;
   case CONSOLE_DRAW_HIRES_40_COLUMN:
-    console_draw_hires_40_column(mem);
+    console_draw_hires_40_column(console, dirty);
     break;
   case CONSOLE_DRAW_LORES_DOUBLE:
-    console_draw_lores_double(mem);
+    console_draw_lores_double(console, dirty);
     break;
   case CONSOLE_DRAW_LORES_80_COLUMN:
-    console_draw_lores_80_column(mem);
+    console_draw_lores_80_column(console, dirty);
     break;
   case CONSOLE_DRAW_LORES_40_COLUMN:
-    console_draw_lores_40_column(mem);
+    console_draw_lores_40_column(console, dirty);
     break;
   case CONSOLE_DRAW_UNKNOWN:
   default:
     break;
   }
-  last_draw = next_draw;
+  console->last_draw = next_draw;
+  memset(frame->dirty, 0, sizeof(frame->dirty));
+  console_flush(console);
   refresh();
+}
+
+
+
+static bool console_video_page(int page)
+{
+  return (page >= 0x04 && page < 0x0C) || (page >= 0x20 && page < 0x60);
+}
+
+
+
+/* Copy the video memory written since the last call and the soft switches
+   to the back frame, on the CPU thread with the mutex held. */
+static void console_publish(console_t *console, mem_t *mem)
+{
+  console_frame_t *back = &console->back;
+  uint8_t switches;
+  bool written = false;
+  int page;
+
+  for (page = 0; page < (CONSOLE_VIDEO_END >> 8); page++) {
+    if (! console_video_page(page)) {
+      continue;
+    }
+    if (mem_video_dirty(mem, mem->main, page << 8)) {
+      memcpy(&back->main[page << 8], &mem->main[page << 8], 0x100);
+      back->dirty[0][page] = true;
+      written = true;
+    }
+    if (mem_video_dirty(mem, mem->aux, page << 8)) {
+      memcpy(&back->aux[page << 8], &mem->aux[page << 8], 0x100);
+      back->dirty[1][page] = true;
+      written = true;
+    }
+  }
+
+  switches = console_video_switches(back);
+  back->video_80_column    = mem->video_80_column;
+  back->video_text_mode    = mem->video_text_mode;
+  back->video_mixed_mode   = mem->video_mixed_mode;
+  back->video_alt_char_set = mem->video_alt_char_set;
+  back->page2              = mem->page2;
+  back->hires              = mem->hires;
+  back->iou_dhires         = mem->iou_dhires;
+
+  if (written || switches != console_video_switches(back)) {
+    if (console->back_ready) {
+      console->frames_skipped++; /* Not drawn yet, this one replaces it. */
+    }
+    console->back_ready = true;
+    mem_video_clean(mem);
+  }
+}
+
+
+
+/* Copy the back frame to the front frame, on the render thread with the
+   mutex held. */
+static void console_take(console_t *console)
+{
+  console_frame_t *back = &console->back;
+  console_frame_t *front = &console->front;
+  int page;
+
+  for (page = 0; page < (CONSOLE_VIDEO_END >> 8); page++) {
+    if (back->dirty[0][page]) {
+      memcpy(&front->main[page << 8], &back->main[page << 8],
+        0x100);
+      front->dirty[0][page] = true;
+    }
+    if (back->dirty[1][page]) {
+      memcpy(&front->aux[page << 8], &back->aux[page << 8],
+        0x100);
+      front->dirty[1][page] = true;
+    }
+  }
+  memset(back->dirty, 0, sizeof(back->dirty));
+
+  front->video_80_column    = back->video_80_column;
+  front->video_text_mode    = back->video_text_mode;
+  front->video_mixed_mode   = back->video_mixed_mode;
+  front->video_alt_char_set = back->video_alt_char_set;
+  front->page2              = back->page2;
+  front->hires              = back->hires;
+  front->iou_dhires         = back->iou_dhires;
+  console->back_ready = false;
+  console->frames_drawn_at = console->frames_published;
+  console->frames_shown++;
+}
+
+
+
+/* Adjust the frame skipping after drawing a frame, on the render thread
+   with the mutex held. When drawing takes longer than a frame lasts, the
+   frames published meanwhile are stale before they are drawn, so wait for
+   that many of them and only draw the last one. */
+static void console_pace(console_t *console, uint64_t draw_ns)
+{
+  console->draw_ns = (console->draw_ns * 7 + draw_ns) / 8;
+  if (draw_ns > CONSOLE_FRAME_NS) {
+    console->frames_late++;
+  }
+
+  console->frame_skip = console->draw_ns / CONSOLE_FRAME_NS;
+  if (console->frame_skip > CONSOLE_FRAME_SKIP_MAX) {
+    console->frame_skip = CONSOLE_FRAME_SKIP_MAX;
+  }
+  if (console->frame_skip > console->frame_skip_peak) {
+    console->frame_skip_peak = console->frame_skip;
+  }
+}
+
+
+
+static int console_screen_init(bool gui_enable)
+{
+  (void)gui_enable;
+  int color_no;
+
+#ifdef HIRES_GUI_WINDOW
+  if (gui_enable) {
+    if (gui_init() != 0) {
+      return -1;
+    }
+  }
+#endif /* HIRES_GUI_WINDOW */
+
+  initscr();
+  noecho();
+  keypad(stdscr, TRUE);
+  timeout(0);
+  curs_set(0);
+
+  if (has_colors() && can_change_color()) {
+    start_color();
+    use_default_colors();
+    for (color_no = 0; color_no < 16; color_no++) {
+      init_pair(color_no + 1,
+        console_color_map[color_no][1],
+        console_color_map[color_no][0]);
+    }
+  }
+
+  return 0;
+}
+
+
+
+/* Render thread, drawing new frames as they come and polling the keyboard
+   and the GUI window in between. */
+static void *console_render(void *arg)
+{
+  console_t *console = arg;
+  struct timespec deadline;
+  struct timespec start;
+  struct timespec end;
+  bool frame;
+  bool poll_key;
+  bool closed = false;
+  int c;
+
+  pthread_mutex_lock(&console->mutex);
+  console->started = (console_screen_init(console->gui_enable) == 0) ?
+    1 : -1;
+  pthread_cond_broadcast(&console->cond);
+
+  while (console->started == 1 && ! console->stop) {
+    if (console->paused) {
+      console->parked = true;
+      pthread_cond_broadcast(&console->cond);
+      pthread_cond_wait(&console->cond, &console->mutex);
+      continue;
+    }
+    console->parked = false;
+
+    frame = console->back_ready && console->frames_published -
+      console->frames_drawn_at > (uint64_t)console->frame_skip;
+    if (frame) {
+      console_take(console);
+    }
+    poll_key = (console->input == ERR);
+    pthread_mutex_unlock(&console->mutex);
+
+    if (frame) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      console_output(console);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+    }
+    c = (poll_key) ? getch() : ERR;
+#ifdef HIRES_GUI_WINDOW
+    closed = ! gui_execute();
+#endif /* HIRES_GUI_WINDOW */
+
+    pthread_mutex_lock(&console->mutex);
+    if (frame) {
+      console_pace(console, (end.tv_sec - start.tv_sec) * 1000000000ULL
+        + end.tv_nsec - start.tv_nsec);
+    }
+    if (c != ERR) {
+      console->input = c;
+    }
+    console->closed |= closed;
+    if (! frame && ! console->paused && ! console->stop) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += CONSOLE_POLL_NS;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&console->cond, &console->mutex, &deadline);
+    }
+  }
+  pthread_mutex_unlock(&console->mutex);
+
+  return NULL;
+}
+
+
+
+void console_execute(console_t *console, w65c02_t *cpu, mem_t *mem)
+{
+  uint64_t frame;
+  bool closed;
+  int c;
+
+  /* Only run once per frame, on the first call after it started. */
+  frame = cpu->cycle_count / CONSOLE_FRAME_CYCLES;
+  if (frame == console->last_frame) {
+    return;
+  }
+
+  /* Output and input, try again on the next call if the render thread is
+     busy with the frames. */
+  if (pthread_mutex_trylock(&console->mutex) != 0) {
+    return;
+  }
+  console->last_frame = frame;
+  console->frames_published++;
+  console_publish(console, mem);
+  c = console->input;
+  console->input = ERR;
+  closed = console->closed;
+  pthread_cond_broadcast(&console->cond);
+  pthread_mutex_unlock(&console->mutex);
+
+  if (closed) {
+    exit(EXIT_SUCCESS);
+  }
 
   /* Input */
-  c = getch();
   if (c != ERR) {
     switch (c) {
     case '\n':
     case KEY_ENTER:
-      console_key = 0x0D; /* Convert to CR. */
+      console->key = 0x0D; /* Convert to CR. */
       break;
 
     case KEY_UP:
-      console_key = 0x0B;
+      console->key = 0x0B;
       break;
 
     case KEY_DOWN:
-      console_key = 0x0A;
+      console->key = 0x0A;
       break;
 
     case KEY_RIGHT:
-      console_key = 0x15;
+      console->key = 0x15;
       break;
 
     case KEY_LEFT:
-      console_key = 0x08;
+      console->key = 0x08;
       break;
 
     case KEY_BACKSPACE:
-      console_key = 0x7F;
+      console->key = 0x7F;
       break;
 
     case KEY_F(1):
@@ -702,29 +1088,119 @@ void console_execute(w65c02_t *cpu, mem_t *mem)
       break;
 
     case KEY_F(2):
-      console_open_apple = !console_open_apple;
+      console->open_apple = !console->open_apple;
       break;
 
     case KEY_F(3):
-      console_solid_apple = !console_solid_apple;
+      console->solid_apple = !console->solid_apple;
       break;
 
     case KEY_F(4):
-      console_80_40_switch = !console_80_40_switch;
+      console->switch_80_40 = !console->switch_80_40;
       break;
 
     default:
-      console_key = c;
+      console->key = c;
       break;
     }
 
-    console_key |= 0x80;
+    console->key |= 0x80;
   }
+}
 
-#ifdef HIRES_GUI_WINDOW
-  gui_execute();
-#endif /* HIRES_GUI_WINDOW */
+
+
+void console_stats_dump(console_t *console, FILE *fh)
+{
+  uint64_t frames;
+
+  frames = console->frames_shown + console->frames_skipped;
+  fprintf(fh, "Video Frames:\n");
+  fprintf(fh, "  Shown     : %llu\n",
+    (unsigned long long)console->frames_shown);
+  fprintf(fh, "  Skipped   : %llu (%.1f%%)\n",
+    (unsigned long long)console->frames_skipped,
+    (frames > 0) ? console->frames_skipped * 100.0 / frames : 0.0);
+  fprintf(fh, "  Skip now  : %d (peak %d, max %d)\n",
+    console->frame_skip, console->frame_skip_peak, CONSOLE_FRAME_SKIP_MAX);
+  fprintf(fh, "  Late      : %llu frames drawn slower than real time\n",
+    (unsigned long long)console->frames_late);
+  fprintf(fh, "  Draw      : %llu us per frame\n",
+    (unsigned long long)console->draw_ns / 1000);
 }
 
 
 
+/* Level triggered, the interrupt handler has to reset the flag. */
+bool console_irq(console_t *console)
+{
+  return console->vbl_flag && console->mem->iou_vbl_mask;
+}
+
+
+
+int console_init(console_t *console, mem_t *mem, sched_t *sched,
+  bool gui_enable)
+{
+  sigset_t mask;
+  sigset_t old_mask;
+
+  memset(console, 0, sizeof(console_t));
+  console->last_draw = CONSOLE_DRAW_UNKNOWN;
+  console->gui_enable = gui_enable;
+  console->mem = mem;
+  console->sched = sched;
+  console->input = ERR;
+  pthread_mutex_init(&console->mutex, NULL);
+  pthread_cond_init(&console->cond, NULL);
+
+  /* Keep signals, like SIGALRM for the pacing, on the CPU thread. */
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  if (pthread_create(&console->thread, NULL, console_render, console) != 0) {
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    pthread_mutex_destroy(&console->mutex);
+    pthread_cond_destroy(&console->cond);
+    return -1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+  pthread_mutex_lock(&console->mutex);
+  while (console->started == 0) {
+    pthread_cond_wait(&console->cond, &console->mutex);
+  }
+  pthread_mutex_unlock(&console->mutex);
+  if (console->started != 1) {
+    pthread_join(console->thread, NULL);
+    pthread_mutex_destroy(&console->mutex);
+    pthread_cond_destroy(&console->cond);
+    return -1;
+  }
+  console->running = true;
+
+  mem->io_read[0x00].func = console_io_read;
+  mem->io_read[0x10].func = console_io_read;
+  mem->io_read[0x19].func = console_io_read;
+  mem->io_read[0x60].func = console_io_read;
+  mem->io_read[0x61].func = console_io_read;
+  mem->io_read[0x62].func = console_io_read;
+  mem->io_read[0x63].func = console_io_read;
+  mem->io_read[0x70].func = console_io_read;
+  mem->io_write[0x10].func = console_io_write;
+  mem->io_write[0x70].func = console_io_write;
+  mem->io_read[0x00].cookie = console;
+  mem->io_read[0x10].cookie = console;
+  mem->io_read[0x19].cookie = console;
+  mem->io_read[0x60].cookie = console;
+  mem->io_read[0x61].cookie = console;
+  mem->io_read[0x62].cookie = console;
+  mem->io_read[0x63].cookie = console;
+  mem->io_read[0x70].cookie = console;
+  mem->io_write[0x10].cookie = console;
+  mem->io_write[0x70].cookie = console;
+
+  sched_event_init(&console->vbl, console_vbl, console);
+  console_vbl(console, sched->now);
+
+  return 0;
+}
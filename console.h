@@ -1,14 +1,103 @@
 #ifndef _CONSOLE_H
 #define _CONSOLE_H
 
+#include <curses.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include "mem.h"
+#include "sched.h"
 #include "w65c02.h"
 
-void console_pause(void);
-void console_resume(void);
-void console_exit(void);
-int console_init(mem_t *mem, bool gui_enable);
-void console_execute(w65c02_t *cpu, mem_t *mem);
+#define CONSOLE_ROWS 48 /* Enough for LoRes and HiRes, text uses 24. */
+#define CONSOLE_COLS 80
+#define CONSOLE_VIDEO_END 0x6000 /* After HiRes page 2. */
+
+typedef enum {
+  CONSOLE_DRAW_UNKNOWN,
+  CONSOLE_DRAW_TEXT_80_COLUMN,
+  CONSOLE_DRAW_TEXT_40_COLUMN,
+  CONSOLE_DRAW_HIRES_DOUBLE,
+  CONSOLE_DRAW_HIRES_80_COLUMN,
+  CONSOLE_DRAW_HIRES_40_COLUMN,
+  CONSOLE_DRAW_LORES_DOUBLE,
+  CONSOLE_DRAW_LORES_80_COLUMN,
+  CONSOLE_DRAW_LORES_40_COLUMN,
+} console_draw_t;
+
+/* Snapshot of the video memory and soft switches, named like in mem_t. */
+typedef struct console_frame_s {
+  uint8_t main[CONSOLE_VIDEO_END];
+  uint8_t aux[CONSOLE_VIDEO_END];
+  bool dirty[2][CONSOLE_VIDEO_END >> 8]; /* Pages written, main and aux. */
+  bool video_80_column;
+  bool video_text_mode;
+  bool video_mixed_mode;
+  bool video_alt_char_set;
+  bool page2;
+  bool hires;
+  bool iou_dhires;
+} console_frame_t;
+
+typedef struct console_s {
+  uint8_t key;
+  bool open_apple;
+  bool solid_apple;
+  bool switch_80_40;
+  bool mouse_button;
+  bool gui_enable;
+
+  mem_t *mem;
+  sched_t *sched;
+  sched_event_t vbl; /* At the start of each vertical blank. */
+  bool vbl_flag;     /* VBL interrupt flag, reset through $C070. */
+
+  uint64_t last_frame;
+  uint64_t frames_published; /* Frames passed by the CPU thread. */
+  uint64_t frames_drawn_at;  /* Of those, when the last one was drawn. */
+  int frame_skip;     /* Frames dropped after each drawn frame. */
+  int frame_skip_peak;
+  uint64_t frames_shown;
+  uint64_t frames_skipped;
+  uint64_t frames_late; /* Took longer to draw than a frame lasts. */
+  uint64_t draw_ns;     /* Average time to draw a frame. */
+  console_draw_t last_draw;
+  uint8_t last_switches; /* Video soft switches of the last draw. */
+
+  /* Cells drawn for the next refresh, and the ones curses has already got,
+     so only the changes are sent to it. */
+  chtype cell[CONSOLE_ROWS][CONSOLE_COLS];
+  chtype shown[CONSOLE_ROWS][CONSOLE_COLS];
+
+  /* Drawing runs on its own thread, which does all curses and SDL calls.
+     The CPU thread copies the video memory written since the last time to
+     the back frame, and the render thread copies the back frame to the
+     front frame it draws from. The mutex is only held for the copying, and
+     the CPU thread skips its turn if it is taken, so it never waits for the
+     display. */
+  console_frame_t back;
+  console_frame_t front;
+  bool back_ready;
+  int input;    /* Key from the render thread. */
+  bool closed;  /* GUI window closed. */
+  int started;  /* 1 when running, -1 if it failed. */
+  bool paused;  /* Terminal handed to the debugger. */
+  bool parked;
+  bool stop;
+  bool running;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} console_t;
+
+void console_pause(console_t *console);
+void console_resume(console_t *console);
+void console_exit(console_t *console);
+int console_init(console_t *console, mem_t *mem, sched_t *sched,
+  bool gui_enable);
+void console_execute(console_t *console, w65c02_t *cpu, mem_t *mem);
+void console_stats_dump(console_t *console, FILE *fh);
+bool console_irq(console_t *console);
 
 #endif /* _CONSOLE_H */
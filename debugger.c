@@ -8,17 +8,13 @@
 #include "acia.h"
 #include "console.h"
 #include "iwm.h"
+#include "machine.h"
 #include "mem.h"
-#include "panic.h"
 #include "w65c02.h"
 #include "w65c02_trace.h"
 
 #define DEBUGGER_ARGS 3
 
-int32_t debugger_breakpoint = -1;
-
-
-
 static void debugger_help(void)
 {
   fprintf(stdout, "Debugger Commands:\n");
@@ -37,12 +33,16 @@ static void debugger_help(void)
   fprintf(stdout, "  r               - CPU Reset\n");
   fprintf(stdout, "  i               - Dump IWM Trace\n");
   fprintf(stdout, "  z               - Dump ACIA Trace\n");
+  fprintf(stdout, "  v               - Dump Video Frame Statistics\n");
 }
 
 
 
-bool debugger(w65c02_t *cpu, mem_t *mem, iwm_t *iwm)
+bool debugger(a2c_machine_t *machine)
 {
+  w65c02_t *cpu = &machine->cpu;
+  mem_t *mem = &machine->mem;
+  iwm_t *iwm = &machine->iwm;
   char input[128];
   char *argv[DEBUGGER_ARGS];
   int argc;
@@ -91,12 +91,12 @@ bool debugger(w65c02_t *cpu, mem_t *mem, iwm_t *iwm)
       return true;
 
     } else if (strncmp(argv[0], "w", 1) == 0) {
-      if (warp_mode) {
+      if (machine->warp_mode) {
         fprintf(stdout, "Warp Mode: Off\n");
-        warp_mode = false;
+        machine->warp_mode = false;
       } else {
         fprintf(stdout, "Warp Mode: On\n");
-        warp_mode = true;
+        machine->warp_mode = true;
       }
 
     } else if (strncmp(argv[0], "f", 1) == 0) {
@@ -128,7 +128,11 @@ bool debugger(w65c02_t *cpu, mem_t *mem, iwm_t *iwm)
       }
 
     } else if (strncmp(argv[0], "t", 1) == 0) {
-      w65c02_trace_dump(stdout);
+      if (cpu->trace != NULL) {
+        w65c02_trace_dump(cpu->trace, stdout);
+      } else {
+        fprintf(stdout, "CPU trace collection is disabled.\n");
+      }
 
     } else if (strncmp(argv[0], "d", 1) == 0) {
       if (argc >= 3) {
@@ -168,30 +172,34 @@ bool debugger(w65c02_t *cpu, mem_t *mem, iwm_t *iwm)
     } else if (strncmp(argv[0], "b", 1) == 0) {
       if (argc >= 2) {
         if (sscanf(argv[1], "%4x", &value1) == 1) {
-          debugger_breakpoint = (value1 & 0xFFFF);
+          machine_breakpoint_set(machine, value1 & 0xFFFF);
           fprintf(stdout, "Breakpoint at $%04x set.\n",
-            debugger_breakpoint);
+            machine->debugger_breakpoint);
         } else {
           fprintf(stdout, "Invalid argument!\n");
         }
       } else {
-        if (debugger_breakpoint < 0) {
+        if (machine->debugger_breakpoint < 0) {
           fprintf(stdout, "Missing argument!\n");
         } else {
           fprintf(stdout, "Breakpoint at $%04x removed.\n",
-            debugger_breakpoint);
+            machine->debugger_breakpoint);
         }
-        debugger_breakpoint = -1;
+        machine_breakpoint_set(machine, -1);
       }
 
     } else if (strncmp(argv[0], "r", 1) == 0) {
       w65c02_reset(cpu, mem);
 
     } else if (strncmp(argv[0], "i", 1) == 0) {
-      iwm_trace_dump(stdout);
+      iwm_trace_dump(iwm, stdout);
 
     } else if (strncmp(argv[0], "z", 1) == 0) {
-      acia_trace_dump(stdout);
+      acia_trace_dump(&machine->acia1, stdout);
+      acia_trace_dump(&machine->acia2, stdout);
+
+    } else if (strncmp(argv[0], "v", 1) == 0) {
+      console_stats_dump(&machine->console, stdout);
     }
   }
 }
@@ -14,8 +14,8 @@ static SDL_Window *gui_window = NULL;
 static SDL_Renderer *gui_renderer = NULL;
 static SDL_Texture *gui_texture = NULL;
 static SDL_PixelFormat *gui_pixel_format = NULL;
-static Uint32 *gui_pixels = NULL;
-static int gui_pixel_pitch = 0;
+static Uint32 *gui_pixels = NULL; /* Kept here, only drawn rows change. */
+static bool gui_changed = false;
 
 
 
@@ -37,6 +37,7 @@ void gui_draw_pixel(int y, int x, bool on)
   if (x < 0 || x >= GUI_WIDTH) {
     return;
   }
+  gui_changed = true;
 
   for (scale_y = 0; scale_y < GUI_H_SCALE; scale_y++) {
     for (scale_x = 0; scale_x < GUI_W_SCALE; scale_x++) {
@@ -61,7 +62,6 @@ static void gui_exit_handler(void)
     SDL_FreeFormat(gui_pixel_format);
   }
   if (gui_texture != NULL) {
-    SDL_UnlockTexture(gui_texture);
     SDL_DestroyTexture(gui_texture);
   }
   if (gui_renderer != NULL) {
@@ -71,6 +71,7 @@ static void gui_exit_handler(void)
     SDL_DestroyWindow(gui_window);
   }
   SDL_Quit();
+  free(gui_pixels);
 }
 
 
@@ -102,9 +103,10 @@ int gui_init(void)
     return -1;
   }
 
-  if (SDL_LockTexture(gui_texture, NULL,
-    (void **)&gui_pixels, &gui_pixel_pitch) != 0) {
-    fprintf(stderr, "Unable to lock texture: %s\n", SDL_GetError());
+  gui_pixels = calloc(GUI_WIDTH * GUI_W_SCALE * GUI_HEIGHT * GUI_H_SCALE,
+    sizeof(Uint32));
+  if (gui_pixels == NULL) {
+    fprintf(stderr, "Unable to allocate pixels\n");
     return -1;
   }
 
@@ -119,7 +121,8 @@ int gui_init(void)
 
 
 
-void gui_execute(void)
+/* Returns false when the window has been closed. */
+bool gui_execute(void)
 {
   SDL_Event event;
 
@@ -127,23 +130,27 @@ void gui_execute(void)
     while (SDL_PollEvent(&event) == 1) {
       switch (event.type) {
       case SDL_QUIT:
-        exit(EXIT_SUCCESS);
+        return false;
+
+      case SDL_WINDOWEVENT:
+        if (event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+          gui_changed = true;
+        }
         break;
       }
     }
 
-    SDL_UnlockTexture(gui_texture);
-    SDL_RenderCopy(gui_renderer, gui_texture, NULL, NULL);
-
-    if (SDL_LockTexture(gui_texture, NULL,
-      (void **)&gui_pixels, &gui_pixel_pitch) != 0) {
-      fprintf(stderr, "Unable to lock texture: %s\n", SDL_GetError());
-      exit(EXIT_FAILURE);
+    /* Skip frames without any pixels drawn. */
+    if (! gui_changed) {
+      return true;
     }
+    gui_changed = false;
 
+    SDL_UpdateTexture(gui_texture, NULL, gui_pixels,
+      GUI_WIDTH * GUI_W_SCALE * sizeof(Uint32));
+    SDL_RenderCopy(gui_renderer, gui_texture, NULL, NULL);
     SDL_RenderPresent(gui_renderer);
   }
-}
-
-
 
+  return true;
+}
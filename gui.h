@@ -6,6 +6,6 @@
 
 void gui_draw_pixel(int y, int x, bool on);
 int gui_init(void);
-void gui_execute(void);
+bool gui_execute(void);
 
 #endif /* _GUI_H */
@@ -0,0 +1,239 @@
+#include "hle.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "iwm.h"
+#include "machine.h"
+#include "mem.h"
+#include "w65c02.h"
+
+#define HLE_RWTS_SLOT 6
+#define HLE_PRODOS_BLOCKS (DISK_SIZE / 512)
+
+#define HLE_RWTS_ERROR_PROTECTED   0x10
+#define HLE_RWTS_ERROR_VOLUME      0x20
+#define HLE_PRODOS_ERROR_IO        0x27
+#define HLE_PRODOS_ERROR_PROTECTED 0x2B
+
+
+
+static uint16_t hle_read16(mem_t *mem, uint16_t address)
+{
+  return mem_read(mem, address) | (mem_read(mem, address + 1) << 8);
+}
+
+
+
+/* Leave the trapped routine as if by its own RTS, with the carry set on
+   error and the error code in A. */
+static void hle_return(w65c02_t *cpu, mem_t *mem, uint8_t error)
+{
+  uint16_t address;
+
+  address  = mem_read(mem, MEM_PAGE_STACK + ++cpu->s);
+  address |= mem_read(mem, MEM_PAGE_STACK + ++cpu->s) << 8;
+  cpu->pc = address + 1;
+  cpu->a = error;
+  cpu->status.c = (error != 0);
+}
+
+
+
+static void hle_sector_read(mem_t *mem, disk_t *disk, int offset,
+  uint16_t buffer)
+{
+  int i;
+
+  for (i = 0; i < DISK_SECTOR_SIZE; i++) {
+    mem_write(mem, buffer + i, disk->data[offset + i]);
+  }
+}
+
+
+
+static void hle_sector_write(a2c_machine_t *machine, int disk_no, int offset,
+  uint16_t buffer)
+{
+  int i;
+
+  for (i = 0; i < DISK_SECTOR_SIZE; i++) {
+    machine->iwm.disk[disk_no].data[offset + i] =
+      mem_read(&machine->mem, buffer + i);
+  }
+  iwm_disk_written(&machine->iwm, disk_no, offset);
+}
+
+
+
+/* RWTS is called with the IOB address in A and Y. Only seeks, reads and
+   writes of whole sectors on the internal drives are served, formatting is
+   left to the real RWTS code. */
+static bool hle_rwts(a2c_machine_t *machine)
+{
+  w65c02_t *cpu = &machine->cpu;
+  mem_t *mem = &machine->mem;
+  uint16_t iob;
+  disk_t *disk;
+  int disk_no;
+  int offset;
+  uint8_t command;
+  uint8_t volume;
+  uint8_t error = 0;
+
+  /* STY $48, STA $49 starts the DOS 3.3 RWTS. */
+  if (mem_read(mem, HLE_RWTS_ENTRY)     != 0x84 ||
+      mem_read(mem, HLE_RWTS_ENTRY + 1) != 0x48 ||
+      mem_read(mem, HLE_RWTS_ENTRY + 2) != 0x85 ||
+      mem_read(mem, HLE_RWTS_ENTRY + 3) != 0x49) {
+    return false;
+  }
+
+  iob = (cpu->a << 8) | cpu->y;
+  if (mem_read(mem, iob) != 0x01 ||
+      mem_read(mem, iob + 0x1) != (HLE_RWTS_SLOT << 4)) {
+    return false;
+  }
+  disk_no = mem_read(mem, iob + 0x2) - 1;
+  if (disk_no != 0 && disk_no != 1) {
+    return false;
+  }
+  disk = &machine->iwm.disk[disk_no];
+  if (! disk->hle || ! disk->loaded ||
+      disk->interleave == DISK_INTERLEAVE_WOZ ||
+      disk->interleave == DISK_INTERLEAVE_NIB) {
+    return false;
+  }
+
+  command = mem_read(mem, iob + 0xC);
+  if (command != 0x00 && command != 0x01 && command != 0x02) {
+    return false; /* Format goes through the IWM. */
+  }
+
+  volume = mem_read(mem, iob + 0x3);
+  if (volume != 0 && volume != disk->volume_no) {
+    error = HLE_RWTS_ERROR_VOLUME;
+  } else if (command == 0x02 && disk->write_protected) {
+    error = HLE_RWTS_ERROR_PROTECTED;
+  } else if (command != 0x00) {
+    offset = iwm_disk_sector_offset(&machine->iwm, disk_no,
+      mem_read(mem, iob + 0x4), mem_read(mem, iob + 0x5),
+      DISK_INTERLEAVE_DOS);
+    if (offset < 0) {
+      return false;
+    }
+    if (command == 0x01) {
+      hle_sector_read(mem, disk, offset, hle_read16(mem, iob + 0x8));
+    } else {
+      hle_sector_write(machine, disk_no, offset, hle_read16(mem, iob + 0x8));
+    }
+  }
+
+  mem_write(mem, iob + 0xD, error);
+  mem_write(mem, iob + 0xE, disk->volume_no);
+  mem_write(mem, iob + 0xF, HLE_RWTS_SLOT << 4);
+  mem_write(mem, iob + 0x10, disk_no + 1);
+  mem_write(mem, 0x48, cpu->y);
+  mem_write(mem, 0x49, cpu->a);
+
+  hle_return(cpu, mem, error);
+  return true;
+}
+
+
+
+/* The ProDOS driver takes its parameters from $42 to $47, and is only
+   served if it is the one ProDOS has installed for the internal drives. */
+static bool hle_prodos(a2c_machine_t *machine)
+{
+  w65c02_t *cpu = &machine->cpu;
+  mem_t *mem = &machine->mem;
+  uint8_t unit;
+  uint16_t block;
+  uint16_t buffer;
+  disk_t *disk;
+  int disk_no;
+  int offset;
+  int i;
+
+  if (! mem->lcram || mem_read(mem, 0xBF00) != 0x4C) {
+    return false; /* No ProDOS MLI, or running from ROM. */
+  }
+
+  unit = mem_read(mem, 0x43);
+  disk_no = unit >> 7;
+  if (((unit >> 4) & 0x7) != HLE_RWTS_SLOT ||
+      hle_read16(mem, 0xBF10 + (disk_no * 0x10) + (HLE_RWTS_SLOT * 2))
+      != cpu->pc) {
+    return false;
+  }
+  disk = &machine->iwm.disk[disk_no];
+  if (! disk->hle || ! disk->loaded ||
+      disk->interleave == DISK_INTERLEAVE_WOZ ||
+      disk->interleave == DISK_INTERLEAVE_NIB) {
+    return false;
+  }
+
+  switch (mem_read(mem, 0x42)) {
+  case 0x00: /* Status */
+    cpu->x = HLE_PRODOS_BLOCKS & 0xFF;
+    cpu->y = HLE_PRODOS_BLOCKS >> 8;
+    hle_return(cpu, mem,
+      disk->write_protected ? HLE_PRODOS_ERROR_PROTECTED : 0);
+    return true;
+
+  case 0x01: /* Read */
+  case 0x02: /* Write */
+    block = hle_read16(mem, 0x46);
+    if (block >= HLE_PRODOS_BLOCKS) {
+      hle_return(cpu, mem, HLE_PRODOS_ERROR_IO);
+      return true;
+    }
+    if (mem_read(mem, 0x42) == 0x02 && disk->write_protected) {
+      hle_return(cpu, mem, HLE_PRODOS_ERROR_PROTECTED);
+      return true;
+    }
+    buffer = hle_read16(mem, 0x44);
+    for (i = 0; i < 2; i++) {
+      offset = iwm_disk_sector_offset(&machine->iwm, disk_no, block / 8,
+        ((block % 8) * 2) + i, DISK_INTERLEAVE_PRODOS);
+      if (mem_read(mem, 0x42) == 0x01) {
+        hle_sector_read(mem, disk, offset, buffer + (i * DISK_SECTOR_SIZE));
+      } else {
+        hle_sector_write(machine, disk_no, offset,
+          buffer + (i * DISK_SECTOR_SIZE));
+      }
+    }
+    hle_return(cpu, mem, 0);
+    return true;
+
+  default:
+    return false; /* Format goes through the IWM. */
+  }
+}
+
+
+
+void hle_enable(a2c_machine_t *machine, int disk_no)
+{
+  machine->iwm.disk[disk_no].hle = true;
+  machine->stop[HLE_RWTS_ENTRY] |= MACHINE_STOP_TRAP;
+  machine->stop[HLE_PRODOS_ENTRY] |= MACHINE_STOP_TRAP;
+}
+
+
+
+/* Called with the CPU stopped at a trap address, returns false to let the
+   CPU carry on with the real code. */
+bool hle_trap(a2c_machine_t *machine)
+{
+  switch (machine->cpu.pc) {
+  case HLE_RWTS_ENTRY:
+    return hle_rwts(machine);
+
+  case HLE_PRODOS_ENTRY:
+    return hle_prodos(machine);
+
+  default:
+    return false;
+  }
+}
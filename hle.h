@@ -0,0 +1,13 @@
+#ifndef _HLE_H
+#define _HLE_H
+
+#include <stdbool.h>
+#include "machine.h"
+
+#define HLE_RWTS_ENTRY   0xBD00 /* DOS 3.3 RWTS. */
+#define HLE_PRODOS_ENTRY 0xD000 /* ProDOS 8 Disk II driver, in LC RAM. */
+
+void hle_enable(a2c_machine_t *machine, int disk_no);
+bool hle_trap(a2c_machine_t *machine);
+
+#endif /* _HLE_H */
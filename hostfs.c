@@ -0,0 +1,832 @@
+#include "hostfs.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A host directory is served as a ProDOS volume, built into the block
+   buffer of a SmartPort unit when it is attached. File types come from a
+   "#TTAAAA" suffix on the host file name (type and optional aux type in
+   hex) or else from a few known extensions. Files whose blocks the guest
+   has written are written back by walking the volume directory tree
+   again, unless the host file has also changed since it was read. */
+
+#define HOSTFS_BLOCK_SIZE 512
+#define HOSTFS_ENTRY_LENGTH 0x27
+#define HOSTFS_ENTRIES_PER_BLOCK 13
+#define HOSTFS_VOLUME_DIR_BLOCK 2
+#define HOSTFS_VOLUME_DIR_BLOCKS 4 /* Minimum, as made by the ProDOS FILER. */
+#define HOSTFS_EOF_MAX 0xFFFFFF
+
+#define HOSTFS_STORAGE_SEEDLING 0x1
+#define HOSTFS_STORAGE_SAPLING  0x2
+#define HOSTFS_STORAGE_TREE     0x3
+#define HOSTFS_STORAGE_SUBDIR   0xD
+#define HOSTFS_STORAGE_SUBDIR_HEADER 0xE
+#define HOSTFS_STORAGE_VOLUME_HEADER 0xF
+
+#define HOSTFS_TYPE_DIR 0x0F
+#define HOSTFS_TYPE_BIN 0x06
+#define HOSTFS_ACCESS   0xE3 /* Destroy, rename, backup, write and read. */
+
+typedef struct hostfs_ext_s {
+  const char *ext;
+  uint8_t type;
+  uint16_t aux;
+} hostfs_ext_t;
+
+static const hostfs_ext_t hostfs_ext[] = {
+  {".txt", 0x04, 0x0000},
+  {".bin", 0x06, 0x2000},
+  {".bas", 0xFC, 0x0801},
+  {".sys", 0xFF, 0x2000},
+  {NULL,   0x00, 0x0000},
+};
+
+typedef struct hostfs_file_s {
+  char host[NAME_MAX + 1];
+  char name[HOSTFS_NAME_MAX + 1];
+  uint8_t type;
+  uint16_t aux;
+  bool dir;
+  off_t size;
+  time_t mtime;
+} hostfs_file_t;
+
+static void hostfs_write16(uint8_t *p, uint16_t value)
+{
+  p[0] = value & 0xFF;
+  p[1] = value >> 8;
+}
+
+
+
+static uint16_t hostfs_read16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+
+
+static uint32_t hostfs_read24(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+
+
+static hostfs_record_t *hostfs_record_find(hostfs_t *fs, uint16_t dir_key,
+  const char *name)
+{
+  int i;
+
+  for (i = 0; i < fs->records; i++) {
+    if (fs->record[i].dir_key == dir_key &&
+        strcmp(fs->record[i].name, name) == 0) {
+      return &fs->record[i];
+    }
+  }
+  return NULL;
+}
+
+
+
+static hostfs_record_t *hostfs_record_add(hostfs_t *fs, uint16_t dir_key,
+  const char *name, const char *host)
+{
+  hostfs_record_t *record;
+
+  if (fs->records >= fs->records_max) {
+    record = realloc(fs->record, (fs->records_max + 64) *
+      sizeof(hostfs_record_t));
+    if (record == NULL) {
+      return NULL;
+    }
+    fs->record = record;
+    fs->records_max += 64;
+  }
+  record = &fs->record[fs->records++];
+  memset(record, 0, sizeof(hostfs_record_t));
+  record->dir_key = dir_key;
+  snprintf(record->name, sizeof(record->name), "%s", name);
+  snprintf(record->host, sizeof(record->host), "%s", host);
+  return record;
+}
+
+
+
+/* ProDOS date and time, as stored in directory entries. */
+static void hostfs_time(uint8_t *p, time_t t)
+{
+  struct tm *tm;
+
+  tm = localtime(&t);
+  if (tm == NULL) {
+    memset(p, 0, 4);
+    return;
+  }
+  hostfs_write16(&p[0], ((tm->tm_year % 100) << 9) |
+    ((tm->tm_mon + 1) << 5) | tm->tm_mday);
+  p[2] = tm->tm_min;
+  p[3] = tm->tm_hour;
+}
+
+
+
+/* Make the ProDOS name of a host file, and find its file type. Returns
+   false if the file is hidden or no usable name is left. */
+static bool hostfs_name(const char *host, bool dir, char *name,
+  uint8_t *type, uint16_t *aux)
+{
+  char base[NAME_MAX + 1];
+  const char *suffix;
+  unsigned int value;
+  char *ext;
+  size_t len;
+  int i, n;
+
+  if (host[0] == '.') {
+    return false;
+  }
+  snprintf(base, sizeof(base), "%s", host);
+  *type = dir ? HOSTFS_TYPE_DIR : HOSTFS_TYPE_BIN;
+  *aux = 0x0000;
+
+  suffix = strrchr(base, '#');
+  len = (suffix != NULL) ? strlen(suffix + 1) : 0;
+  if (! dir && (len == 2 || len == 6) &&
+      strspn(suffix + 1, "0123456789abcdefABCDEF") == len &&
+      sscanf(suffix + 1, "%x", &value) == 1) {
+    *type = (len == 2) ? value : value >> 16;
+    *aux = (len == 2) ? 0x0000 : value & 0xFFFF;
+    base[suffix - base] = '\0';
+  } else if (! dir && (ext = strrchr(base, '.')) != NULL) {
+    for (i = 0; hostfs_ext[i].ext != NULL; i++) {
+      if (strcasecmp(ext, hostfs_ext[i].ext) == 0) {
+        *type = hostfs_ext[i].type;
+        *aux = hostfs_ext[i].aux;
+        *ext = '\0';
+        break;
+      }
+    }
+  }
+
+  /* Letters, digits and periods, starting with a letter. */
+  n = 0;
+  if (base[0] != '\0' && ! isalpha((unsigned char)base[0])) {
+    name[n++] = 'A';
+  }
+  for (i = 0; base[i] != '\0' && n < HOSTFS_NAME_MAX; i++) {
+    if (isalnum((unsigned char)base[i])) {
+      name[n++] = toupper((unsigned char)base[i]);
+    } else {
+      name[n++] = '.';
+    }
+  }
+  name[n] = '\0';
+  return n > 0;
+}
+
+
+
+static int hostfs_filter(const struct dirent *entry)
+{
+  return entry->d_name[0] != '.';
+}
+
+
+
+/* List the files of a host directory that can be put in a ProDOS
+   directory, in name order and without duplicate ProDOS names. */
+static int hostfs_list(const char *path, hostfs_file_t **files)
+{
+  struct dirent **list;
+  char host_path[PATH_MAX];
+  hostfs_file_t *file;
+  struct stat st;
+  int i, j, n, count;
+
+  n = scandir(path, &list, hostfs_filter, alphasort);
+  if (n < 0) {
+    return -1;
+  }
+  *files = calloc((n > 0) ? n : 1, sizeof(hostfs_file_t));
+  if (*files == NULL) {
+    for (i = 0; i < n; i++) {
+      free(list[i]);
+    }
+    free(list);
+    return -1;
+  }
+
+  count = 0;
+  for (i = 0; i < n; i++) {
+    file = &(*files)[count];
+    snprintf(host_path, PATH_MAX, "%s/%s", path, list[i]->d_name);
+    if (stat(host_path, &st) != 0 ||
+        (! S_ISDIR(st.st_mode) && ! S_ISREG(st.st_mode)) ||
+        (S_ISREG(st.st_mode) && st.st_size > HOSTFS_EOF_MAX) ||
+        ! hostfs_name(list[i]->d_name, S_ISDIR(st.st_mode), file->name,
+        &file->type, &file->aux)) {
+      free(list[i]);
+      continue;
+    }
+    for (j = 0; j < count; j++) {
+      if (strcmp((*files)[j].name, file->name) == 0) {
+        break;
+      }
+    }
+    if (j < count) {
+      free(list[i]);
+      continue; /* Same ProDOS name as an earlier file. */
+    }
+    snprintf(file->host, sizeof(file->host), "%s", list[i]->d_name);
+    file->dir = S_ISDIR(st.st_mode);
+    file->size = st.st_size;
+    file->mtime = st.st_mtime;
+    count++;
+    free(list[i]);
+  }
+  free(list);
+  return count;
+}
+
+
+
+static int hostfs_alloc(hostfs_t *fs, uint32_t n)
+{
+  uint32_t block;
+
+  if (fs->used + n > fs->blocks) {
+    return -1;
+  }
+  block = fs->used;
+  fs->used += n;
+  return block;
+}
+
+
+
+static uint8_t *hostfs_block(hostfs_t *fs, uint32_t block)
+{
+  return &fs->data[block * HOSTFS_BLOCK_SIZE];
+}
+
+
+
+/* Point an index block entry at a block, low and high bytes apart. */
+static void hostfs_index_set(uint8_t *index, int i, uint16_t block)
+{
+  index[i] = block & 0xFF;
+  index[i + 256] = block >> 8;
+}
+
+
+
+/* Read a host file into newly allocated blocks, with the index blocks
+   first. Returns the key block, or -1 if the volume is full. */
+static int hostfs_file_build(hostfs_t *fs, const char *path,
+  hostfs_file_t *file, uint8_t *storage, uint16_t *blocks_used)
+{
+  uint32_t data_blocks;
+  uint32_t index_blocks;
+  int key, first, i;
+  FILE *fh;
+
+  data_blocks = (file->size + HOSTFS_BLOCK_SIZE - 1) / HOSTFS_BLOCK_SIZE;
+  if (data_blocks == 0) {
+    data_blocks = 1;
+  }
+  if (data_blocks == 1) {
+    *storage = HOSTFS_STORAGE_SEEDLING;
+    index_blocks = 0;
+  } else if (data_blocks <= 256) {
+    *storage = HOSTFS_STORAGE_SAPLING;
+    index_blocks = 1;
+  } else {
+    *storage = HOSTFS_STORAGE_TREE;
+    index_blocks = 1 + ((data_blocks + 255) / 256);
+  }
+
+  key = hostfs_alloc(fs, index_blocks + data_blocks);
+  if (key < 0) {
+    return -1;
+  }
+  first = key + index_blocks;
+  *blocks_used = index_blocks + data_blocks;
+
+  if (*storage == HOSTFS_STORAGE_SAPLING) {
+    for (i = 0; i < (int)data_blocks; i++) {
+      hostfs_index_set(hostfs_block(fs, key), i, first + i);
+    }
+  } else if (*storage == HOSTFS_STORAGE_TREE) {
+    for (i = 0; i < (int)data_blocks; i++) {
+      if (i % 256 == 0) {
+        hostfs_index_set(hostfs_block(fs, key), i / 256, key + 1 + (i / 256));
+      }
+      hostfs_index_set(hostfs_block(fs, key + 1 + (i / 256)), i % 256,
+        first + i);
+    }
+  }
+
+  fh = fopen(path, "rb");
+  if (fh != NULL) {
+    if (fread(hostfs_block(fs, first), 1, file->size, fh) !=
+      (size_t)file->size) {
+      file->size = 0; /* Changed while reading, served as empty. */
+    }
+    fclose(fh);
+  }
+  return key;
+}
+
+
+
+static void hostfs_header(uint8_t *entry, uint8_t storage, const char *name,
+  time_t mtime)
+{
+  entry[0x00] = (storage << 4) | strlen(name);
+  memcpy(&entry[0x01], name, strlen(name));
+  hostfs_time(&entry[0x18], mtime);
+  entry[0x1C] = 0x00; /* Version */
+  entry[0x1D] = 0x00; /* Minimum version */
+  entry[0x1E] = HOSTFS_ACCESS;
+  entry[0x1F] = HOSTFS_ENTRY_LENGTH;
+  entry[0x20] = HOSTFS_ENTRIES_PER_BLOCK;
+}
+
+
+
+/* Build a directory and everything in it. The volume directory is followed
+   by the volume bitmap. Returns the key block, or -1 if the volume is full
+   or the host directory can not be read. */
+static int hostfs_dir_build(hostfs_t *fs, const char *path, const char *name,
+  time_t mtime, int parent_block, int parent_entry, uint16_t *blocks_used)
+{
+  char host_path[PATH_MAX];
+  hostfs_record_t *record;
+  hostfs_file_t *files;
+  uint8_t *entry;
+  uint8_t storage;
+  uint16_t used;
+  off_t size;
+  int count, dir_blocks, key, file_key, block, i;
+
+  count = hostfs_list(path, &files);
+  if (count < 0) {
+    return -1;
+  }
+
+  /* Room for the header and every file, with linked blocks. */
+  dir_blocks = (count + HOSTFS_ENTRIES_PER_BLOCK) / HOSTFS_ENTRIES_PER_BLOCK;
+  if (parent_block < 0 && dir_blocks < HOSTFS_VOLUME_DIR_BLOCKS) {
+    dir_blocks = HOSTFS_VOLUME_DIR_BLOCKS;
+  }
+  key = hostfs_alloc(fs, dir_blocks);
+  if (key < 0) {
+    free(files);
+    return -1;
+  }
+  for (i = 0; i < dir_blocks; i++) {
+    hostfs_write16(&hostfs_block(fs, key + i)[0], (i > 0) ? key + i - 1 : 0);
+    hostfs_write16(&hostfs_block(fs, key + i)[2],
+      (i < dir_blocks - 1) ? key + i + 1 : 0);
+  }
+  *blocks_used = dir_blocks;
+
+  entry = &hostfs_block(fs, key)[4];
+  if (parent_block < 0) {
+    hostfs_header(entry, HOSTFS_STORAGE_VOLUME_HEADER, name, mtime);
+    block = hostfs_alloc(fs, (fs->blocks + (HOSTFS_BLOCK_SIZE * 8) - 1) /
+      (HOSTFS_BLOCK_SIZE * 8));
+    if (block < 0) {
+      free(files);
+      return -1;
+    }
+    hostfs_write16(&entry[0x23], block); /* Bitmap pointer */
+    hostfs_write16(&entry[0x25], fs->blocks);
+  } else {
+    hostfs_header(entry, HOSTFS_STORAGE_SUBDIR_HEADER, name, mtime);
+    entry[0x10] = 0x75; /* Required by ProDOS. */
+    hostfs_write16(&entry[0x23], parent_block);
+    entry[0x25] = parent_entry;
+    entry[0x26] = HOSTFS_ENTRY_LENGTH;
+  }
+  hostfs_write16(&entry[0x21], count);
+
+  for (i = 0; i < count; i++) {
+    block = key + ((i + 1) / HOSTFS_ENTRIES_PER_BLOCK);
+    entry = &hostfs_block(fs, block)[4 +
+      (((i + 1) % HOSTFS_ENTRIES_PER_BLOCK) * HOSTFS_ENTRY_LENGTH)];
+    snprintf(host_path, PATH_MAX, "%s/%s", path, files[i].host);
+
+    if (files[i].dir) {
+      file_key = hostfs_dir_build(fs, host_path, files[i].name,
+        files[i].mtime, block, ((i + 1) % HOSTFS_ENTRIES_PER_BLOCK) + 1,
+        &used);
+      storage = HOSTFS_STORAGE_SUBDIR;
+      files[i].size = used * HOSTFS_BLOCK_SIZE;
+    } else {
+      size = files[i].size;
+      file_key = hostfs_file_build(fs, host_path, &files[i], &storage, &used);
+      record = hostfs_record_add(fs, key, files[i].name, files[i].host);
+      if (record == NULL) {
+        file_key = -1;
+      } else {
+        record->storage = storage;
+        record->key = file_key;
+        record->eof = files[i].size;
+        record->size = size;
+        record->mtime = files[i].mtime;
+      }
+    }
+    if (file_key < 0) {
+      free(files);
+      return -1;
+    }
+
+    entry[0x00] = (storage << 4) | strlen(files[i].name);
+    memcpy(&entry[0x01], files[i].name, strlen(files[i].name));
+    entry[0x10] = files[i].type;
+    hostfs_write16(&entry[0x11], file_key);
+    hostfs_write16(&entry[0x13], used);
+    entry[0x15] = files[i].size & 0xFF;
+    entry[0x16] = (files[i].size >> 8) & 0xFF;
+    entry[0x17] = (files[i].size >> 16) & 0xFF;
+    hostfs_time(&entry[0x18], files[i].mtime);
+    entry[0x1E] = HOSTFS_ACCESS;
+    hostfs_write16(&entry[0x1F], files[i].aux);
+    hostfs_time(&entry[0x21], files[i].mtime);
+    hostfs_write16(&entry[0x25], key);
+  }
+
+  free(files);
+  return key;
+}
+
+
+
+/* Build a ProDOS volume of the given size from a host directory into the
+   zeroed block buffer. Returns -1 if it does not fit. */
+int hostfs_init(hostfs_t *fs, const char *path, uint8_t *data,
+  uint32_t blocks)
+{
+  char name[HOSTFS_NAME_MAX + 1];
+  const char *base;
+  struct stat st;
+  uint8_t *bitmap;
+  uint16_t used;
+  uint8_t type;
+  uint16_t aux;
+  int key;
+  uint32_t i;
+
+  if (stat(path, &st) != 0 || ! S_ISDIR(st.st_mode)) {
+    return -1;
+  }
+  base = strrchr(path, '/');
+  base = (base != NULL && base[1] != '\0') ? base + 1 : path;
+  if (! hostfs_name(base, true, name, &type, &aux)) {
+    snprintf(name, sizeof(name), "HOST");
+  }
+
+  memset(fs, 0, sizeof(hostfs_t));
+  snprintf(fs->path, PATH_MAX, "%s", path);
+  fs->data = data;
+  fs->blocks = blocks;
+  fs->used = HOSTFS_VOLUME_DIR_BLOCK; /* After the boot blocks. */
+  fs->written = calloc((blocks + 7) / 8, 1);
+  if (fs->written == NULL) {
+    return -1;
+  }
+  key = hostfs_dir_build(fs, path, name, st.st_mtime, -1, 0, &used);
+  if (key != HOSTFS_VOLUME_DIR_BLOCK) {
+    hostfs_exit(fs);
+    return -1;
+  }
+
+  /* Free blocks have their bit set. */
+  bitmap = hostfs_block(fs, hostfs_read16(&hostfs_block(fs, key)[4 + 0x23]));
+  for (i = fs->used; i < blocks; i++) {
+    bitmap[i / 8] |= 0x80 >> (i % 8);
+  }
+  return 0;
+}
+
+
+
+/* Note a block written by the guest. */
+void hostfs_written(hostfs_t *fs, uint32_t block)
+{
+  if (block < fs->blocks) {
+    fs->written[block / 8] |= 0x80 >> (block % 8);
+  }
+}
+
+
+
+static bool hostfs_is_written(hostfs_t *fs, uint32_t block)
+{
+  return block < fs->blocks &&
+    (fs->written[block / 8] & (0x80 >> (block % 8))) != 0;
+}
+
+
+
+/* Block number of a file block, 0 for a sparse one. */
+static uint16_t hostfs_file_block(const uint8_t *data, uint32_t blocks,
+  uint8_t storage, uint16_t key, uint32_t n)
+{
+  const uint8_t *index;
+
+  if (storage == HOSTFS_STORAGE_SEEDLING) {
+    return (n == 0) ? key : 0;
+  }
+  if (storage == HOSTFS_STORAGE_TREE) {
+    if (key >= blocks || n / 256 >= 128) {
+      return 0;
+    }
+    index = &data[key * HOSTFS_BLOCK_SIZE];
+    key = index[n / 256] | (index[(n / 256) + 256] << 8);
+    n %= 256;
+  }
+  if (key == 0 || key >= blocks || n >= 256) {
+    return 0;
+  }
+  index = &data[key * HOSTFS_BLOCK_SIZE];
+  return index[n] | (index[n + 256] << 8);
+}
+
+
+
+/* Whether the guest has written a file since it was last synced, to its
+   entry or to any of its blocks. Files without a record are new. */
+static bool hostfs_file_written(hostfs_t *fs, const uint8_t *entry,
+  const hostfs_record_t *record)
+{
+  const uint8_t *index;
+  uint8_t storage;
+  uint16_t key, block;
+  uint32_t eof, n;
+
+  storage = entry[0x00] >> 4;
+  key = hostfs_read16(&entry[0x11]);
+  eof = hostfs_read24(&entry[0x15]);
+  if (record == NULL || record->storage != storage || record->key != key ||
+      record->eof != eof || hostfs_is_written(fs, key)) {
+    return true;
+  }
+
+  for (n = 0; n * HOSTFS_BLOCK_SIZE < eof; n++) {
+    if (storage == HOSTFS_STORAGE_TREE && n % 256 == 0 && key < fs->blocks &&
+        n / 256 < 128) {
+      index = hostfs_block(fs, key);
+      if (hostfs_is_written(fs,
+        index[n / 256] | (index[(n / 256) + 256] << 8))) {
+        return true;
+      }
+    }
+    block = hostfs_file_block(fs->data, fs->blocks, storage, key, n);
+    if (block != 0 && hostfs_is_written(fs, block)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+
+/* Write a file back to the host through a temporary file renamed over the
+   old one, keeping its mode. A host file changed since it was last read or
+   written is left alone, as is one that appeared with the name of a new
+   file. Returns 1 if skipped for that reason. */
+static int hostfs_file_sync(hostfs_t *fs, const uint8_t *entry,
+  uint16_t dir_key, const char *name, const char *path, const char *host,
+  hostfs_record_t *record)
+{
+  char host_path[PATH_MAX];
+  char tmp_path[PATH_MAX + 8];
+  uint8_t *contents, *old;
+  uint32_t size, n;
+  uint16_t block;
+  struct stat st;
+  mode_t mode;
+  bool exists;
+  bool same;
+  FILE *fh;
+  int fd;
+
+  snprintf(host_path, PATH_MAX, "%s/%s", path, host);
+  exists = (stat(host_path, &st) == 0);
+  if ((record == NULL) ? exists : (! exists || st.st_size != record->size ||
+      st.st_mtime != record->mtime)) {
+    snprintf(fs->skipped, PATH_MAX, "%s", host_path);
+    return 1;
+  }
+  mode = (exists) ? st.st_mode & 07777 : 0644;
+
+  size = hostfs_read24(&entry[0x15]);
+  contents = calloc(size + 1, 1);
+  if (contents == NULL) {
+    return -1;
+  }
+  for (n = 0; n * HOSTFS_BLOCK_SIZE < size; n++) {
+    block = hostfs_file_block(fs->data, fs->blocks, entry[0x00] >> 4,
+      hostfs_read16(&entry[0x11]), n);
+    if (block != 0 && block < fs->blocks) {
+      memcpy(&contents[n * HOSTFS_BLOCK_SIZE],
+        hostfs_block(fs, block),
+        (size - (n * HOSTFS_BLOCK_SIZE) < HOSTFS_BLOCK_SIZE) ?
+        size - (n * HOSTFS_BLOCK_SIZE) : HOSTFS_BLOCK_SIZE);
+    }
+  }
+
+  same = false;
+  if (exists && st.st_size == size) {
+    old = malloc(size + 1);
+    fh = fopen(host_path, "rb");
+    if (old != NULL && fh != NULL && fread(old, 1, size, fh) == size) {
+      same = (memcmp(old, contents, size) == 0);
+    }
+    if (fh != NULL) {
+      fclose(fh);
+    }
+    free(old);
+  }
+
+  if (! same) {
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", host_path);
+    fd = mkstemp(tmp_path);
+    if (fd == -1) {
+      free(contents);
+      return -1;
+    }
+    fchmod(fd, mode);
+    fh = fdopen(fd, "wb");
+    if (fh == NULL || fwrite(contents, 1, size, fh) != size) {
+      if (fh != NULL) {
+        fclose(fh);
+      } else {
+        close(fd);
+      }
+      unlink(tmp_path);
+      free(contents);
+      return -1;
+    }
+    fclose(fh);
+
+    if (rename(tmp_path, host_path) != 0) {
+      unlink(tmp_path);
+      free(contents);
+      return -1;
+    }
+  }
+  free(contents);
+
+  if (record == NULL) {
+    record = hostfs_record_add(fs, dir_key, name, host);
+    if (record == NULL) {
+      return -1;
+    }
+  }
+  if (stat(host_path, &st) != 0) {
+    return -1;
+  }
+  record->storage = entry[0x00] >> 4;
+  record->key = hostfs_read16(&entry[0x11]);
+  record->eof = size;
+  record->size = st.st_size;
+  record->mtime = st.st_mtime;
+  return 0;
+}
+
+
+
+/* Walk a ProDOS directory and write its written files back into a host
+   directory, matching the entries to the host files they were read from,
+   or else by their ProDOS names. New files get their type in a name
+   suffix, deleted ones are left on the host. Returns the number of files
+   skipped, or -1 on error. */
+static int hostfs_dir_sync(hostfs_t *fs, uint16_t key, const char *path,
+  int depth)
+{
+  char host_path[PATH_MAX];
+  char host[NAME_MAX + 1];
+  char name[HOSTFS_NAME_MAX + 1];
+  hostfs_record_t *record;
+  hostfs_file_t *files;
+  const uint8_t *entry;
+  uint16_t block;
+  uint8_t storage;
+  int count, result, skipped, chain, n, i, j;
+
+  if (depth > 64) {
+    return -1; /* Directory loop. */
+  }
+  count = hostfs_list(path, &files);
+  if (count < 0) {
+    return -1;
+  }
+
+  result = 0;
+  skipped = 0;
+  block = key;
+  for (chain = 0; block != 0 && block < fs->blocks && chain < (int)fs->blocks;
+    chain++) {
+    for (i = 0; i < HOSTFS_ENTRIES_PER_BLOCK; i++) {
+      entry = &hostfs_block(fs, block)[4 + (i * HOSTFS_ENTRY_LENGTH)];
+      storage = entry[0x00] >> 4;
+      if (storage != HOSTFS_STORAGE_SEEDLING &&
+          storage != HOSTFS_STORAGE_SAPLING &&
+          storage != HOSTFS_STORAGE_TREE &&
+          storage != HOSTFS_STORAGE_SUBDIR) {
+        continue; /* Deleted, header or not a ProDOS file. */
+      }
+      memcpy(name, &entry[0x01], entry[0x00] & 0x0F);
+      name[entry[0x00] & 0x0F] = '\0';
+
+      record = NULL;
+      if (storage != HOSTFS_STORAGE_SUBDIR) {
+        record = hostfs_record_find(fs, key, name);
+        if (! hostfs_file_written(fs, entry, record)) {
+          continue;
+        }
+      }
+
+      for (j = 0; j < count; j++) {
+        if (strcmp(files[j].name, name) == 0 &&
+            files[j].dir == (storage == HOSTFS_STORAGE_SUBDIR)) {
+          break;
+        }
+      }
+      if (record != NULL) {
+        snprintf(host, sizeof(host), "%s", record->host);
+      } else if (j < count) {
+        snprintf(host, sizeof(host), "%s", files[j].host);
+      } else if (storage == HOSTFS_STORAGE_SUBDIR ||
+        (entry[0x10] == HOSTFS_TYPE_BIN && hostfs_read16(&entry[0x1F]) == 0)) {
+        snprintf(host, sizeof(host), "%s", name);
+      } else {
+        snprintf(host, sizeof(host), "%s#%02X%04X", name, entry[0x10],
+          hostfs_read16(&entry[0x1F]));
+      }
+
+      if (storage == HOSTFS_STORAGE_SUBDIR) {
+        snprintf(host_path, PATH_MAX, "%s/%s", path, host);
+        if (j >= count && mkdir(host_path, 0755) != 0) {
+          result = -1;
+          continue;
+        }
+        n = hostfs_dir_sync(fs, hostfs_read16(&entry[0x11]), host_path,
+          depth + 1);
+      } else {
+        n = hostfs_file_sync(fs, entry, key, name, path, host, record);
+      }
+      if (n < 0) {
+        result = -1;
+      } else {
+        skipped += n;
+      }
+    }
+    block = hostfs_read16(&hostfs_block(fs, block)[2]);
+  }
+
+  free(files);
+  return (result < 0) ? -1 : skipped;
+}
+
+
+
+/* Write the files the guest changed back to the host directory. Returns
+   the number of files skipped since they changed on the host too, with the
+   last one in skipped, or -1 on error. */
+int hostfs_sync(hostfs_t *fs)
+{
+  int result;
+
+  result = hostfs_dir_sync(fs, HOSTFS_VOLUME_DIR_BLOCK, fs->path, 0);
+  if (result >= 0) {
+    memset(fs->written, 0, (fs->blocks + 7) / 8);
+  }
+  return result;
+}
+
+
+
+void hostfs_exit(hostfs_t *fs)
+{
+  free(fs->written);
+  fs->written = NULL;
+  free(fs->record);
+  fs->record = NULL;
+  fs->records = 0;
+  fs->records_max = 0;
+}
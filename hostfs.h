@@ -0,0 +1,42 @@
+#ifndef _HOSTFS_H
+#define _HOSTFS_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define HOSTFS_NAME_MAX 15
+
+/* A host file as last read into or written back from the volume, to tell
+   the writes of the guest apart from changes made on the host. */
+typedef struct hostfs_record_s {
+  uint16_t dir_key;               /* Key block of its directory. */
+  char name[HOSTFS_NAME_MAX + 1]; /* ProDOS name. */
+  char host[NAME_MAX + 1];        /* Host name, in the same directory. */
+  uint8_t storage;
+  uint16_t key;
+  uint32_t eof;
+  off_t size;
+  time_t mtime;
+} hostfs_record_t;
+
+typedef struct hostfs_s {
+  char path[PATH_MAX];
+  uint8_t *data;
+  uint32_t blocks;
+  uint32_t used;    /* Blocks allocated by the build, from block 0. */
+  uint8_t *written; /* Bitmap of the blocks written since the last sync. */
+  hostfs_record_t *record;
+  int records;
+  int records_max;
+  char skipped[PATH_MAX]; /* Last file changed on both sides, not synced. */
+} hostfs_t;
+
+int hostfs_init(hostfs_t *fs, const char *path, uint8_t *data,
+  uint32_t blocks);
+void hostfs_written(hostfs_t *fs, uint32_t block);
+int hostfs_sync(hostfs_t *fs);
+void hostfs_exit(hostfs_t *fs);
+
+#endif /* _HOSTFS_H */
@@ -1,18 +1,29 @@
 #include "iwm.h"
+#include <errno.h>
+#include <libgen.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef DISK_ZSTD
+#include <zstd.h>
+#endif /* DISK_ZSTD */
 
 #include "mem.h"
 #include "panic.h"
 
-#define IWM_TRACE_BUFFER_SIZE 1024
-#define IWM_TRACE_MAX 80
+#define DISK_UNPACK_MAX 0x1000000 /* Address space reserved for unpacking. */
 
-static char iwm_trace_buffer[IWM_TRACE_BUFFER_SIZE][IWM_TRACE_MAX];
-static int iwm_trace_buffer_n = 0;
+#define DISK_OVERLAY_MAGIC "A2CO"
+#define DISK_OVERLAY_HEADER_SIZE 12 /* Magic, data size and checksum. */
 
 static const uint8_t disk_gcr_map[64] = {
   0x96, 0x97, 0x9A, 0x9B, 0x9D, 0x9E, 0x9F, 0xA6,
@@ -37,18 +48,18 @@ static const int disk_interleave_prodos[DISK_SECTORS] = {
 
 
 
-static void iwm_trace(const char *format, ...)
+static void iwm_trace(iwm_t *iwm, const char *format, ...)
 {
   va_list args;
 
   va_start(args, format);
-  vsnprintf(iwm_trace_buffer[iwm_trace_buffer_n],
+  vsnprintf(iwm->trace_buffer[iwm->trace_buffer_n],
     IWM_TRACE_MAX, format, args);
   va_end(args);
 
-  iwm_trace_buffer_n++;
-  if (iwm_trace_buffer_n >= IWM_TRACE_BUFFER_SIZE) {
-    iwm_trace_buffer_n = 0;
+  iwm->trace_buffer_n++;
+  if (iwm->trace_buffer_n >= IWM_TRACE_BUFFER_SIZE) {
+    iwm->trace_buffer_n = 0;
   }
 }
 
@@ -98,9 +109,48 @@ static void disk_sector_to_nibble(uint8_t sector[], uint8_t nibble[])
 
 
 
-static void disk_load_track(iwm_t *iwm, int disk_no, int track_no)
+static uint8_t disk_odd_even_decode(uint8_t xx, uint8_t yy)
+{
+  return ((xx << 1) | 0x01) & yy;
+}
+
+
+
+/* Reverse of disk_sector_to_nibble(). */
+static void disk_nibble_to_sector(uint8_t nibble[], uint8_t sector[])
+{
+  int i;
+  uint8_t low;
+
+  for (i = 0; i < 256; i++) {
+    low = nibble[i % 86] >> ((i / 86) * 2);
+    sector[i]  = nibble[i + 86] << 2;
+    sector[i] |= (low >> 1) & 0x01; /* Bit 1 to 0 */
+    sector[i] |= (low << 1) & 0x02; /* Bit 0 to 1 */
+  }
+}
+
+
+
+/* Reverse of disk_gcr_map, or -1 if the byte is not a valid nibble. */
+static int disk_gcr_unmap(uint8_t byte)
 {
   int i;
+
+  for (i = 0; i < 64; i++) {
+    if (disk_gcr_map[i] == byte) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+
+static void disk_encode_track(iwm_t *iwm, int disk_no, int track_no)
+{
+  uint8_t *track = iwm->disk[disk_no].nibble[track_no];
+  int i;
   int sector_no;
   int byte_no = 0;
   uint8_t nibble[342];
@@ -109,40 +159,36 @@ static void disk_load_track(iwm_t *iwm, int disk_no, int track_no)
   uint8_t yy;
   int offset;
 
-  if (track_no >= DISK_TRACKS) {
-    return; /* Track out of range, ignore request. */
-  }
-
   for (sector_no = 0; sector_no < DISK_SECTORS; sector_no++) {
     /* Address Field Prologue */
-    iwm->disk[disk_no].track[byte_no++] = 0xD5;
-    iwm->disk[disk_no].track[byte_no++] = 0xAA;
-    iwm->disk[disk_no].track[byte_no++] = 0x96;
+    track[byte_no++] = 0xD5;
+    track[byte_no++] = 0xAA;
+    track[byte_no++] = 0x96;
 
     /* Address Field */
     disk_odd_even_encode(iwm->disk[disk_no].volume_no, &xx, &yy); /* Volume */
-    iwm->disk[disk_no].track[byte_no++] = xx;
-    iwm->disk[disk_no].track[byte_no++] = yy;
+    track[byte_no++] = xx;
+    track[byte_no++] = yy;
     disk_odd_even_encode(track_no, &xx, &yy); /* Track */
-    iwm->disk[disk_no].track[byte_no++] = xx;
-    iwm->disk[disk_no].track[byte_no++] = yy;
+    track[byte_no++] = xx;
+    track[byte_no++] = yy;
     disk_odd_even_encode(sector_no, &xx, &yy); /* Sector */
-    iwm->disk[disk_no].track[byte_no++] = xx;
-    iwm->disk[disk_no].track[byte_no++] = yy;
+    track[byte_no++] = xx;
+    track[byte_no++] = yy;
     disk_odd_even_encode(iwm->disk[disk_no].volume_no ^ track_no ^ sector_no,
       &xx, &yy); /* Checksum */
-    iwm->disk[disk_no].track[byte_no++] = xx;
-    iwm->disk[disk_no].track[byte_no++] = yy;
+    track[byte_no++] = xx;
+    track[byte_no++] = yy;
 
     /* Address Field Epilogue */
-    iwm->disk[disk_no].track[byte_no++] = 0xDE;
-    iwm->disk[disk_no].track[byte_no++] = 0xAA;
-    iwm->disk[disk_no].track[byte_no++] = 0xEB;
+    track[byte_no++] = 0xDE;
+    track[byte_no++] = 0xAA;
+    track[byte_no++] = 0xEB;
 
     /* Data Field Prologue */
-    iwm->disk[disk_no].track[byte_no++] = 0xD5;
-    iwm->disk[disk_no].track[byte_no++] = 0xAA;
-    iwm->disk[disk_no].track[byte_no++] = 0xAD;
+    track[byte_no++] = 0xD5;
+    track[byte_no++] = 0xAA;
+    track[byte_no++] = 0xAD;
 
     /* Data Field */
     switch (iwm->disk[disk_no].interleave) {
@@ -165,28 +211,171 @@ static void disk_load_track(iwm_t *iwm, int disk_no, int track_no)
     disk_sector_to_nibble(&iwm->disk[disk_no].data[offset], nibble);
     data = 0;
     for (i = 0; i < 342; i++) {
-      iwm->disk[disk_no].track[byte_no++] = disk_gcr_map[data ^ nibble[i]];
+      track[byte_no++] = disk_gcr_map[data ^ nibble[i]];
       data = nibble[i];
     }
-    iwm->disk[disk_no].track[byte_no++] = disk_gcr_map[data]; /* Checksum */
+    track[byte_no++] = disk_gcr_map[data]; /* Checksum */
 
     /* Data Field Epilogue */
-    iwm->disk[disk_no].track[byte_no++] = 0xDE;
-    iwm->disk[disk_no].track[byte_no++] = 0xAA;
-    iwm->disk[disk_no].track[byte_no++] = 0xEB;
+    track[byte_no++] = 0xDE;
+    track[byte_no++] = 0xAA;
+    track[byte_no++] = 0xEB;
+  }
+}
+
+
+
+/* Track changes are a pointer switch, each track is only allocated and
+   encoded the first time the head gets there. */
+static void disk_load_track(iwm_t *iwm, int disk_no, int track_no)
+{
+  if (track_no >= DISK_TRACKS) {
+    return; /* Track out of range, ignore request. */
+  }
+
+  if (iwm->disk[disk_no].interleave == DISK_INTERLEAVE_NIB) {
+    iwm->disk[disk_no].track = &iwm->disk[disk_no].data[track_no *
+      DISK_NIB_TRACK_SIZE]; /* Already nibblized in the image. */
+  } else {
+    if (iwm->disk[disk_no].nibble[track_no] == NULL) {
+      iwm->disk[disk_no].nibble[track_no] = malloc(DISK_TRACK_SIZE);
+      if (iwm->disk[disk_no].nibble[track_no] == NULL) {
+        panic(iwm->mem->machine, "Out of memory for track %d!\n", track_no);
+        return;
+      }
+      iwm->disk[disk_no].nibble_valid[track_no] = false;
+    }
+    if (! iwm->disk[disk_no].nibble_valid[track_no]) {
+      disk_encode_track(iwm, disk_no, track_no);
+      iwm->disk[disk_no].nibble_valid[track_no] = true;
+    }
+    iwm->disk[disk_no].track = iwm->disk[disk_no].nibble[track_no];
+  }
+  iwm->disk[disk_no].track_no = track_no;
+  iwm->disk[disk_no].field_left = 0;
+  iwm->disk[disk_no].prologue_n = 0;
+}
+
+
+
+/* Move the head to the next 0xD5, which starts every field prologue and
+   never appears inside a field. Software scanning for a prologue only finds
+   it sooner, unless it counts the bytes it has to wait for. */
+static void disk_skip_to_prologue(disk_t *disk)
+{
+  int i;
+  int n;
+
+  n = disk->track_n;
+  for (i = 0; i < disk->track_size; i++) {
+    if (disk->track[n] == 0xD5) {
+      disk->track_n = n;
+      return;
+    }
+    n++;
+    if (n >= disk->track_size) {
+      n = 0;
+    }
   }
 }
 
 
 
+/* Follow the field prologues as the software reads them, so that a field
+   is never skipped into once it has been found. */
+static void disk_field_follow(disk_t *disk, uint8_t data)
+{
+  if (disk->field_left > 0) {
+    disk->field_left--;
+  } else if (data == 0xD5) {
+    disk->prologue_n = 1;
+  } else if (disk->prologue_n == 1 && data == 0xAA) {
+    disk->prologue_n = 2;
+  } else if (disk->prologue_n == 2 && data == 0x96) {
+    disk->field_left = DISK_ADDRESS_FIELD_SIZE;
+    disk->prologue_n = 0;
+  } else if (disk->prologue_n == 2 && data == 0xAD) {
+    disk->field_left = DISK_DATA_FIELD_SIZE;
+    disk->prologue_n = 0;
+  } else {
+    disk->prologue_n = 0;
+  }
+}
+
+
+
+/* Turn the disk to where it is now, from the cycle count of the running
+   instruction. The position is only worked out when the software looks, and
+   bytes passing the head in between are lost. Returns false if the byte at
+   the head has not passed it completely yet. */
+static bool disk_spin(iwm_t *iwm, disk_t *disk)
+{
+  uint64_t now = *iwm->mem->cycle_count;
+  uint64_t bytes;
+
+  if (now < disk->spin_cycle) {
+    return false;
+  }
+  bytes = (now - disk->spin_cycle) / DISK_BYTE_CYCLES;
+  disk->track_n = (disk->track_n + bytes) % disk->track_size;
+  disk->spin_cycle += bytes * DISK_BYTE_CYCLES;
+  return true;
+}
+
+
+
+/* Start turning the disk from the current cycle, with the byte at the head
+   complete, after it has been stopped or deselected. */
+static void disk_spin_start(iwm_t *iwm, disk_t *disk)
+{
+  disk->spin_cycle = *iwm->mem->cycle_count;
+}
+
+
+
+/* Read the data register. Without fast disk mode, a new byte is only there
+   every 32 cycles, or when the bit cells of a WOZ byte have passed, and the
+   register reads with the high bit clear until then. */
 static uint8_t disk_spin_and_read(iwm_t *iwm, int disk_no)
 {
+  disk_t *disk = &iwm->disk[disk_no];
+  uint64_t cells;
   uint8_t data;
+  int value;
+
+  disk->write_prologue_n = 0;
+  disk->write_n = 0;
 
-  data = iwm->disk[disk_no].track[iwm->disk[disk_no].track_n];
-  iwm->disk[disk_no].track_n++;
-  if (iwm->disk[disk_no].track_n >= DISK_TRACK_SIZE) {
-    iwm->disk[disk_no].track_n = 0;
+  if (disk->interleave == DISK_INTERLEAVE_WOZ) {
+    if (iwm->fast_disk) {
+      return woz_read(&disk->woz);
+    }
+    cells = (*iwm->mem->cycle_count - disk->spin_cycle) / DISK_CELL_CYCLES;
+    disk->spin_cycle += cells * DISK_CELL_CYCLES;
+    value = woz_read_timed(&disk->woz,
+      (cells > WOZ_CELLS_MAX) ? WOZ_CELLS_MAX : cells);
+    return (value < 0) ? iwm->data & 0x7F : value;
+  }
+
+  if (iwm->fast_disk) {
+    if (disk->field_left == 0 && disk->prologue_n == 0) {
+      disk_skip_to_prologue(disk);
+    }
+  } else {
+    if (! disk_spin(iwm, disk)) {
+      return iwm->data & 0x7F;
+    }
+    disk->spin_cycle += DISK_BYTE_CYCLES; /* For the byte after this one. */
+  }
+
+  data = disk->track[disk->track_n];
+  disk->track_n++;
+  if (disk->track_n >= disk->track_size) {
+    disk->track_n = 0;
+  }
+
+  if (iwm->fast_disk) {
+    disk_field_follow(disk, data);
   }
 
   return data;
@@ -194,86 +383,251 @@ static uint8_t disk_spin_and_read(iwm_t *iwm, int disk_no)
 
 
 
-static void disk_step(iwm_t *iwm, int disk_no)
+/* Store a data field written by the software into its sector. */
+static void disk_write_data_field(iwm_t *iwm, int disk_no)
 {
-  int prev_track = iwm->disk[disk_no].stepper_pos / 2;
+  disk_t *disk = &iwm->disk[disk_no];
+  uint8_t nibble[DISK_NIBBLES - 1];
+  uint8_t data = 0;
+  int offset;
+  int value;
+  int i;
 
-  /* Simulate build-up of energy in the drive stepper motor phases. */
-  if (iwm->ph0) {
-    iwm->disk[disk_no].ph0_energy++;
-  } else {
-    iwm->disk[disk_no].ph0_energy = 0;
-  }
-  if (iwm->ph1) {
-    iwm->disk[disk_no].ph1_energy++;
-  } else {
-    iwm->disk[disk_no].ph1_energy = 0;
+  for (i = 0; i < DISK_NIBBLES; i++) {
+    value = disk_gcr_unmap(disk->write_buffer[i]);
+    if (value < 0) {
+      iwm_trace(iwm, "[W] D%d, Bad nibble 0x%02x\n", disk_no,
+        disk->write_buffer[i]);
+      return;
+    }
+    if (i < DISK_NIBBLES - 1) {
+      nibble[i] = value ^ data;
+      data = nibble[i];
+    } else if (value != data) {
+      iwm_trace(iwm, "[W] D%d, Bad checksum\n", disk_no);
+      return;
+    }
   }
-  if (iwm->ph2) {
-    iwm->disk[disk_no].ph2_energy++;
-  } else {
-    iwm->disk[disk_no].ph2_energy = 0;
+
+  offset = iwm_disk_sector_offset(iwm, disk_no, disk->track_no,
+    disk->write_sector, DISK_INTERLEAVE_RAW);
+  if (offset < 0) {
+    return;
   }
-  if (iwm->ph3) {
-    iwm->disk[disk_no].ph3_energy++;
-  } else {
-    iwm->disk[disk_no].ph3_energy = 0;
+  iwm_trace(iwm, "[W] D%d, T%d, S%d\n", disk_no, disk->track_no,
+    disk->write_sector);
+  disk_nibble_to_sector(nibble, &disk->data[offset]);
+  iwm_disk_written(iwm, disk_no, offset);
+}
+
+
+
+/* Follow the bytes written by the software and decode the address and data
+   fields. A data field goes to the sector of the address field written
+   just before it, when formatting, or else the one under the head. */
+static void disk_write(iwm_t *iwm, int disk_no, uint8_t value)
+{
+  disk_t *disk = &iwm->disk[disk_no];
+  uint8_t volume;
+
+  if (disk->interleave == DISK_INTERLEAVE_NIB) {
+    disk->track[disk->track_n] = value; /* Nibbles go straight in. */
+    disk->changed[((disk->track_no * disk->track_size) + disk->track_n) /
+      DISK_SECTOR_SIZE] = true;
+    disk->track_n++;
+    if (disk->track_n >= disk->track_size) {
+      disk->track_n = 0;
+    }
+    disk->dirty[disk->track_no] = true;
+    return;
   }
 
-  /* Simulate movement of drive stepper motor. */
-  switch (iwm->disk[disk_no].stepper_pos % 4) {
-  case 0:
-    if (iwm->disk[disk_no].ph0_energy == 0) {
-      if (iwm->disk[disk_no].ph1_energy > 1000) {
-        iwm->disk[disk_no].stepper_pos++;
-      } else if (iwm->disk[disk_no].ph3_energy > 1000) {
-        iwm->disk[disk_no].stepper_pos--;
-        if (iwm->disk[disk_no].stepper_pos < 0) {
-          iwm->disk[disk_no].stepper_pos = 0;
-        }
-      }
+  if (disk->write_n > 0) {
+    disk->write_buffer[DISK_NIBBLES - disk->write_n] = value;
+    disk->write_n--;
+    if (disk->write_n > 0) {
+      return;
     }
-    break;
 
-  case 1:
-    if (iwm->disk[disk_no].ph1_energy == 0) {
-      if (iwm->disk[disk_no].ph2_energy > 1000) {
-        iwm->disk[disk_no].stepper_pos++;
-      } else if (iwm->disk[disk_no].ph0_energy > 1000) {
-        iwm->disk[disk_no].stepper_pos--;
+    if (disk->write_field == 0x96) {
+      volume = disk_odd_even_decode(disk->write_buffer[DISK_NIBBLES - 8],
+        disk->write_buffer[DISK_NIBBLES - 7]);
+      disk->write_sector = disk_odd_even_decode(
+        disk->write_buffer[DISK_NIBBLES - 4],
+        disk->write_buffer[DISK_NIBBLES - 3]);
+      if (volume != disk->volume_no) {
+        disk->volume_no = volume; /* Every track has to be encoded again. */
+        memset(disk->nibble_valid, 0, sizeof(disk->nibble_valid));
+        disk_load_track(iwm, disk_no, disk->track_no);
+      }
+    } else {
+      if (disk->write_sector < 0) {
+        disk->write_sector = disk->track_n / DISK_SECTOR_NIBBLES;
       }
+      disk_write_data_field(iwm, disk_no);
+      disk->track_n = ((disk->write_sector + 1) * DISK_SECTOR_NIBBLES) %
+        DISK_TRACK_SIZE;
+      disk->write_sector = -1;
     }
-    break;
+    return;
+  }
 
-  case 2:
-    if (iwm->disk[disk_no].ph2_energy == 0) {
-      if (iwm->disk[disk_no].ph3_energy > 1000) {
-        iwm->disk[disk_no].stepper_pos++;
-      } else if (iwm->disk[disk_no].ph1_energy > 1000) {
-        iwm->disk[disk_no].stepper_pos--;
-      }
+  if (value == 0xD5) {
+    disk->write_prologue_n = 1;
+  } else if (disk->write_prologue_n == 1 && value == 0xAA) {
+    disk->write_prologue_n = 2;
+  } else if (disk->write_prologue_n == 2 && (value == 0x96 || value == 0xAD)) {
+    disk->write_field = value;
+    disk->write_n = (value == 0x96) ? 8 : DISK_NIBBLES;
+    disk->write_prologue_n = 0;
+  } else {
+    disk->write_prologue_n = 0;
+  }
+}
+
+
+
+/* Cycle count at which the stepper motor moves after the last sync, or 0 if
+   it stays put. Only one move is possible, since the phase that pulled the
+   rotor then holds it. */
+static uint64_t disk_step_next(iwm_t *iwm, disk_t *disk, int *direction)
+{
+  int own = disk->stepper_pos % 4;
+  int next = (own + 1) % 4;
+  int prev = (own + 3) % 4;
+  uint64_t next_cycle = 0;
+  uint64_t prev_cycle = 0;
+
+  if (iwm->stepper_phases & (1 << own)) {
+    return 0;
+  }
+
+  /* The rotor moves on the first cycle a neighbour phase has been on for
+     long enough, and can not move below track 0. */
+  if (iwm->stepper_phases & (1 << next)) {
+    next_cycle = iwm->ph_cycle[next] + DISK_STEP_ENERGY + 1;
+    if (next_cycle <= iwm->stepper_cycle) {
+      next_cycle = iwm->stepper_cycle + 1;
     }
-    break;
+  }
+  if ((iwm->stepper_phases & (1 << prev)) && disk->stepper_pos > 0) {
+    prev_cycle = iwm->ph_cycle[prev] + DISK_STEP_ENERGY + 1;
+    if (prev_cycle <= iwm->stepper_cycle) {
+      prev_cycle = iwm->stepper_cycle + 1;
+    }
+  }
 
-  case 3:
-    if (iwm->disk[disk_no].ph3_energy == 0) {
-      if (iwm->disk[disk_no].ph0_energy > 1000) {
-        iwm->disk[disk_no].stepper_pos++;
-      } else if (iwm->disk[disk_no].ph2_energy > 1000) {
-        iwm->disk[disk_no].stepper_pos--;
-      }
+  if (next_cycle != 0 && (prev_cycle == 0 || next_cycle <= prev_cycle)) {
+    *direction = 1;
+    return next_cycle;
+  } else if (prev_cycle != 0) {
+    *direction = -1;
+    return prev_cycle;
+  }
+  return 0;
+}
+
+
+
+static void disk_step(iwm_t *iwm, int disk_no, uint64_t now)
+{
+  disk_t *disk = &iwm->disk[disk_no];
+  int prev_track = disk->stepper_pos / 2;
+  uint64_t move;
+  int direction;
+
+  /* Simulate movement of drive stepper motor. */
+  move = disk_step_next(iwm, disk, &direction);
+  if (move == 0 || move > now) {
+    return;
+  }
+  disk->stepper_pos += direction;
+
+  /* Change track if the stepper motor has moved and it is enabled. WOZ
+     images are mapped by quarter tracks, of which the stepper motor
+     simulation reaches every other. */
+  if (iwm->stepper_motor_on) {
+    if (disk->interleave == DISK_INTERLEAVE_WOZ) {
+      woz_seek(&disk->woz, disk->stepper_pos * 2);
+    } else if (prev_track != disk->stepper_pos / 2) {
+      iwm_trace(iwm, "[E] D%d, T%d -> T%d\n", disk_no, prev_track,
+      disk->stepper_pos / 2);
+      disk_load_track(iwm, disk_no, disk->stepper_pos / 2);
     }
-    break;
   }
+}
+
+
+
+/* Catch up with the stepper motor simulation, then apply the current
+   switches and schedule the next move. */
+static void iwm_sync(iwm_t *iwm, uint64_t now)
+{
+  uint8_t phases;
+  uint64_t move;
+  int direction;
+  int disk_no;
+  int i;
 
-  /* Change track if the stepper motor has moved and it is enabled. */
-  if (iwm->motor_on) {
-    if (prev_track != iwm->disk[disk_no].stepper_pos / 2) {
-      iwm_trace("[E] D%d, T%d -> T%d\n", disk_no, prev_track,
-      iwm->disk[disk_no].stepper_pos / 2);
-      disk_load_track(iwm, disk_no, iwm->disk[disk_no].stepper_pos / 2);
+  disk_no = iwm->stepper_drive_select ? 1 : 0;
+  if (iwm->disk[disk_no].loaded) {
+    disk_step(iwm, disk_no, now);
+  }
+  iwm->stepper_cycle = now;
+
+  /* Time stamp the phases turned on, a newly selected drive has not seen
+     any of them before. */
+  phases = iwm->ph0 | (iwm->ph1 << 1) | (iwm->ph2 << 2) | (iwm->ph3 << 3);
+  for (i = 0; i < 4; i++) {
+    if ((phases & (1 << i)) && (! (iwm->stepper_phases & (1 << i)) ||
+      iwm->drive_select != iwm->stepper_drive_select)) {
+      iwm->ph_cycle[i] = now;
     }
   }
+  iwm->stepper_phases = phases;
+  iwm->stepper_motor_on = iwm->motor_on;
+  iwm->stepper_drive_select = iwm->drive_select;
+
+  disk_no = iwm->stepper_drive_select ? 1 : 0;
+  move = 0;
+  if (iwm->disk[disk_no].loaded) {
+    move = disk_step_next(iwm, &iwm->disk[disk_no], &direction);
+  }
+  if (move != 0) {
+    sched_add(iwm->sched, &iwm->stepper, move);
+  } else {
+    sched_remove(iwm->sched, &iwm->stepper);
+  }
+}
+
+
+
+static void iwm_stepper(void *iwm, uint64_t now)
+{
+  iwm_sync(iwm, now);
+}
+
+
+
+/* Save from the emulation, which breaks into the debugger if it fails. */
+static void iwm_disk_save(iwm_t *iwm, int disk_no)
+{
+  disk_t *disk = &iwm->disk[disk_no];
+
+  if (iwm_disk_flush(iwm, disk_no) != 0) {
+    panic(iwm->mem->machine, "Saving of disk %s '%s' failed!\n",
+      (disk->overlay) ? "overlay" : "image",
+      (disk->overlay) ? disk->overlay_filename : disk->filename);
+  }
+}
+
+
+
+static void iwm_flush(void *iwm, uint64_t now)
+{
+  (void)now;
+  iwm_disk_save(iwm, 0);
+  iwm_disk_save(iwm, 1);
 }
 
 
@@ -306,15 +660,28 @@ static void iwm_switch(iwm_t *iwm, uint16_t address)
     iwm->ph3 = true;
     break;
   case 0xC0E8:
+    if (iwm->motor_on) {
+      sched_add(iwm->sched, &iwm->flush, iwm->sched->now + IWM_FLUSH_CYCLES);
+    }
     iwm->motor_on = false;
     break;
   case 0xC0E9:
+    sched_remove(iwm->sched, &iwm->flush);
+    if (! iwm->motor_on) {
+      disk_spin_start(iwm, &iwm->disk[iwm->drive_select ? 1 : 0]);
+    }
     iwm->motor_on = true;
     break;
   case 0xC0EA:
+    if (iwm->drive_select) {
+      disk_spin_start(iwm, &iwm->disk[0]);
+    }
     iwm->drive_select = false;
     break;
   case 0xC0EB:
+    if (! iwm->drive_select) {
+      disk_spin_start(iwm, &iwm->disk[1]);
+    }
     iwm->drive_select = true;
     break;
   case 0xC0EC:
@@ -330,6 +697,13 @@ static void iwm_switch(iwm_t *iwm, uint16_t address)
     iwm->l7 = true;
     break;
   }
+
+  /* Stop the CPU and catch up with the stepper motor simulation before the
+     new switches take effect, the cycles until now ran with the old ones. */
+  if (address <= 0xC0EB) {
+    sched_add(iwm->sched, &iwm->stepper, iwm->sched->now);
+    iwm->mem->io_event = true;
+  }
 }
 
 
@@ -348,21 +722,24 @@ static uint8_t iwm_read(void *iwm, uint16_t address)
     disk_no = ((iwm_t *)iwm)->drive_select ? 1 : 0;
     if (((iwm_t *)iwm)->disk[disk_no].loaded) {
       ((iwm_t *)iwm)->data = disk_spin_and_read(iwm, disk_no);
-      iwm_trace("[R] Data=0x%02x\n", ((iwm_t *)iwm)->data);
+      iwm_trace(iwm, "[R] Data=0x%02x\n", ((iwm_t *)iwm)->data);
       return ((iwm_t *)iwm)->data;
     } else {
       return 0xFF;
     }
 
   } else if (((iwm_t *)iwm)->l6 == false && ((iwm_t *)iwm)->l7 == true) {
-    iwm_trace("[R] Handshake=0x%02x\n", ((iwm_t *)iwm)->handshake);
+    iwm_trace(iwm, "[R] Handshake=0x%02x\n", ((iwm_t *)iwm)->handshake);
     return ((iwm_t *)iwm)->handshake;
 
   } else if (((iwm_t *)iwm)->l6 == true && ((iwm_t *)iwm)->l7 == false) {
     ((iwm_t *)iwm)->status = 0;
     ((iwm_t *)iwm)->status |= (((iwm_t *)iwm)->mode & 0x1F);
     ((iwm_t *)iwm)->status |= (((iwm_t *)iwm)->motor_on << 5);
-    iwm_trace("[R] Status=0x%02x\n", ((iwm_t *)iwm)->status);
+    disk_no = ((iwm_t *)iwm)->drive_select ? 1 : 0;
+    ((iwm_t *)iwm)->status |=
+      (((iwm_t *)iwm)->disk[disk_no].write_protected << 7);
+    iwm_trace(iwm, "[R] Status=0x%02x\n", ((iwm_t *)iwm)->status);
     return ((iwm_t *)iwm)->status;
   }
 
@@ -373,6 +750,7 @@ static uint8_t iwm_read(void *iwm, uint16_t address)
 
 static void iwm_write(void *iwm, uint16_t address, uint8_t value)
 {
+  int disk_no;
   iwm_switch(iwm, address);
 
   /* Write is done on odd-numbered addresses only. */
@@ -382,22 +760,38 @@ static void iwm_write(void *iwm, uint16_t address, uint8_t value)
 
   if (((iwm_t *)iwm)->l6 == true && ((iwm_t *)iwm)->l7 == true) {
     if (((iwm_t *)iwm)->motor_on == false) {
-      iwm_trace("[W] Mode=0x%02x\n", value);
+      iwm_trace(iwm, "[W] Mode=0x%02x\n", value);
       ((iwm_t *)iwm)->mode = value;
     } else {
-      iwm_trace("[W] Data=0x%02x\n", value);
-      /* NOTE: Write of data is not implemented... */
+      iwm_trace(iwm, "[W] Data=0x%02x\n", value);
+      disk_no = ((iwm_t *)iwm)->drive_select ? 1 : 0;
+      if (((iwm_t *)iwm)->disk[disk_no].loaded &&
+          ! ((iwm_t *)iwm)->disk[disk_no].write_protected) {
+        /* Written bytes are paced by the software, starting from where
+           the disk has turned to. */
+        if (! ((iwm_t *)iwm)->fast_disk) {
+          disk_spin(iwm, &((iwm_t *)iwm)->disk[disk_no]);
+        }
+        disk_write(iwm, disk_no, value);
+        ((iwm_t *)iwm)->disk[disk_no].spin_cycle =
+          *((iwm_t *)iwm)->mem->cycle_count + DISK_BYTE_CYCLES;
+      }
     }
   }
 }
 
 
 
-void iwm_init(iwm_t *iwm, mem_t *mem)
+void iwm_init(iwm_t *iwm, mem_t *mem, sched_t *sched)
 {
   int i;
 
   memset(iwm, 0, sizeof(iwm_t));
+  iwm->mem = mem;
+  iwm->sched = sched;
+  sched_event_init(&iwm->stepper, iwm_stepper, iwm);
+  sched_event_init(&iwm->flush, iwm_flush, iwm);
+  iwm->stepper_cycle = sched->now;
 
   for (i = 0xE0; i <= 0xEF; i++) {
     mem->io_read[i].func = iwm_read;
@@ -407,37 +801,25 @@ void iwm_init(iwm_t *iwm, mem_t *mem)
   }
 
   for (i = 0; i < IWM_TRACE_BUFFER_SIZE; i++) {
-    iwm_trace_buffer[i][0] = '\0';
-  }
-  iwm_trace_buffer_n = 0;
-}
-
-
-
-void iwm_execute(iwm_t *iwm)
-{
-  int disk_no;
-
-  disk_no = iwm->drive_select ? 1 : 0;
-  if (iwm->disk[disk_no].loaded) {
-    disk_step(iwm, disk_no);
+    iwm->trace_buffer[i][0] = '\0';
   }
+  iwm->trace_buffer_n = 0;
 }
 
 
 
-void iwm_trace_dump(FILE *fh)
+void iwm_trace_dump(iwm_t *iwm, FILE *fh)
 {
   int i;
 
-  for (i = iwm_trace_buffer_n; i < IWM_TRACE_BUFFER_SIZE; i++) {
-    if (iwm_trace_buffer[i][0] != '\0') {
-      fprintf(fh, iwm_trace_buffer[i]);
+  for (i = iwm->trace_buffer_n; i < IWM_TRACE_BUFFER_SIZE; i++) {
+    if (iwm->trace_buffer[i][0] != '\0') {
+      fprintf(fh, iwm->trace_buffer[i]);
     }
   }
-  for (i = 0; i < iwm_trace_buffer_n; i++) {
-    if (iwm_trace_buffer[i][0] != '\0') {
-      fprintf(fh, iwm_trace_buffer[i]);
+  for (i = 0; i < iwm->trace_buffer_n; i++) {
+    if (iwm->trace_buffer[i][0] != '\0') {
+      fprintf(fh, iwm->trace_buffer[i]);
     }
   }
 }
@@ -445,7 +827,7 @@ void iwm_trace_dump(FILE *fh)
 
 
 static disk_interleave_t iwm_disk_type_detect(const char *filename,
-  uint8_t data[])
+  uint8_t data[], size_t size)
 {
   const char *ext;
 
@@ -459,9 +841,31 @@ static disk_interleave_t iwm_disk_type_detect(const char *filename,
     } else if ((strcmp(ext, ".po") == 0) ||
                (strcmp(ext, ".PO") == 0)) { /* ProDOS extension. */
       return DISK_INTERLEAVE_PRODOS;
+
+    } else if ((strcmp(ext, ".woz") == 0) ||
+               (strcmp(ext, ".WOZ") == 0)) { /* WOZ extension. */
+      return DISK_INTERLEAVE_WOZ;
+
+    } else if ((strcmp(ext, ".nib") == 0) ||
+               (strcmp(ext, ".NIB") == 0)) { /* NIB extension. */
+      return DISK_INTERLEAVE_NIB;
     }
   }
 
+  /* Check for WOZ header. */
+  if (size >= 8 && woz_detect(data)) {
+    return DISK_INTERLEAVE_WOZ;
+  }
+
+  /* Only NIB images have this size. */
+  if (size == DISK_NIB_SIZE) {
+    return DISK_INTERLEAVE_NIB;
+  }
+
+  if (size < 5) {
+    return DISK_INTERLEAVE_RAW;
+  }
+
   /* Check for DOS signature. */
   if (data[0x0] == 0x01 &&
       data[0x1] == 0xA5 &&
@@ -485,57 +889,691 @@ static disk_interleave_t iwm_disk_type_detect(const char *filename,
 
 
 
-int iwm_disk_load(iwm_t *iwm, int disk_no, const char *filename,
-  int interleave_override)
+static uint32_t disk_2mg_read32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+
+/* Use the header of a 2MG image to find the payload and its type, returns
+   false if the image has no such header. */
+static bool disk_2mg_detect(disk_t *disk, size_t *offset,
+  disk_interleave_t *interleave)
+{
+  uint32_t flags;
+
+  if (disk->map_size < DISK_2MG_HEADER_SIZE ||
+      memcmp(disk->map, "2IMG", 4) != 0) {
+    return false;
+  }
+
+  switch (disk_2mg_read32(&disk->map[0x0C])) {
+  case 0:
+    *interleave = DISK_INTERLEAVE_DOS;
+    break;
+  case 1:
+    *interleave = DISK_INTERLEAVE_PRODOS;
+    break;
+  default:
+    *interleave = DISK_INTERLEAVE_NIB;
+    break;
+  }
+
+  *offset = disk_2mg_read32(&disk->map[0x18]);
+  if (*offset > disk->map_size) {
+    *offset = disk->map_size;
+  }
+
+  flags = disk_2mg_read32(&disk->map[0x10]);
+  if (flags & 0x80000000) {
+    disk->write_protected = true; /* Locked. */
+  }
+  return true;
+}
+
+
+
+/* Map the image file copy on write, so the page cache is shared by every
+   emulator using it and writes only reach the file when it is flushed. */
+static int disk_map(disk_t *disk, const char *filename)
+{
+  struct stat st;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  disk->map_size = st.st_size;
+  if (disk->map_size > 0) {
+    disk->map = mmap(NULL, disk->map_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE, fd, 0);
+  } else {
+    disk->map = mmap(NULL, 1, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    disk->map_size = 1; /* Nothing to map, treated as a short image. */
+  }
+  close(fd);
+
+  if (disk->map == MAP_FAILED) {
+    disk->map = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+
+
+static void disk_unmap(disk_t *disk)
+{
+  if (disk->map != NULL) {
+    munmap(disk->map, disk->map_size);
+    disk->map = NULL;
+    disk->map_size = 0;
+  }
+}
+
+
+
+/* Images shorter than their format are read as if padded with zeroes, into
+   memory of their own since the file mapping can not be extended. */
+static int disk_map_extend(disk_t *disk, size_t size)
+{
+  uint8_t *map;
+
+  if (disk->map_size >= size) {
+    return 0;
+  }
+
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  memcpy(map, disk->map, disk->map_size);
+  munmap(disk->map, disk->map_size);
+  disk->map = map;
+  disk->map_size = size;
+  return 0;
+}
+
+
+
+/* Inflate one or more gzip members into the unpacked image. */
+static size_t disk_gunzip(const uint8_t *in, size_t in_size, uint8_t *out,
+  size_t out_size)
+{
+  z_stream z;
+  int result;
+
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, 15 + 16) != Z_OK) {
+    return 0;
+  }
+  z.next_in = (uint8_t *)in;
+  z.avail_in = in_size;
+  z.next_out = out;
+  z.avail_out = out_size;
+
+  do {
+    result = inflate(&z, Z_NO_FLUSH);
+    if (result == Z_STREAM_END && z.avail_in > 0) {
+      result = inflateReset(&z); /* Concatenated member. */
+    }
+  } while (result == Z_OK && z.avail_out > 0);
+  inflateEnd(&z);
+
+  return (result == Z_STREAM_END) ? out_size - z.avail_out : 0;
+}
+
+
+
+#ifdef DISK_ZSTD
+static size_t disk_unzstd(const uint8_t *in, size_t in_size, uint8_t *out,
+  size_t out_size)
+{
+  ZSTD_DStream *stream;
+  ZSTD_inBuffer input = {in, in_size, 0};
+  ZSTD_outBuffer output = {out, out_size, 0};
+  size_t result;
+
+  stream = ZSTD_createDStream();
+  if (stream == NULL) {
+    return 0;
+  }
+  ZSTD_initDStream(stream);
+  do {
+    result = ZSTD_decompressStream(stream, &output, &input);
+  } while (! ZSTD_isError(result) && input.pos < input.size &&
+    output.pos < output.size);
+  ZSTD_freeDStream(stream);
+
+  return (! ZSTD_isError(result) && result == 0 && input.pos == input.size) ?
+    output.pos : 0;
+}
+#endif /* DISK_ZSTD */
+
+
+
+/* Replace a gzip or zstd compressed image with its contents, decoded
+   straight from the file mapping into anonymous memory. Address space for
+   the largest image is reserved and the unused end released afterwards.
+   Returns 1 if unpacked, 0 if not compressed or -1 on error. */
+static int disk_unpack(disk_t *disk)
+{
+  size_t (*decode)(const uint8_t *, size_t, uint8_t *, size_t);
+  uint8_t *map;
+  size_t size;
+  size_t used;
+
+  if (disk->map_size >= 2 && disk->map[0] == 0x1F && disk->map[1] == 0x8B) {
+    decode = disk_gunzip;
+  } else if (disk->map_size >= 4 && disk->map[0] == 0x28 &&
+    disk->map[1] == 0xB5 && disk->map[2] == 0x2F && disk->map[3] == 0xFD) {
+#ifdef DISK_ZSTD
+    decode = disk_unzstd;
+#else
+    return -1; /* Built without zstd support. */
+#endif /* DISK_ZSTD */
+  } else {
+    return 0;
+  }
+
+  map = mmap(NULL, DISK_UNPACK_MAX, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  size = decode(disk->map, disk->map_size, map, DISK_UNPACK_MAX);
+  if (size == 0) {
+    munmap(map, DISK_UNPACK_MAX);
+    return -1;
+  }
+
+  used = (size + sysconf(_SC_PAGESIZE) - 1) & ~(sysconf(_SC_PAGESIZE) - 1);
+  if (used < DISK_UNPACK_MAX) {
+    munmap(&map[used], DISK_UNPACK_MAX - used);
+  }
+  munmap(disk->map, disk->map_size);
+  disk->map = map;
+  disk->map_size = size;
+  return 1;
+}
+
+
+
+/* Filename without a compression extension, for the type detection. */
+static void disk_unpacked_filename(const char *filename, char *unpacked)
 {
+  char *ext;
+
+  snprintf(unpacked, PATH_MAX, "%s", filename);
+  ext = strrchr(unpacked, '.');
+  if (ext != NULL && ext != unpacked &&
+      (strcasecmp(ext, ".gz") == 0 || strcasecmp(ext, ".zst") == 0)) {
+    *ext = '\0';
+  }
+}
+
+
+
+static size_t disk_data_size(disk_t *disk)
+{
+  return (disk->interleave == DISK_INTERLEAVE_NIB) ? DISK_NIB_SIZE : DISK_SIZE;
+}
+
+
+
+/* FNV-1a, to tell if a delta file was made against the same image. */
+static uint32_t disk_checksum(const uint8_t *data, size_t size)
+{
+  uint32_t hash = 0x811C9DC5;
+  size_t i;
+
+  for (i = 0; i < size; i++) {
+    hash = (hash ^ data[i]) * 0x01000193;
+  }
+  return hash;
+}
+
+
+
+static uint32_t disk_read32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+
+static void disk_write32(uint8_t *p, uint32_t value)
+{
+  p[0] = value & 0xFF;
+  p[1] = (value >> 8) & 0xFF;
+  p[2] = (value >> 16) & 0xFF;
+  p[3] = value >> 24;
+}
+
+
+
+/* Apply the delta file on top of the image data. Only the pages it touches
+   are copied out of the shared mapping. A missing delta file is an empty
+   one, a delta made against another image is refused. */
+static int disk_overlay_load(disk_t *disk)
+{
+  uint8_t header[DISK_OVERLAY_HEADER_SIZE];
+  uint8_t chunk[2];
+  size_t size;
   FILE *fh;
   int n;
-  int c;
 
-  iwm->disk[disk_no].loaded = false;
+  size = disk_data_size(disk);
+  disk->overlay_base = disk_checksum(disk->data, size);
+  memset(disk->changed, 0, sizeof(disk->changed));
+  if (disk->overlay_filename[0] == '\0') {
+    return 0;
+  }
 
-  if (filename == NULL) {
-    return 0; /* Just unload the image. */
+  fh = fopen(disk->overlay_filename, "rb");
+  if (fh == NULL) {
+    return (errno == ENOENT) ? 0 : -1;
+  }
+  if (fread(header, 1, DISK_OVERLAY_HEADER_SIZE, fh) !=
+        DISK_OVERLAY_HEADER_SIZE ||
+      memcmp(header, DISK_OVERLAY_MAGIC, 4) != 0 ||
+      disk_read32(&header[4]) != size ||
+      disk_read32(&header[8]) != disk->overlay_base) {
+    fclose(fh);
+    return -1;
   }
 
-  fh = fopen(filename, "rb");
+  while (fread(chunk, 1, 2, fh) == 2) {
+    n = chunk[0] | (chunk[1] << 8);
+    if ((size_t)n >= size / DISK_SECTOR_SIZE ||
+        fread(&disk->data[n * DISK_SECTOR_SIZE], 1, DISK_SECTOR_SIZE, fh) !=
+        DISK_SECTOR_SIZE) {
+      fclose(fh);
+      return -1;
+    }
+    disk->changed[n] = true;
+  }
+  fclose(fh);
+  return 0;
+}
+
+
+
+/* Make a rename in the directory of a file durable. */
+static int disk_dir_sync(const char *filename)
+{
+  char dir_filename[PATH_MAX];
+  int fd;
+  int result;
+
+  snprintf(dir_filename, PATH_MAX, "%s", filename);
+  fd = open(dirname(dir_filename), O_RDONLY | O_DIRECTORY);
+  if (fd == -1) {
+    return -1;
+  }
+  result = fsync(fd);
+  close(fd);
+  return result;
+}
+
+
+
+/* Save every changed sector to the delta file, replacing it in one rename
+   like the image itself. */
+static int disk_overlay_save(disk_t *disk)
+{
+  char tmp_filename[PATH_MAX];
+  uint8_t header[DISK_OVERLAY_HEADER_SIZE];
+  uint8_t chunk[2];
+  size_t size;
+  FILE *fh;
+  int fd;
+  int n;
+
+  if (disk->overlay_filename[0] == '\0') {
+    return 0; /* Kept in memory only. */
+  }
+  if (snprintf(tmp_filename, PATH_MAX, "%s.XXXXXX", disk->overlay_filename)
+    >= PATH_MAX) {
+    return -1;
+  }
+  fd = mkstemp(tmp_filename);
+  if (fd == -1) {
+    return -1;
+  }
+  fchmod(fd, 0644);
+  fh = fdopen(fd, "wb");
   if (fh == NULL) {
+    close(fd);
+    unlink(tmp_filename);
+    return -1;
+  }
+
+  size = disk_data_size(disk);
+  memcpy(header, DISK_OVERLAY_MAGIC, 4);
+  disk_write32(&header[4], size);
+  disk_write32(&header[8], disk->overlay_base);
+  fwrite(header, 1, DISK_OVERLAY_HEADER_SIZE, fh);
+  for (n = 0; (size_t)n < size / DISK_SECTOR_SIZE; n++) {
+    if (disk->changed[n]) {
+      chunk[0] = n & 0xFF;
+      chunk[1] = n >> 8;
+      fwrite(chunk, 1, 2, fh);
+      fwrite(&disk->data[n * DISK_SECTOR_SIZE], 1, DISK_SECTOR_SIZE, fh);
+    }
+  }
+  if (ferror(fh) || fflush(fh) != 0 || fsync(fd) != 0) {
+    fclose(fh);
+    unlink(tmp_filename);
     return -1;
   }
+  fclose(fh);
 
+  if (rename(tmp_filename, disk->overlay_filename) != 0) {
+    unlink(tmp_filename);
+    return -1;
+  }
+  return disk_dir_sync(disk->overlay_filename);
+}
+
+
+
+/* Keep the writes to a drive out of its image files from the next load on,
+   in memory only if there is no delta filename. */
+int iwm_disk_overlay_set(iwm_t *iwm, int disk_no, const char *filename)
+{
   if (disk_no != 0 && disk_no != 1) {
     return -2;
   }
+  iwm->disk[disk_no].overlay = true;
+  snprintf(iwm->disk[disk_no].overlay_filename, PATH_MAX, "%s",
+    (filename != NULL) ? filename : "");
+  return 0;
+}
 
-  n = 0;
-  while ((c = fgetc(fh)) != EOF) {
-    iwm->disk[disk_no].data[n] = c;
-    n++;
-    if (n > DISK_SIZE) {
-      break;
-    }
+
+
+int iwm_disk_load(iwm_t *iwm, int disk_no, const char *filename,
+  int interleave_override)
+{
+  disk_t *disk;
+  disk_interleave_t interleave;
+  char unpacked_filename[PATH_MAX];
+  size_t offset;
+  int unpacked;
+  int i;
+
+  if (disk_no != 0 && disk_no != 1) {
+    return -2;
+  }
+  disk = &iwm->disk[disk_no];
+
+  iwm_sync(iwm, iwm->sched->now);
+  if (iwm_disk_flush(iwm, disk_no) != 0) {
+    return -1; /* Keep the image, rather than lose the writes to it. */
+  }
+  disk->loaded = false;
+  disk_unmap(disk);
+
+  /* Drop the tracks encoded or loaded from the previous image. */
+  for (i = 0; i < DISK_TRACKS; i++) {
+    free(disk->nibble[i]);
+    disk->nibble[i] = NULL;
+  }
+  woz_free(&disk->woz);
+
+  if (filename == NULL) {
+    return 0; /* Just unload the image. */
   }
-  fclose(fh);
 
-  if (interleave_override > 0) {
-    iwm->disk[disk_no].interleave = interleave_override;
+  if (disk_map(disk, filename) != 0) {
+    return -1;
+  }
+  unpacked = disk_unpack(disk);
+  if (unpacked < 0) {
+    disk_unmap(disk);
+    return -1;
+  }
+  disk_unpacked_filename(filename, unpacked_filename);
+
+  snprintf(disk->filename, PATH_MAX, "%s", filename);
+  /* Compressed images are not written back, except to an overlay. */
+  disk->write_protected = (unpacked > 0 || access(filename, W_OK) != 0);
+  disk->write_prologue_n = 0;
+  disk->write_n = 0;
+  disk->write_sector = -1;
+
+  /* A 2MG image is a header around one of the other types. */
+  if (disk_2mg_detect(disk, &offset, &interleave)) {
+    if (interleave_override > 0) {
+      interleave = interleave_override;
+    }
   } else {
-    /* Try to automatically determine the type. */
-    iwm->disk[disk_no].interleave = iwm_disk_type_detect(filename,
-      iwm->disk[disk_no].data);
+    offset = 0;
+    if (interleave_override > 0) {
+      interleave = interleave_override;
+    } else {
+      /* Try to automatically determine the type. */
+      interleave = iwm_disk_type_detect(unpacked_filename, disk->map,
+        disk->map_size);
+    }
+  }
+  disk->interleave = interleave;
+
+  if (interleave == DISK_INTERLEAVE_WOZ) {
+    if (woz_load(&disk->woz, &disk->map[offset],
+      disk->map_size - offset) != 0) {
+      disk_unmap(disk);
+      return -1;
+    }
+    disk->write_protected = true; /* Writes need sectors or nibbles. */
+  } else if (disk_map_extend(disk, offset +
+    ((interleave == DISK_INTERLEAVE_NIB) ? DISK_NIB_SIZE : DISK_SIZE)) != 0) {
+    disk_unmap(disk);
+    return -1;
+  }
+  disk->data = &disk->map[offset];
+  disk->track_size = (interleave == DISK_INTERLEAVE_NIB) ?
+    DISK_NIB_TRACK_SIZE : DISK_TRACK_SIZE;
+  disk->track_n = 0;
+  disk_spin_start(iwm, disk);
+
+  if (disk->overlay && interleave != DISK_INTERLEAVE_WOZ) {
+    if (disk_overlay_load(disk) != 0) {
+      disk_unmap(disk);
+      return -1;
+    }
+    disk->write_protected = false; /* The image file is never written. */
   }
 
-  if (iwm->disk[disk_no].interleave == DISK_INTERLEAVE_DOS) {
+  if (interleave == DISK_INTERLEAVE_DOS) {
     /* Set volume number from DOS 3.3 VTOC structure on T11/S0. */
-    iwm->disk[disk_no].volume_no = iwm->disk[disk_no].data[0x11006];
+    disk->volume_no = disk->data[0x11006];
+  }
+  if (offset > 0 && (disk_2mg_read32(&disk->map[0x10]) & 0x100)) {
+    disk->volume_no = disk->map[0x10]; /* Set in the 2MG header. */
   }
 
   /* Load T0 now since there will initially be no track change detected. */
-  disk_load_track(iwm, disk_no, 0);
+  if (interleave != DISK_INTERLEAVE_WOZ) {
+    disk_load_track(iwm, disk_no, 0);
+  }
 
-  iwm->disk[disk_no].loaded = true;
+  disk->loaded = true;
+  iwm_sync(iwm, iwm->sched->now);
   return 0;
 }
 
 
 
+/* Offset in the image data of a sector, numbered in the order the DOS or
+   ProDOS software uses, or -1 if it is out of range. */
+int iwm_disk_sector_offset(iwm_t *iwm, int disk_no, int track_no,
+  int sector_no, disk_interleave_t order)
+{
+  const int *software;
+  int physical;
+
+  if (track_no < 0 || track_no >= DISK_TRACKS ||
+      sector_no < 0 || sector_no >= DISK_SECTORS) {
+    return -1;
+  }
+
+  if (order == DISK_INTERLEAVE_DOS) {
+    software = disk_interleave_dos;
+  } else if (order == DISK_INTERLEAVE_PRODOS) {
+    software = disk_interleave_prodos;
+  } else {
+    software = NULL;
+  }
+
+  /* Find the physical sector, as written by disk_encode_track(). */
+  physical = sector_no;
+  if (software != NULL) {
+    for (physical = 0; physical < DISK_SECTORS; physical++) {
+      if (software[physical] == sector_no) {
+        break;
+      }
+    }
+  }
+
+  switch (iwm->disk[disk_no].interleave) {
+  case DISK_INTERLEAVE_DOS:
+    return (track_no * DISK_SECTORS * DISK_SECTOR_SIZE) +
+           (disk_interleave_dos[physical] * DISK_SECTOR_SIZE);
+
+  case DISK_INTERLEAVE_PRODOS:
+    return (track_no * DISK_SECTORS * DISK_SECTOR_SIZE) +
+           (disk_interleave_prodos[physical] * DISK_SECTOR_SIZE);
+
+  case DISK_INTERLEAVE_RAW:
+  default:
+    return (track_no * DISK_SECTORS * DISK_SECTOR_SIZE) +
+           (physical * DISK_SECTOR_SIZE);
+  }
+}
+
+
+
+/* Mark the sector at an offset as changed in the image data, and encode its
+   track again. */
+void iwm_disk_written(iwm_t *iwm, int disk_no, int offset)
+{
+  int track_no = offset / (DISK_SECTORS * DISK_SECTOR_SIZE);
+
+  iwm->disk[disk_no].changed[offset / DISK_SECTOR_SIZE] = true;
+  iwm->disk[disk_no].dirty[track_no] = true;
+  iwm->disk[disk_no].nibble_valid[track_no] = false;
+  if (iwm->disk[disk_no].track_no == track_no) {
+    disk_load_track(iwm, disk_no, track_no);
+  }
+  if (! iwm->motor_on) { /* Written without the drive, save soon anyway. */
+    sched_add(iwm->sched, &iwm->flush, iwm->sched->now + IWM_FLUSH_CYCLES);
+  }
+}
+
+
+
+/* Save the image if any track has been written, through a temporary file
+   that replaces the image in one rename, so a crash never leaves it half
+   written. The tracks stay dirty if it fails. */
+int iwm_disk_flush(iwm_t *iwm, int disk_no)
+{
+  disk_t *disk = &iwm->disk[disk_no];
+  char tmp_filename[PATH_MAX];
+  struct stat st;
+  FILE *fh;
+  int fd;
+  int i;
+
+  for (i = 0; i < DISK_TRACKS; i++) {
+    if (disk->dirty[i]) {
+      break;
+    }
+  }
+  if (i >= DISK_TRACKS || ! disk->loaded) {
+    return 0;
+  }
+
+  if (disk->overlay) {
+    if (disk_overlay_save(disk) != 0) {
+      return -1;
+    }
+    iwm_trace(iwm, "[E] D%d, Overlay saved\n", disk_no);
+    memset(disk->dirty, 0, sizeof(disk->dirty));
+    return 0;
+  }
+
+  if (snprintf(tmp_filename, PATH_MAX, "%s.XXXXXX", disk->filename)
+    >= PATH_MAX) {
+    return -1;
+  }
+  fd = mkstemp(tmp_filename);
+  if (fd == -1) {
+    return -1;
+  }
+  if (stat(disk->filename, &st) == 0) {
+    fchmod(fd, st.st_mode & 0777);
+  }
+
+  fh = fdopen(fd, "wb");
+  if (fh == NULL ||
+      fwrite(disk->map, 1, disk->map_size, fh) != disk->map_size ||
+      fflush(fh) != 0 ||
+      fsync(fd) != 0) {
+    if (fh != NULL) {
+      fclose(fh);
+    } else {
+      close(fd);
+    }
+    unlink(tmp_filename);
+    return -1;
+  }
+  fclose(fh);
+
+  if (rename(tmp_filename, disk->filename) != 0) {
+    unlink(tmp_filename);
+    return -1;
+  }
+  if (disk_dir_sync(disk->filename) != 0) {
+    return -1;
+  }
+
+  iwm_trace(iwm, "[E] D%d, Saved\n", disk_no);
+  memset(disk->dirty, 0, sizeof(disk->dirty));
+  return 0;
+}
+
+
+
+/* Save what is still pending, reporting any failure on stderr since it is
+   too late for the debugger, and unload both drives. */
+int iwm_exit(iwm_t *iwm)
+{
+  disk_t *disk;
+  int result = 0;
+  int i;
+
+  sched_remove(iwm->sched, &iwm->flush);
+  for (i = 0; i < 2; i++) {
+    disk = &iwm->disk[i];
+    if (iwm_disk_flush(iwm, i) != 0) {
+      fprintf(stderr, "Saving of disk %s '%s' failed!\n",
+        (disk->overlay) ? "overlay" : "image",
+        (disk->overlay) ? disk->overlay_filename : disk->filename);
+      memset(disk->dirty, 0, sizeof(disk->dirty)); /* Given up on. */
+      result = -1;
+    }
+    iwm_disk_load(iwm, i, NULL, 0);
+  }
+  return result;
+}
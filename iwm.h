@@ -1,35 +1,82 @@
 #ifndef _IWM_H
 #define _IWM_H
 
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include "mem.h"
+#include "sched.h"
+#include "woz.h"
 
 #define DISK_TRACKS 35
 #define DISK_SECTORS 16
 #define DISK_SECTOR_SIZE 256
 #define DISK_SIZE (DISK_TRACKS * DISK_SECTORS * DISK_SECTOR_SIZE)
 #define DISK_TRACK_SIZE 5808 /* With address/data fields and GCR encoding. */
+#define DISK_SECTOR_NIBBLES (DISK_TRACK_SIZE / DISK_SECTORS)
+#define DISK_NIBBLES 343 /* GCR encoded sector with checksum. */
+#define DISK_STEP_ENERGY 1000 /* Cycles a phase must be on to pull the rotor. */
+#define DISK_CELL_CYCLES 4 /* Per bit cell, at 300 RPM. */
+#define DISK_BYTE_CYCLES (DISK_CELL_CYCLES * 8)
+#define DISK_ADDRESS_FIELD_SIZE 11 /* After the prologue, with epilogue. */
+#define DISK_DATA_FIELD_SIZE 346 /* After the prologue, with epilogue. */
+#define DISK_NIB_TRACK_SIZE 6656 /* Of pre-nibblized .nib images. */
+#define DISK_NIB_SIZE (DISK_TRACKS * DISK_NIB_TRACK_SIZE)
+#define DISK_2MG_HEADER_SIZE 64
+#define DISK_CHUNKS (DISK_NIB_SIZE / DISK_SECTOR_SIZE) /* Overlay units. */
+
+#define IWM_FLUSH_CYCLES 1023000 /* Delay after motor off before write-back. */
+
+#define IWM_TRACE_BUFFER_SIZE 1024
+#define IWM_TRACE_MAX 80
 
 typedef enum {
   DISK_INTERLEAVE_RAW    = 1,
   DISK_INTERLEAVE_DOS    = 2,
   DISK_INTERLEAVE_PRODOS = 3,
+  DISK_INTERLEAVE_WOZ    = 4, /* Bit streams, no sectors. */
+  DISK_INTERLEAVE_NIB    = 5, /* Nibbles, no sectors. */
 } disk_interleave_t;
 
 typedef struct disk_s {
   bool loaded;
-  int ph0_energy;
-  int ph1_energy;
-  int ph2_energy;
-  int ph3_energy;
+  bool hle; /* Serve DOS 3.3 and ProDOS calls directly from the image. */
+  bool write_protected;
+  char filename[PATH_MAX];
   int stepper_pos;
   int track_n;
+  uint64_t spin_cycle; /* When the byte at track_n has passed the head. */
+  int field_left; /* Bytes left of the field the software is reading. */
+  int prologue_n; /* Bytes of a field prologue read so far. */
   uint8_t volume_no;
   disk_interleave_t interleave;
-  uint8_t data[DISK_SIZE];
-  uint8_t track[DISK_TRACK_SIZE];
+  uint8_t *map;   /* Image file, mapped copy on write. */
+  size_t map_size;
+  uint8_t *data;  /* Sectors or nibbles, after any image header. */
+  uint8_t *track; /* Nibbles of the track under the head. */
+  int track_size;
+  int track_no;
+  uint8_t *nibble[DISK_TRACKS]; /* Allocated and encoded on first use. */
+  bool nibble_valid[DISK_TRACKS];
+  bool dirty[DISK_TRACKS]; /* Written since the image file was saved. */
+
+  /* With an overlay, the image file is never written and the sectors that
+     differ from it are kept apart, in a delta file if one is given. */
+  bool overlay;
+  char overlay_filename[PATH_MAX];
+  uint32_t overlay_base; /* Checksum of the image data the delta is for. */
+  bool changed[DISK_CHUNKS]; /* Sectors, or nibble chunks, in the overlay. */
+
+  /* Fields written by the software, decoded back into sectors. */
+  int write_prologue_n;
+  uint8_t write_field;  /* Third prologue byte of the field being written. */
+  int write_n;          /* Bytes of the field still to be collected. */
+  int write_sector;     /* Physical sector for the next data field, or -1. */
+  uint8_t write_buffer[DISK_NIBBLES];
+
+  woz_t woz; /* Replaces all of the above for WOZ images. */
 } disk_t;
 
 typedef struct iwm_s {
@@ -45,13 +92,34 @@ typedef struct iwm_s {
   uint8_t data;
   uint8_t status;
   uint8_t handshake;
+  bool fast_disk; /* Skip ahead to the next field prologue when scanning. */
   disk_t disk[2];
+  mem_t *mem;
+  sched_t *sched;
+  sched_event_t flush; /* Write-back some time after the motor stops. */
+
+  /* The stepper motor is simulated lazily up to stepper_cycle, with the
+     switches as they were at that point. */
+  sched_event_t stepper;
+  uint64_t stepper_cycle;
+  uint64_t ph_cycle[4];   /* Cycle count at which each phase was turned on. */
+  uint8_t stepper_phases; /* Bit 0 to 3 for PH0 to PH3. */
+  bool stepper_motor_on;
+  bool stepper_drive_select;
+
+  char trace_buffer[IWM_TRACE_BUFFER_SIZE][IWM_TRACE_MAX];
+  int trace_buffer_n;
 } iwm_t;
 
-void iwm_init(iwm_t *iwm, mem_t *mem);
-void iwm_trace_dump(FILE *fh);
-void iwm_execute(iwm_t *iwm);
+void iwm_init(iwm_t *iwm, mem_t *mem, sched_t *sched);
+void iwm_trace_dump(iwm_t *iwm, FILE *fh);
 int iwm_disk_load(iwm_t *iwm, int disk_no, const char *filename,
   int interleave_override);
+int iwm_disk_overlay_set(iwm_t *iwm, int disk_no, const char *filename);
+int iwm_disk_flush(iwm_t *iwm, int disk_no);
+void iwm_disk_written(iwm_t *iwm, int disk_no, int offset);
+int iwm_exit(iwm_t *iwm);
+int iwm_disk_sector_offset(iwm_t *iwm, int disk_no, int track_no,
+  int sector_no, disk_interleave_t order);
 
 #endif /* _IWM_H */
@@ -0,0 +1,145 @@
+#include "machine.h"
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "acia.h"
+#include "console.h"
+#include "hle.h"
+#include "iwm.h"
+#include "mem.h"
+#include "panic.h"
+#include "sched.h"
+#include "smartport.h"
+#include "w65c02.h"
+#include "w65c02_jit.h"
+#include "w65c02_trace.h"
+
+
+
+int machine_init(a2c_machine_t *machine, const char *tty_device)
+{
+  memset(machine, 0, sizeof(a2c_machine_t));
+
+  mem_init(&machine->mem);
+  machine->mem.machine = machine;
+  machine->mem.cycle_count = &machine->cpu.cycle_count;
+
+  sched_init(&machine->sched);
+
+  iwm_init(&machine->iwm, &machine->mem, &machine->sched);
+  acia_init(&machine->acia1, &machine->mem, &machine->sched, 0xC098, NULL);
+  if (acia_init(&machine->acia2, &machine->mem, &machine->sched, 0xC0A8,
+    tty_device) != 0) {
+    return -1;
+  }
+
+  w65c02_trace_init(&machine->trace);
+  machine->cpu.trace = &machine->trace;
+  machine->debugger_breakpoint = -1;
+
+  return 0;
+}
+
+
+
+int machine_jit_enable(a2c_machine_t *machine)
+{
+  if (machine->jit != NULL) {
+    return 0;
+  }
+
+  machine->jit = malloc(sizeof(w65c02_jit_t));
+  if (machine->jit == NULL) {
+    return -1;
+  }
+
+  if (w65c02_jit_init(machine->jit, &machine->mem) != 0) {
+    free(machine->jit);
+    machine->jit = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+
+int machine_exit(a2c_machine_t *machine)
+{
+  int result;
+
+  result = iwm_exit(&machine->iwm);
+  smartport_exit(&machine->smartport);
+  if (machine->jit != NULL) {
+    w65c02_jit_exit(machine->jit);
+    free(machine->jit);
+    machine->jit = NULL;
+  }
+  return result;
+}
+
+
+
+int machine_run(a2c_machine_t *machine, int budget)
+{
+  int cycles;
+
+  /* Run the CPU uninterrupted until the earliest device event. */
+  budget = sched_budget(&machine->sched, budget);
+
+  if (machine->jit != NULL) {
+    cycles = w65c02_jit_run(machine->jit, &machine->cpu, &machine->mem,
+      budget);
+  } else {
+    cycles = w65c02_run(&machine->cpu, &machine->mem, budget);
+  }
+
+  sched_run(&machine->sched, machine->cpu.cycle_count);
+  machine->mem.io_event = false;
+
+  if (console_irq(&machine->console)) {
+    w65c02_irq(&machine->cpu, &machine->mem);
+  }
+
+  if (machine->stop[machine->cpu.pc] & MACHINE_STOP_TRAP) {
+    if (! smartport_trap(machine)) {
+      hle_trap(machine);
+    }
+  }
+  if (machine->stop[machine->cpu.pc] & MACHINE_STOP_BREAKPOINT) {
+    machine->debugger_break = true;
+  }
+
+  return cycles;
+}
+
+
+
+/* Set the debugger breakpoint, or remove it with -1. */
+void machine_breakpoint_set(a2c_machine_t *machine, int32_t address)
+{
+  if (machine->debugger_breakpoint >= 0) {
+    machine->stop[machine->debugger_breakpoint] &= ~MACHINE_STOP_BREAKPOINT;
+  }
+  machine->debugger_breakpoint = address;
+  if (address >= 0) {
+    machine->stop[address] |= MACHINE_STOP_BREAKPOINT;
+  }
+}
+
+
+
+void panic(a2c_machine_t *machine, const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(machine->panic_msg, sizeof(machine->panic_msg), format, args);
+  va_end(args);
+
+  machine->debugger_break = true;
+}
@@ -0,0 +1,47 @@
+#ifndef _MACHINE_H
+#define _MACHINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "acia.h"
+#include "console.h"
+#include "iwm.h"
+#include "mem.h"
+#include "sched.h"
+#include "smartport.h"
+#include "w65c02.h"
+#include "w65c02_jit.h"
+#include "w65c02_trace.h"
+
+#define MACHINE_PANIC_MAX 80
+
+#define MACHINE_STOP_BREAKPOINT 0x01
+#define MACHINE_STOP_TRAP       0x02
+
+typedef struct a2c_machine_s {
+  w65c02_t cpu;
+  mem_t mem;
+  sched_t sched; /* Device events on the CPU cycle count timeline. */
+  iwm_t iwm;
+  smartport_t smartport;
+  acia_t acia1;
+  acia_t acia2;
+  console_t console;
+  w65c02_trace_t trace;
+  w65c02_jit_t *jit; /* Only allocated when enabled. */
+
+  bool debugger_break;
+  bool warp_mode;
+  int32_t debugger_breakpoint;
+  char panic_msg[MACHINE_PANIC_MAX];
+
+  uint8_t stop[UINT16_MAX + 1]; /* Addresses to stop the CPU at, by PC. */
+} a2c_machine_t;
+
+int machine_init(a2c_machine_t *machine, const char *tty_device);
+int machine_jit_enable(a2c_machine_t *machine);
+int machine_exit(a2c_machine_t *machine);
+int machine_run(a2c_machine_t *machine, int budget);
+void machine_breakpoint_set(a2c_machine_t *machine, int32_t address);
+
+#endif /* _MACHINE_H */
@@ -1,6 +1,5 @@
 #include <limits.h>
 #include <signal.h>
-#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,28 +8,21 @@
 #include <sys/time.h>
 #include <unistd.h>
 
-#include "acia.h"
 #include "console.h"
 #include "debugger.h"
+#include "hle.h"
 #include "iwm.h"
+#include "machine.h"
 #include "mem.h"
-#include "panic.h"
+#include "smartport.h"
 #include "w65c02.h"
-#include "w65c02_trace.h"
 
 #define DEFAULT_ROM_FILENAME "rom_ff.bin"
+#define RUN_BUDGET 1000 /* Maximum cycles for the CPU between device updates. */
 
 
 
-static w65c02_t cpu;
-static mem_t mem;
-static iwm_t iwm;
-static acia_t acia1;
-static acia_t acia2;
-
-bool debugger_break = false;
-bool warp_mode = false;
-static char panic_msg[80];
+static a2c_machine_t machine;
 
 
 
@@ -38,22 +30,28 @@ static void sig_handler(int sig)
 {
   switch (sig) {
   case SIGINT:
-    debugger_break = true;
+    machine.debugger_break = true;
     return;
   }
 }
 
 
 
-void panic(const char *format, ...)
+static void machine_exit_handler(void)
 {
-  va_list args;
+  /* Saves any disk writes still pending, a failure changes the exit status
+     from here, as exit() has already been called. */
+  if (machine_exit(&machine) != 0) {
+    fflush(stdout);
+    _exit(EXIT_FAILURE);
+  }
+}
 
-  va_start(args, format);
-  vsnprintf(panic_msg, sizeof(panic_msg), format, args);
-  va_end(args);
 
-  debugger_break = true;
+
+static void console_exit_handler(void)
+{
+  console_exit(&machine.console); /* Gives the terminal back. */
 }
 
 
@@ -67,9 +65,21 @@ static void display_help(const char *progname)
      "  -h        Display this help.\n"
      "  -b        Break into debugger on start.\n"
      "  -w        Warp (full speed) mode.\n"
+     "  -f        Fast disk, skip rotational waiting for the next field.\n"
+     "  -e DRIVES Serve DOS 3.3 RWTS and ProDOS block access directly from\n"
+     "            the images in DRIVES (1, 2 or 12), bypassing the IWM.\n"
+     "  -c DRIVES Keep writes to the floppy images in DRIVES (1, 2 or 12) in\n"
+     "            memory, leaving the image files unchanged.\n"
+     "  -o FILE   Keep writes to the floppy image in drive #1 in delta FILE,\n"
+     "            leaving the image file unchanged.\n"
+     "  -O FILE   Same as -o for drive #2.\n"
+     "  -n        No CPU trace collection, for faster execution.\n"
+     "  -j        JIT compile hot code to native x86-64, implies -n.\n"
      "  -r FILE   Use FILE for ROM instead of the default.\n"
      "  -t TYPE   Force override TYPE of floppy disk image for drive #1.\n"
      "  -T TYPE   Force override TYPE of floppy disk image for drive #2.\n"
+     "  -d FILE   Attach ProDOS hard disk image or host directory FILE to\n"
+     "            the SmartPort in slot 5, can be given up to 4 times.\n"
      "  -s TTY    Assign TTY device for ACIA 2 communication.\n"
 #ifdef HIRES_GUI_WINDOW
      "  -g        Run a window for HiRes graphics output in parallel.\n"
@@ -79,10 +89,14 @@ static void display_help(const char *progname)
     "  %d = Raw\n"
     "  %d = DOS sectoring/interleaving\n"
     "  %d = ProDOS sectoring/interleaving\n"
+    "  %d = WOZ bit stream\n"
+    "  %d = NIB nibbles\n"
     "\n",
     DISK_INTERLEAVE_RAW,
     DISK_INTERLEAVE_DOS,
-    DISK_INTERLEAVE_PRODOS);
+    DISK_INTERLEAVE_PRODOS,
+    DISK_INTERLEAVE_WOZ,
+    DISK_INTERLEAVE_NIB);
   fprintf(stdout,
     "Default ROM filename: '%s'\n", DEFAULT_ROM_FILENAME);
   fprintf(stdout,
@@ -94,27 +108,68 @@ static void display_help(const char *progname)
 int main(int argc, char *argv[])
 {
   int c;
+  int i;
   int count = 0;
+  bool break_enable = false;
+  bool warp_enable = false;
+  bool fast_disk = false;
+  char *hle_drives = "";
+  char *overlay_drives = "";
+  char *overlay_filename_1 = NULL;
+  char *overlay_filename_2 = NULL;
+  bool trace_enable = true;
+  bool jit_enable = false;
   char *rom_filename = DEFAULT_ROM_FILENAME;
   char *disk_filename_1 = NULL;
   char *disk_filename_2 = NULL;
   char *tty_device = NULL;
+  char *hdd_filename[SMARTPORT_UNITS];
+  int hdd_count = 0;
   int disk_type_1 = 0;
   int disk_type_2 = 0;
   bool gui_enable = false;
 
-  while ((c = getopt(argc, argv, "hbwr:t:T:s:g")) != -1) {
+  while ((c = getopt(argc, argv, "hbwfe:c:o:O:njr:t:T:d:s:g")) != -1) {
     switch (c) {
     case 'h':
       display_help(argv[0]);
       return EXIT_SUCCESS;
 
     case 'b':
-      debugger_break = true;
+      break_enable = true;
       break;
 
     case 'w':
-      warp_mode = true;
+      warp_enable = true;
+      break;
+
+    case 'f':
+      fast_disk = true;
+      break;
+
+    case 'e':
+      hle_drives = optarg;
+      break;
+
+    case 'c':
+      overlay_drives = optarg;
+      break;
+
+    case 'o':
+      overlay_filename_1 = optarg;
+      break;
+
+    case 'O':
+      overlay_filename_2 = optarg;
+      break;
+
+    case 'n':
+      trace_enable = false;
+      break;
+
+    case 'j':
+      jit_enable = true;
+      trace_enable = false;
       break;
 
     case 'r':
@@ -129,6 +184,15 @@ int main(int argc, char *argv[])
       disk_type_2 = atoi(optarg);
       break;
 
+    case 'd':
+      if (hdd_count >= SMARTPORT_UNITS) {
+        fprintf(stdout, "Only %d hard disk images supported!\n",
+          SMARTPORT_UNITS);
+        return EXIT_FAILURE;
+      }
+      hdd_filename[hdd_count++] = optarg;
+      break;
+
     case 's':
       tty_device = optarg;
       break;
@@ -153,38 +217,67 @@ int main(int argc, char *argv[])
     }
   }
 
-  w65c02_trace_init();
-  panic_msg[0] = '\0';
-  mem_init(&mem);
-  iwm_init(&iwm, &mem);
-  acia_init(&acia1, &mem, 0xC098, NULL);
-
-  if (acia_init(&acia2, &mem, 0xC0A8, tty_device) != 0) {
+  if (machine_init(&machine, tty_device) != 0) {
     return EXIT_FAILURE;
   }
+  atexit(machine_exit_handler);
+  machine.debugger_break = break_enable;
+  machine.warp_mode = warp_enable;
+  machine.iwm.fast_disk = fast_disk;
+  if (strchr(hle_drives, '1') != NULL) {
+    hle_enable(&machine, 0);
+  }
+  if (strchr(hle_drives, '2') != NULL) {
+    hle_enable(&machine, 1);
+  }
+  if (strchr(overlay_drives, '1') != NULL || overlay_filename_1 != NULL) {
+    iwm_disk_overlay_set(&machine.iwm, 0, overlay_filename_1);
+  }
+  if (strchr(overlay_drives, '2') != NULL || overlay_filename_2 != NULL) {
+    iwm_disk_overlay_set(&machine.iwm, 1, overlay_filename_2);
+  }
+  if (! trace_enable) {
+    machine.cpu.trace = NULL;
+  }
+  if (jit_enable) {
+    if (machine_jit_enable(&machine) != 0) {
+      fprintf(stdout, "JIT is not available on this host!\n");
+      return EXIT_FAILURE;
+    }
+  }
 
-  if (mem_rom_load(&mem, rom_filename) != 0) {
+  if (mem_rom_load(&machine.mem, rom_filename) != 0) {
     fprintf(stdout, "Loading of ROM '%s' failed!\n", rom_filename);
     return EXIT_FAILURE;
   }
 
   if (disk_filename_1 != NULL) {
-    if (iwm_disk_load(&iwm, 0, disk_filename_1, disk_type_1) != 0) {
+    if (iwm_disk_load(&machine.iwm, 0, disk_filename_1, disk_type_1) != 0) {
       fprintf(stdout, "Loading of disk image '%s' failed!\n", disk_filename_1);
       return EXIT_FAILURE;
     }
   }
 
   if (disk_filename_2 != NULL) {
-    if (iwm_disk_load(&iwm, 1, disk_filename_2, disk_type_2) != 0) {
+    if (iwm_disk_load(&machine.iwm, 1, disk_filename_2, disk_type_2) != 0) {
       fprintf(stdout, "Loading of disk image '%s' failed!\n", disk_filename_2);
       return EXIT_FAILURE;
     }
   }
 
-  if (console_init(&mem, gui_enable) != 0) {
+  for (i = 0; i < hdd_count; i++) {
+    if (smartport_attach(&machine, hdd_filename[i]) != 0) {
+      fprintf(stdout, "Loading of hard disk image '%s' failed!\n",
+        hdd_filename[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (console_init(&machine.console, &machine.mem, &machine.sched,
+    gui_enable) != 0) {
     return EXIT_FAILURE;
   }
+  atexit(console_exit_handler);
 
   signal(SIGINT, sig_handler);
 
@@ -197,38 +290,25 @@ int main(int argc, char *argv[])
   signal(SIGALRM, sig_handler);
   setitimer(ITIMER_REAL, &new, NULL);
 
-  w65c02_reset(&cpu, &mem);
+  w65c02_reset(&machine.cpu, &machine.mem);
 
   while (1) {
-    w65c02_trace_add(&cpu, &mem);
-    w65c02_execute(&cpu, &mem);
-    console_execute(&cpu, &mem);
-
-    while (cpu.cycles > 0) {
-      acia_execute(&acia1);
-      acia_execute(&acia2);
-      iwm_execute(&iwm);
-      cpu.cycles--;
-      count++;
-    }
-
-    if (debugger_breakpoint == cpu.pc) {
-      debugger_break = true;
-    }
-
-    if (debugger_break) {
-      console_pause();
-      if (panic_msg[0] != '\0') {
-        fprintf(stdout, "%s", panic_msg);
-        panic_msg[0] = '\0';
+    count += machine_run(&machine, RUN_BUDGET);
+    console_execute(&machine.console, &machine.cpu, &machine.mem);
+
+    if (machine.debugger_break) {
+      console_pause(&machine.console);
+      if (machine.panic_msg[0] != '\0') {
+        fprintf(stdout, "%s", machine.panic_msg);
+        machine.panic_msg[0] = '\0';
       }
-      debugger_break = debugger(&cpu, &mem, &iwm);
-      if (! debugger_break) {
-        console_resume();
+      machine.debugger_break = debugger(&machine);
+      if (! machine.debugger_break) {
+        console_resume(&machine.console);
       }
     }
 
-    if (! warp_mode) {
+    if (! machine.warp_mode) {
       if (count > 10230) {
         count = 0;
         pause(); /* Wait for SIGALRM. */
@@ -238,6 +318,3 @@ int main(int argc, char *argv[])
 
   return EXIT_SUCCESS;
 }
-
-
-
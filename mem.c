@@ -9,6 +9,162 @@
 #include "mem.h"
 #include "panic.h"
 
+#define MEM_DECODE_FLUSH_MAX 16 /* Clears before a RAM page is not cached. */
+
+
+
+int mem_host_page(mem_t *mem, uint8_t *page)
+{
+  if (page >= mem->main && page < &mem->main[MEM_RAM_MAIN_MAX]) {
+    return (page - mem->main) >> 8;
+  } else if (page >= mem->aux && page < &mem->aux[MEM_RAM_AUX_MAX]) {
+    return (MEM_RAM_MAIN_MAX + (page - mem->aux)) >> 8;
+  } else {
+    return -1; /* ROM */
+  }
+}
+
+
+
+static mem_decode_t *mem_decode_host(mem_t *mem, uint8_t *page)
+{
+  int host;
+
+  host = mem_host_page(mem, page);
+  if (host < 0 && (page < mem->rom || page >= &mem->rom[MEM_ROM_MAX])) {
+    return NULL; /* Card ROM. */
+  } else if (host < 0) {
+    return &mem->decode[MEM_RAM_MAIN_MAX + MEM_RAM_AUX_MAX +
+      (page - mem->rom)]; /* ROM never changes. */
+  } else if (mem->decode_flush[host] >= MEM_DECODE_FLUSH_MAX) {
+    return NULL; /* Too much self-modifying code. */
+  } else {
+    return &mem->decode[host << 8];
+  }
+}
+
+
+
+static void mem_page_update(mem_t *mem)
+{
+  uint16_t key;
+  uint8_t *ram;
+  int page, offset, host;
+
+  key = mem->store80 << 0 | mem->page2 << 1 | mem->hires << 2 |
+        mem->ram_rd << 3 | mem->ram_wrt << 4 | mem->alt_zp << 5 |
+        mem->rom_bank << 6 | mem->lcram << 7 | mem->bnk2 << 8 | mem->wp << 9;
+  if (key == mem->page_key) {
+    return; /* No soft switch changed state. */
+  }
+  mem->page_key = key;
+
+  for (page = 0; page < MEM_PAGE_MAX; page++) {
+    if (page < 0x02) { /* Zero Page & Stack Page */
+      ram = (mem->alt_zp) ? mem->aux : mem->main;
+      mem->read_page[page]  = &ram[page << 8];
+      mem->write_page[page] = &ram[page << 8];
+
+    } else if (page < 0xC0) { /* Low 48K Area */
+      ram = (mem->ram_rd) ? mem->aux : mem->main;
+      mem->read_page[page]  = &ram[page << 8];
+      ram = (mem->ram_wrt) ? mem->aux : mem->main;
+      mem->write_page[page] = &ram[page << 8];
+      if (mem->store80 && page >= 0x04 && page < 0x08) {
+        ram = (mem->page2) ? mem->aux : mem->main; /* Text & LoRes Page 1 */
+        mem->read_page[page]  = &ram[page << 8];
+        mem->write_page[page] = &ram[page << 8];
+      }
+      if (mem->store80 && page >= 0x20 && page < 0x40) {
+        ram = (mem->page2 && mem->hires) ? mem->aux : mem->main; /* HiRes */
+        mem->read_page[page]  = &ram[page << 8];
+        mem->write_page[page] = &ram[page << 8];
+      }
+
+    } else if (page < 0xC1) { /* Hardware I/O Page */
+      mem->read_page[page]  = NULL;
+      mem->write_page[page] = NULL;
+
+    } else if (page < 0xD0) { /* INTCXROM */
+      mem->read_page[page] = &mem->rom[(page << 8) -
+        ((mem->rom_bank) ? 0x8000 : 0xC000)];
+      if (page < 0xC8 && ! mem->rom_bank &&
+          mem->slot_rom[page - 0xC0] != NULL) {
+        mem->read_page[page] = mem->slot_rom[page - 0xC0];
+      }
+      mem->write_page[page] = NULL;
+
+    } else { /* $D000 Area */
+      ram = (mem->alt_zp) ? mem->aux : mem->main;
+      offset = page << 8;
+      if (page < 0xE0 && mem->bnk2 == false) {
+        offset -= 0x1000;
+      }
+      if (mem->lcram) {
+        mem->read_page[page] = &ram[offset];
+      } else {
+        mem->read_page[page] = &mem->rom[(page << 8) -
+          ((mem->rom_bank) ? 0x8000 : 0xC000)];
+      }
+      mem->write_page[page] = (mem->wp) ? NULL : &ram[offset];
+    }
+
+    mem->decode_page[page] = (mem->read_page[page] != NULL) ?
+      mem_decode_host(mem, mem->read_page[page]) : NULL;
+
+    /* Divert writes to watched code and video pages through the slow
+       path. */
+    mem->write_map[page] = mem->write_page[page];
+    if (mem->write_page[page] != NULL) {
+      host = mem_host_page(mem, mem->write_page[page]);
+      if (host >= 0 && (mem->code_watch[host] || ! mem->video_dirty[host])) {
+        mem->write_page[page] = NULL;
+      }
+    }
+  }
+}
+
+
+
+/* Whether the video RAM page holding address in ram, main or aux, has been
+   written since the last mem_video_clean(). */
+bool mem_video_dirty(mem_t *mem, uint8_t *ram, uint16_t address)
+{
+  return mem->video_dirty[mem_host_page(mem, &ram[address & 0xFF00])];
+}
+
+
+
+/* Watch the text, LoRes and HiRes pages for writes again, after a
+   renderer has drawn them. */
+void mem_video_clean(mem_t *mem)
+{
+  bool dirty = false;
+  int host;
+
+  for (host = 0; host < MEM_HOST_PAGE_MAX; host++) {
+    if (((host & 0xFF) >= 0x04 && (host & 0xFF) < 0x0C) ||
+        ((host & 0xFF) >= 0x20 && (host & 0xFF) < 0x60)) {
+      dirty |= mem->video_dirty[host];
+      mem->video_dirty[host] = false;
+    }
+  }
+  if (dirty) {
+    mem->page_key = 0xFFFF;
+    mem_page_update(mem);
+  }
+}
+
+
+
+/* Replace the internal ROM page of a slot, or restore it with NULL. */
+void mem_slot_rom_set(mem_t *mem, int slot, uint8_t *rom)
+{
+  mem->slot_rom[slot] = rom;
+  mem->page_key = 0xFFFF; /* Rebuild the page tables. */
+  mem_page_update(mem);
+}
+
 
 
 static uint8_t mem_bank_select_read(void *mem, uint16_t address)
@@ -40,25 +196,25 @@ static uint8_t mem_bank_select_read(void *mem, uint16_t address)
 
   case 0xC054:
     ((mem_t *)mem)->page2 = false;
-    return 0;
+    break;
 
   case 0xC055:
     ((mem_t *)mem)->page2 = true;
-    return 0;
+    break;
 
   case 0xC056:
     ((mem_t *)mem)->hires = false;
-    return 0;
+    break;
 
   case 0xC057:
     ((mem_t *)mem)->hires = true;
-    return 0;
+    break;
 
   case 0xC080:
     ((mem_t *)mem)->lcram = true;
     ((mem_t *)mem)->bnk2 = true;
     ((mem_t *)mem)->wp = true;
-    return 0;
+    break;
 
   case 0xC081:
     ((mem_t *)mem)->lcram = false;
@@ -69,13 +225,13 @@ static uint8_t mem_bank_select_read(void *mem, uint16_t address)
       ((mem_t *)mem)->wp = true;
       ((mem_t *)mem)->rr_expect = address;
     }
-    return 0;
+    break;
 
   case 0xC082:
     ((mem_t *)mem)->lcram = false;
     ((mem_t *)mem)->bnk2 = true;
     ((mem_t *)mem)->wp = true;
-    return 0;
+    break;
 
   case 0xC083:
     ((mem_t *)mem)->lcram = true;
@@ -86,13 +242,13 @@ static uint8_t mem_bank_select_read(void *mem, uint16_t address)
       ((mem_t *)mem)->wp = true;
       ((mem_t *)mem)->rr_expect = address;
     }
-    return 0;
+    break;
 
   case 0xC088:
     ((mem_t *)mem)->lcram = true;
     ((mem_t *)mem)->bnk2 = false;
     ((mem_t *)mem)->wp = true;
-    return 0;
+    break;
 
   case 0xC089:
     ((mem_t *)mem)->lcram = false;
@@ -103,13 +259,13 @@ static uint8_t mem_bank_select_read(void *mem, uint16_t address)
       ((mem_t *)mem)->wp = true;
       ((mem_t *)mem)->rr_expect = address;
     }
-    return 0;
+    break;
 
   case 0xC08A:
     ((mem_t *)mem)->lcram = false;
     ((mem_t *)mem)->bnk2 = false;
     ((mem_t *)mem)->wp = true;
-    return 0;
+    break;
 
   case 0xC08B:
     ((mem_t *)mem)->lcram = true;
@@ -120,11 +276,14 @@ static uint8_t mem_bank_select_read(void *mem, uint16_t address)
       ((mem_t *)mem)->wp = true;
       ((mem_t *)mem)->rr_expect = address;
     }
-    return 0;
+    break;
 
   default:
     return 0;
   }
+
+  mem_page_update(mem);
+  return 0;
 }
 
 
@@ -186,6 +345,8 @@ static void mem_bank_select_write(void *mem, uint16_t address, uint8_t value)
     (void)mem_bank_select_read(mem, address);
     break;
   }
+
+  mem_page_update(mem);
 }
 
 
@@ -383,6 +544,18 @@ void mem_init(mem_t *mem)
   for (i = 0; i < MEM_ROM_MAX; i++) {
     mem->rom[i] = 0x00;
   }
+  mem->io_event = false;
+  mem->cycle_count = NULL;
+  mem->machine = NULL;
+  mem->page_key = 0xFFFF; /* Force the first page table build. */
+  for (i = 0; i < MEM_HOST_PAGE_MAX; i++) {
+    mem->code_watch[i] = false;
+    mem->decode_flush[i] = 0;
+    mem->video_dirty[i] = true;
+  }
+  memset(mem->decode, 0, sizeof(mem->decode));
+  mem->code_write.func = NULL;
+  mem->code_write.cookie = NULL;
   for (i = 0; i < MEM_IO_MAX; i++) {
     mem->io_read[i].func = NULL;
     mem->io_read[i].cookie = NULL;
@@ -582,112 +755,40 @@ void mem_init(mem_t *mem)
   mem->io_write[0x52].cookie = mem;
   mem->io_write[0x53].func = video_io_write;
   mem->io_write[0x53].cookie = mem;
+
+  mem_page_update(mem);
 }
 
 
 
-uint8_t mem_read(mem_t *mem, uint16_t address)
+uint8_t mem_read_slow(mem_t *mem, uint16_t address)
 {
-  if (address < 0x200) { /* Zero Page & Stack Page */
-    if (mem->alt_zp == false) {
-      return mem->main[address];
-    } else {
-      return mem->aux[address];
-    }
+  uint8_t hook;
 
-  } else if (address < 0xC000) { /* Low 48K Area */
-    if (mem->store80 == true && address >= 0x400 && address < 0x800) {
-      if (mem->page2 == true) {
-        return mem->aux[address]; /* Text & LoRes Page 1X */
-      } else {
-        return mem->main[address]; /* Text & LoRes Page 1 */
-      }
-    }
-    if (mem->store80 == true && address >= 0x2000 && address < 0x4000) {
-      if (mem->page2 == true && mem->hires == true) {
-        return mem->aux[address]; /* HiRes Page 1X */
-      } else {
-        return mem->main[address]; /* HiRes Page 1 */
-      }
-    }
-    if (mem->ram_rd == false) {
-      return mem->main[address];
-    } else {
-      return mem->aux[address];
-    }
-
-  } else if (address < 0xC100) { /* Hardware I/O Page */
-    uint8_t hook = address - 0xC000;
+  if (address >= 0xC000 && address < 0xC100) { /* Hardware I/O Page */
+    hook = address - 0xC000;
     if (mem->io_read[hook].func != NULL) {
       return (mem->io_read[hook].func)(mem->io_read[hook].cookie, address);
     } else {
       /* panic("Unhandled read from I/O address $%04x\n", address); */
       return 0;
     }
-
-  } else if (address < 0xD000) { /* INTCXROM */
-    if (mem->rom_bank == false) {
-      return mem->rom[address - 0xC000];
-    } else {
-      return mem->rom[address - 0x8000];
-    }
-
-  } else { /* $D000 Area */
-    if (mem->lcram == false) { /* ROM */
-      if (mem->rom_bank == false) {
-        return mem->rom[address - 0xC000];
-      } else {
-        return mem->rom[address - 0x8000];
-      }
-    } else { /* RAM */
-      if (address < 0xE000 && mem->bnk2 == false) {
-        address -= 0x1000;
-      }
-      if (mem->alt_zp == false) {
-        return mem->main[address];
-      } else {
-        return mem->aux[address];
-      }
-    }
   }
+
+  /* Every other page is mapped in the page table. */
+  return mem->read_page[address >> 8][address & 0xFF];
 }
 
 
 
-void mem_write(mem_t *mem, uint16_t address, uint8_t value)
+void mem_write_slow(mem_t *mem, uint16_t address, uint8_t value)
 {
-  if (address < 0x200) { /* Zero Page & Stack Page */
-    if (mem->alt_zp == false) {
-      mem->main[address] = value;
-    } else {
-      mem->aux[address] = value;
-    }
-
-  } else if (address < 0xC000) { /* Low 48K Area */
-    if (mem->store80 == true && address >= 0x400 && address < 0x800) {
-      if (mem->page2 == true) {
-        mem->aux[address] = value; /* Text & LoRes Page 1X */
-      } else {
-        mem->main[address] = value; /* Text & LoRes Page 1 */
-      }
-      return;
-    }
-    if (mem->store80 == true && address >= 0x2000 && address < 0x4000) {
-      if (mem->page2 == true && mem->hires == true) {
-        mem->aux[address] = value; /* HiRes Page 1X */
-      } else {
-        mem->main[address] = value; /* HiRes Page 1 */
-      }
-      return;
-    }
-    if (mem->ram_wrt == false) {
-      mem->main[address] = value;
-    } else {
-      mem->aux[address] = value;
-    }
+  uint8_t hook;
+  uint8_t *page;
+  int host;
 
-  } else if (address < 0xC100) { /* Hardware I/O Page */
-    uint8_t hook = address - 0xC000;
+  if (address >= 0xC000 && address < 0xC100) { /* Hardware I/O Page */
+    hook = address - 0xC000;
     if (mem->io_write[hook].func != NULL) {
       (mem->io_write[hook].func)(mem->io_write[hook].cookie, address, value);
     } else {
@@ -695,23 +796,51 @@ void mem_write(mem_t *mem, uint16_t address, uint8_t value)
         address, value); */
     }
 
-  } else if (address < 0xD000) { /* INTCXROM */
-    /* Read-Only ROM! */
-
-  } else { /* $D000 Area (Always RAM) */
-    if (mem->wp == false) {
-      if (address < 0xE000 && mem->bnk2 == false) {
-        address -= 0x1000;
+  } else if (mem->write_map[address >> 8] != NULL) { /* Watched page */
+    page = mem->write_map[address >> 8];
+    host = mem_host_page(mem, page);
+    mem->video_dirty[host] = true;
+    if (mem->code_watch[host]) {
+      if (mem->decode_flush[host] < MEM_DECODE_FLUSH_MAX) {
+        mem->decode_flush[host]++;
       }
-      if (mem->alt_zp == false) {
-        mem->main[address] = value;
-      } else {
-        mem->aux[address] = value;
+      mem_code_watch(mem, page, false);
+      if (mem->code_write.func != NULL) {
+        (mem->code_write.func)(mem->code_write.cookie, page);
       }
     } else {
-      panic("Write protected RAM address $%04x ($%02x)\n", address, value);
+      mem->write_page[address >> 8] = page; /* Only one mapping in the low
+                                               48K area for video pages. */
     }
+    page[address & 0xFF] = value;
+
+  } else if (address < 0xD000) { /* INTCXROM */
+    /* Read-Only ROM! */
+
+  } else { /* $D000 Area (Write protected RAM) */
+    panic(mem->machine, "Write protected RAM address $%04x ($%02x)\n",
+      address, value);
+  }
+}
+
+
+
+void mem_code_watch(mem_t *mem, uint8_t *page, bool enable)
+{
+  int host;
+
+  host = mem_host_page(mem, page);
+  if (host < 0 || mem->code_watch[host] == enable) {
+    return; /* ROM never changes. */
+  }
+  if (! enable) {
+    /* The decode cache shares the watch with the JIT, so drop it too,
+       whoever stops watching. */
+    memset(&mem->decode[host << 8], 0, sizeof(mem_decode_t) * 0x100);
   }
+  mem->code_watch[host] = enable;
+  mem->page_key = 0xFFFF;
+  mem_page_update(mem);
 }
 
 
@@ -735,6 +864,8 @@ int mem_rom_load(mem_t *mem, const char *filename)
       break;
     }
   }
+  memset(&mem->decode[MEM_RAM_MAIN_MAX + MEM_RAM_AUX_MAX], 0,
+    sizeof(mem_decode_t) * MEM_ROM_MAX);
 
   fclose(fh);
   return 0;
@@ -9,6 +9,10 @@
 #define MEM_RAM_AUX_MAX  0x10000
 #define MEM_ROM_MAX      0x8000
 #define MEM_IO_MAX       0x100
+#define MEM_PAGE_MAX     0x100
+#define MEM_HOST_PAGE_MAX ((MEM_RAM_MAIN_MAX + MEM_RAM_AUX_MAX) / 0x100)
+#define MEM_SLOT_MAX     8
+#define MEM_DECODE_MAX   (MEM_RAM_MAIN_MAX + MEM_RAM_AUX_MAX + MEM_ROM_MAX)
 
 typedef struct mem_io_read_hook_s {
   void *cookie;
@@ -20,6 +24,20 @@ typedef struct mem_io_write_hook_s {
   void (*func)(void *, uint16_t, uint8_t);
 } mem_io_write_hook_t;
 
+typedef struct mem_code_write_hook_s {
+  void *cookie;
+  void (*func)(void *, uint8_t *);
+} mem_code_write_hook_t;
+
+/* Instruction decoded by the CPU, a cycles value of 0 marks an empty entry. */
+typedef struct mem_decode_s {
+  uint8_t opcode;
+  uint8_t cycles;   /* Base cycles without page crossing or decimal mode. */
+  uint16_t operand; /* Operand bytes following the opcode, little endian. */
+} mem_decode_t;
+
+struct a2c_machine_s;
+
 typedef struct mem_s {
   uint8_t main[MEM_RAM_MAIN_MAX]; /* Main RAM from 0x0000 to 0xFFFF. */
   uint8_t aux[MEM_RAM_AUX_MAX];   /* Auxiliary RAM from 0x0000 to 0xFFFF. */
@@ -51,16 +69,78 @@ typedef struct mem_s {
   bool bnk2;     /* 0 = Bank1, 1 = Bank2 */
   bool wp; /* Write Protect */
   uint16_t rr_expect; /* Expected double address read for RAM write enable. */
+
+  uint8_t *slot_rom[MEM_SLOT_MAX]; /* Card ROM pages replacing the internal
+                                      ones in the main ROM bank, or NULL. */
+
+  bool io_event; /* Set by I/O hooks to end the current w65c02_run() early. */
+  const uint64_t *cycle_count; /* Of the running CPU, up to the instruction
+                                  being executed, for I/O hook timing. */
+  struct a2c_machine_s *machine; /* Owner, for panic() and the debugger. */
+
+  /* Host pointers to the start of each 256-byte page as currently mapped by
+     the soft switches. NULL means the access must take the slow path. */
+  uint8_t *read_page[MEM_PAGE_MAX];
+  uint8_t *write_page[MEM_PAGE_MAX];
+  uint8_t *write_map[MEM_PAGE_MAX]; /* Write targets, also for watched pages. */
+  uint16_t page_key; /* Soft switch state the page tables were built for. */
+
+  /* RAM pages holding cached code, writes to them go through the slow path
+     and call the hook once with the host page before the watch is dropped. */
+  bool code_watch[MEM_HOST_PAGE_MAX];
+  mem_code_write_hook_t code_write;
+
+  /* Video RAM pages written since mem_video_clean(), other pages are always
+     set. Clean pages are watched, their first write goes through the slow
+     path to set the flag again. */
+  bool video_dirty[MEM_HOST_PAGE_MAX];
+
+  /* Decode cache for every byte of RAM and ROM, in host memory order. The
+     entries of a RAM page are cleared by the first write after one of them
+     was filled in, pages cleared too often are no longer cached. */
+  mem_decode_t decode[MEM_DECODE_MAX];
+  mem_decode_t *decode_page[MEM_PAGE_MAX]; /* NULL means not cached. */
+  uint8_t decode_flush[MEM_HOST_PAGE_MAX]; /* Clears per RAM page. */
 } mem_t;
 
 #define MEM_PAGE_STACK 0x100
 
 void mem_init(mem_t *mem);
-uint8_t mem_read(mem_t *mem, uint16_t address);
-void mem_write(mem_t *mem, uint16_t address, uint8_t value);
+uint8_t mem_read_slow(mem_t *mem, uint16_t address);
+void mem_write_slow(mem_t *mem, uint16_t address, uint8_t value);
+int mem_host_page(mem_t *mem, uint8_t *page);
+void mem_code_watch(mem_t *mem, uint8_t *page, bool enable);
+bool mem_video_dirty(mem_t *mem, uint8_t *ram, uint16_t address);
+void mem_video_clean(mem_t *mem);
+void mem_slot_rom_set(mem_t *mem, int slot, uint8_t *rom);
 int mem_rom_load(mem_t *mem, const char *filename);
 void mem_ram_main_dump(FILE *fh, mem_t *mem, uint16_t start, uint16_t end);
 void mem_ram_aux_dump(FILE *fh, mem_t *mem, uint16_t start, uint16_t end);
 void mem_switch_dump(FILE *fh, mem_t * mem);
 
+
+
+static inline uint8_t mem_read(mem_t *mem, uint16_t address)
+{
+  uint8_t *page = mem->read_page[address >> 8];
+  if (page != NULL) {
+    return page[address & 0xFF];
+  }
+  return mem_read_slow(mem, address);
+}
+
+
+
+static inline void mem_write(mem_t *mem, uint16_t address, uint8_t value)
+{
+  uint8_t *page = mem->write_page[address >> 8];
+  if (page != NULL) {
+    page[address & 0xFF] = value;
+  } else {
+    mem_write_slow(mem, address, value);
+  }
+}
+
+
+
 #endif /* _MEM_H */
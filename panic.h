@@ -4,9 +4,8 @@
 #include <stdarg.h>
 #include <stdbool.h>
 
-extern bool debugger_break;
-extern bool warp_mode;
+struct a2c_machine_s;
 
-void panic(const char *format, ...);
+void panic(struct a2c_machine_s *machine, const char *format, ...);
 
 #endif /* _PANIC_H */
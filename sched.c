@@ -0,0 +1,96 @@
+#include "sched.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+
+void sched_init(sched_t *sched)
+{
+  memset(sched, 0, sizeof(sched_t));
+}
+
+
+
+void sched_event_init(sched_event_t *event, sched_func_t func, void *cookie)
+{
+  memset(event, 0, sizeof(sched_event_t));
+  event->func = func;
+  event->cookie = cookie;
+}
+
+
+
+void sched_remove(sched_t *sched, sched_event_t *event)
+{
+  sched_event_t **link;
+
+  if (! event->pending) {
+    return;
+  }
+
+  for (link = &sched->head; *link != NULL; link = &(*link)->next) {
+    if (*link == event) {
+      *link = event->next;
+      break;
+    }
+  }
+  event->pending = false;
+  event->next = NULL;
+}
+
+
+
+/* Insert or move an event, events with equal deadlines run in the order
+   they were added. */
+void sched_add(sched_t *sched, sched_event_t *event, uint64_t deadline)
+{
+  sched_event_t **link;
+
+  sched_remove(sched, event);
+
+  for (link = &sched->head; *link != NULL; link = &(*link)->next) {
+    if ((*link)->deadline > deadline) {
+      break;
+    }
+  }
+  event->deadline = deadline;
+  event->pending = true;
+  event->next = *link;
+  *link = event;
+}
+
+
+
+/* Limit a CPU budget so that it ends at the earliest deadline. */
+int sched_budget(sched_t *sched, int budget)
+{
+  if (sched->head == NULL) {
+    return budget;
+  }
+  if (sched->head->deadline <= sched->now) {
+    return 1;
+  }
+  if (sched->head->deadline - sched->now < (uint64_t)budget) {
+    return sched->head->deadline - sched->now;
+  }
+  return budget;
+}
+
+
+
+/* Advance the timeline and call every event that has become due. */
+void sched_run(sched_t *sched, uint64_t now)
+{
+  sched_event_t *event;
+
+  sched->now = now;
+  while (sched->head != NULL && sched->head->deadline <= now) {
+    event = sched->head;
+    sched->head = event->next;
+    event->pending = false;
+    event->next = NULL;
+    (event->func)(event->cookie, now);
+  }
+}
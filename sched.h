@@ -0,0 +1,30 @@
+#ifndef _A2C_SCHED_H /* Not _SCHED_H, which the system <sched.h> uses. */
+#define _A2C_SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef void (*sched_func_t)(void *, uint64_t);
+
+/* Device event, embedded in the device owning it. */
+typedef struct sched_event_s {
+  uint64_t deadline; /* Cycle count at which the event is due. */
+  bool pending;
+  void *cookie;
+  sched_func_t func; /* Called with the cookie and the current cycle count. */
+  struct sched_event_s *next;
+} sched_event_t;
+
+typedef struct sched_s {
+  uint64_t now;        /* Cycle count of the last sched_run(). */
+  sched_event_t *head; /* Pending events, earliest deadline first. */
+} sched_t;
+
+void sched_init(sched_t *sched);
+void sched_event_init(sched_event_t *event, sched_func_t func, void *cookie);
+void sched_add(sched_t *sched, sched_event_t *event, uint64_t deadline);
+void sched_remove(sched_t *sched, sched_event_t *event);
+int sched_budget(sched_t *sched, int budget);
+void sched_run(sched_t *sched, uint64_t now);
+
+#endif /* _A2C_SCHED_H */
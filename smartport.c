@@ -0,0 +1,512 @@
+#include "smartport.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hostfs.h"
+#include "machine.h"
+#include "mem.h"
+#include "panic.h"
+#include "w65c02.h"
+
+#define SMARTPORT_2MG_HEADER_SIZE 64
+
+#define SMARTPORT_ERROR_BAD_COMMAND     0x01
+#define SMARTPORT_ERROR_BAD_PCOUNT      0x04
+#define SMARTPORT_ERROR_IO              0x27
+#define SMARTPORT_ERROR_NO_DEVICE       0x28
+#define SMARTPORT_ERROR_WRITE_PROTECTED 0x2B
+#define SMARTPORT_ERROR_BAD_BLOCK       0x2D
+
+/* Card signature for ProDOS, followed by the boot entry. */
+static const uint8_t smartport_rom_header[] = {
+  0xA2, 0x20,       /* LDX #$20 */
+  0xA0, 0x00,       /* LDY #$00 */
+  0xA2, 0x03,       /* LDX #$03 */
+  0xA0, 0x00,       /* LDY #$00, SmartPort */
+  0x4C, 0x08, 0xC5, /* JMP $C508 */
+};
+
+
+
+static uint16_t smartport_read16(mem_t *mem, uint16_t address)
+{
+  return mem_read(mem, address) | (mem_read(mem, address + 1) << 8);
+}
+
+
+
+/* Leave the call as if by an RTS, skipping any inline parameters, with the
+   carry set on error and the error code in A. */
+static void smartport_return(w65c02_t *cpu, mem_t *mem, int skip,
+  uint8_t error)
+{
+  uint16_t address;
+
+  address  = mem_read(mem, MEM_PAGE_STACK + ++cpu->s);
+  address |= mem_read(mem, MEM_PAGE_STACK + ++cpu->s) << 8;
+  cpu->pc = address + 1 + skip;
+  cpu->a = error;
+  cpu->status.c = (error != 0);
+}
+
+
+
+static uint8_t smartport_block_read(smartport_unit_t *unit, mem_t *mem,
+  uint32_t block, uint16_t buffer)
+{
+  int i;
+
+  if (block >= unit->blocks) {
+    return SMARTPORT_ERROR_BAD_BLOCK;
+  }
+  for (i = 0; i < SMARTPORT_BLOCK_SIZE; i++) {
+    mem_write(mem, buffer + i, unit->data[(block * SMARTPORT_BLOCK_SIZE) + i]);
+  }
+  return 0;
+}
+
+
+
+static uint8_t smartport_block_write(smartport_unit_t *unit, mem_t *mem,
+  uint32_t block, uint16_t buffer)
+{
+  int i;
+
+  if (unit->write_protected) {
+    return SMARTPORT_ERROR_WRITE_PROTECTED;
+  }
+  if (block >= unit->blocks) {
+    return SMARTPORT_ERROR_BAD_BLOCK;
+  }
+  for (i = 0; i < SMARTPORT_BLOCK_SIZE; i++) {
+    unit->data[(block * SMARTPORT_BLOCK_SIZE) + i] = mem_read(mem, buffer + i);
+  }
+  if (unit->hostfs != NULL) {
+    hostfs_written(unit->hostfs, block);
+  }
+  unit->dirty = true;
+  return 0;
+}
+
+
+
+/* Write the host directory volumes back. Returns the last file left alone
+   because it also changed on the host, or NULL. */
+static const char *smartport_sync(smartport_t *smartport)
+{
+  const char *skipped = NULL;
+  int result;
+  int i;
+
+  for (i = 0; i < smartport->units; i++) {
+    if (smartport->unit[i].directory && smartport->unit[i].dirty) {
+      result = hostfs_sync(smartport->unit[i].hostfs);
+      if (result >= 0) {
+        smartport->unit[i].dirty = false;
+      }
+      if (result > 0) {
+        skipped = smartport->unit[i].hostfs->skipped;
+      }
+    }
+  }
+  return skipped;
+}
+
+
+
+/* Sync once the writes have settled, since ProDOS updates a file over
+   several blocks. */
+static void smartport_flush(void *smartport, uint64_t now)
+{
+  smartport_t *sp = (smartport_t *)smartport;
+  const char *skipped;
+
+  (void)now;
+  skipped = smartport_sync(sp);
+  if (skipped != NULL) {
+    panic(sp->machine, "Host file '%s' changed, not written back!\n",
+      skipped);
+  }
+}
+
+
+
+static void smartport_written(smartport_t *smartport, smartport_unit_t *unit)
+{
+  if (unit->directory) {
+    sched_add(smartport->sched, &smartport->flush,
+      smartport->sched->now + SMARTPORT_FLUSH_CYCLES);
+  }
+}
+
+
+
+/* Status bytes for a unit, with the identification when dib is set. */
+static int smartport_unit_status(smartport_unit_t *unit, uint8_t *status,
+  bool dib)
+{
+  status[0] = 0xF8; /* Block device, write, read, online. */
+  if (unit->write_protected) {
+    status[0] = (status[0] & ~0x40) | 0x04;
+  }
+  status[1] = unit->blocks & 0xFF;
+  status[2] = unit->blocks >> 8;
+  status[3] = 0;
+  if (! dib) {
+    return 4;
+  }
+
+  status[4] = 7;
+  memcpy(&status[5], "A2C HDD         ", 16);
+  status[21] = 0x02; /* Hard disk. */
+  status[22] = 0x20; /* Not removable. */
+  status[23] = 0x01; /* Version. */
+  status[24] = 0x00;
+  return 25;
+}
+
+
+
+/* ProDOS block driver, with the parameters in $42 to $47. Units 3 and 4
+   are reached through the slot ProDOS remaps them to. */
+static void smartport_prodos(a2c_machine_t *machine)
+{
+  smartport_t *smartport = &machine->smartport;
+  w65c02_t *cpu = &machine->cpu;
+  mem_t *mem = &machine->mem;
+  smartport_unit_t *unit;
+  uint8_t error;
+  int unit_no;
+
+  unit_no = mem_read(mem, 0x43) >> 7;
+  if (((mem_read(mem, 0x43) >> 4) & 0x7) != SMARTPORT_SLOT) {
+    unit_no += 2;
+  }
+  if (unit_no >= smartport->units) {
+    smartport_return(cpu, mem, 0, SMARTPORT_ERROR_NO_DEVICE);
+    return;
+  }
+  unit = &smartport->unit[unit_no];
+
+  switch (mem_read(mem, 0x42)) {
+  case 0x00: /* Status */
+    cpu->x = unit->blocks & 0xFF;
+    cpu->y = unit->blocks >> 8;
+    error = unit->write_protected ? SMARTPORT_ERROR_WRITE_PROTECTED : 0;
+    break;
+
+  case 0x01: /* Read */
+    error = smartport_block_read(unit, mem, smartport_read16(mem, 0x46),
+      smartport_read16(mem, 0x44));
+    break;
+
+  case 0x02: /* Write */
+    error = smartport_block_write(unit, mem, smartport_read16(mem, 0x46),
+      smartport_read16(mem, 0x44));
+    if (error == 0) {
+      smartport_written(smartport, unit);
+    }
+    break;
+
+  case 0x03: /* Format */
+    error = unit->write_protected ? SMARTPORT_ERROR_WRITE_PROTECTED : 0;
+    break;
+
+  default:
+    error = SMARTPORT_ERROR_IO;
+    break;
+  }
+
+  smartport_return(cpu, mem, 0, error);
+}
+
+
+
+/* SmartPort call, with the command byte and parameter list address inline
+   after the JSR. */
+static void smartport_call(a2c_machine_t *machine)
+{
+  smartport_t *smartport = &machine->smartport;
+  w65c02_t *cpu = &machine->cpu;
+  mem_t *mem = &machine->mem;
+  smartport_unit_t *unit = NULL;
+  uint8_t status[25];
+  uint16_t inline_args;
+  uint16_t params;
+  uint16_t buffer;
+  uint32_t block;
+  uint8_t command;
+  uint8_t error = 0;
+  int unit_no;
+  int n;
+  int i;
+
+  inline_args = smartport_read16(mem, MEM_PAGE_STACK + cpu->s + 1) + 1;
+  command = mem_read(mem, inline_args);
+  params = smartport_read16(mem, inline_args + 1);
+
+  unit_no = mem_read(mem, params + 1);
+  if (unit_no > smartport->units ||
+      (unit_no == 0 && command != 0x00)) {
+    smartport_return(cpu, mem, 3, SMARTPORT_ERROR_NO_DEVICE);
+    return;
+  }
+  if (unit_no > 0) {
+    unit = &smartport->unit[unit_no - 1];
+  }
+  buffer = smartport_read16(mem, params + 2);
+  block = smartport_read16(mem, params + 4) | (mem_read(mem, params + 6) << 16);
+
+  switch (command) {
+  case 0x00: /* Status */
+    if (mem_read(mem, params) != 3) {
+      error = SMARTPORT_ERROR_BAD_PCOUNT;
+      break;
+    }
+    memset(status, 0, sizeof(status));
+    if (unit == NULL) {
+      status[0] = smartport->units; /* Driver status. */
+      n = 8;
+    } else if (mem_read(mem, params + 4) == 0x00) {
+      n = smartport_unit_status(unit, status, false);
+    } else if (mem_read(mem, params + 4) == 0x03) {
+      n = smartport_unit_status(unit, status, true);
+    } else {
+      error = SMARTPORT_ERROR_BAD_COMMAND;
+      break;
+    }
+    for (i = 0; i < n; i++) {
+      mem_write(mem, buffer + i, status[i]);
+    }
+    cpu->x = n;
+    cpu->y = 0;
+    break;
+
+  case 0x01: /* Read Block */
+    error = smartport_block_read(unit, mem, block, buffer);
+    break;
+
+  case 0x02: /* Write Block */
+    error = smartport_block_write(unit, mem, block, buffer);
+    if (error == 0) {
+      smartport_written(smartport, unit);
+    }
+    break;
+
+  case 0x03: /* Format */
+  case 0x04: /* Control */
+  case 0x05: /* Init */
+    break;
+
+  default:
+    error = SMARTPORT_ERROR_BAD_COMMAND;
+    break;
+  }
+
+  smartport_return(cpu, mem, 3, error);
+}
+
+
+
+/* Boot like a disk controller card, by loading block 0 to $800 and running
+   it with the slot in X. */
+static void smartport_boot(a2c_machine_t *machine)
+{
+  w65c02_t *cpu = &machine->cpu;
+  mem_t *mem = &machine->mem;
+
+  if (machine->smartport.units == 0 ||
+      smartport_block_read(&machine->smartport.unit[0], mem, 0, 0x800) != 0 ||
+      mem_read(mem, 0x801) == 0x00) {
+    cpu->pc = 0xE000; /* Nothing to boot, go to BASIC. */
+    return;
+  }
+  cpu->x = SMARTPORT_SLOT << 4;
+  cpu->pc = 0x801;
+}
+
+
+
+/* Called with the CPU stopped at a trap address, returns false if it is not
+   one of the card entry points. */
+bool smartport_trap(a2c_machine_t *machine)
+{
+  switch (machine->cpu.pc) {
+  case SMARTPORT_BOOT_ENTRY:
+    smartport_boot(machine);
+    return true;
+
+  case SMARTPORT_PRODOS_ENTRY:
+    smartport_prodos(machine);
+    return true;
+
+  case SMARTPORT_ENTRY:
+    smartport_call(machine);
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+
+
+/* Map a ProDOS ordered (.po, .hdv) or 2MG hard disk image as the next unit.
+   Writable images are mapped shared, so written blocks go straight to the
+   file through the page cache. */
+static int smartport_unit_map(smartport_unit_t *unit, const char *filename)
+{
+  struct stat st;
+  size_t offset = 0;
+  int fd;
+
+  unit->write_protected = (access(filename, W_OK) != 0);
+  fd = open(filename, unit->write_protected ? O_RDONLY : O_RDWR);
+  if (fd == -1) {
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < SMARTPORT_BLOCK_SIZE) {
+    close(fd);
+    return -1;
+  }
+
+  unit->map_size = st.st_size;
+  unit->map = mmap(NULL, unit->map_size,
+    PROT_READ | (unit->write_protected ? 0 : PROT_WRITE), MAP_SHARED, fd, 0);
+  close(fd);
+  if (unit->map == MAP_FAILED) {
+    unit->map = NULL;
+    return -1;
+  }
+
+  if (unit->map_size >= SMARTPORT_2MG_HEADER_SIZE &&
+      memcmp(unit->map, "2IMG", 4) == 0) {
+    offset = unit->map[0x18] | (unit->map[0x19] << 8) |
+      (unit->map[0x1A] << 16) | ((size_t)unit->map[0x1B] << 24);
+    if (offset > unit->map_size) {
+      offset = unit->map_size;
+    }
+  }
+  unit->data = &unit->map[offset];
+  unit->blocks = (unit->map_size - offset) / SMARTPORT_BLOCK_SIZE;
+  if (unit->blocks > SMARTPORT_BLOCKS_MAX) {
+    unit->blocks = SMARTPORT_BLOCKS_MAX;
+  }
+
+  snprintf(unit->filename, PATH_MAX, "%s", filename);
+  return 0;
+}
+
+
+
+/* Build a full size volume from a host directory in anonymous memory, only
+   the blocks in use take up host memory. */
+static int smartport_unit_directory(smartport_unit_t *unit,
+  const char *filename)
+{
+  unit->map_size = SMARTPORT_BLOCKS_MAX * SMARTPORT_BLOCK_SIZE;
+  unit->map = mmap(NULL, unit->map_size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (unit->map == MAP_FAILED) {
+    unit->map = NULL;
+    return -1;
+  }
+  unit->data = unit->map;
+  unit->blocks = SMARTPORT_BLOCKS_MAX;
+
+  unit->hostfs = malloc(sizeof(hostfs_t));
+  if (unit->hostfs == NULL ||
+      hostfs_init(unit->hostfs, filename, unit->data, unit->blocks) != 0) {
+    free(unit->hostfs);
+    unit->hostfs = NULL;
+    munmap(unit->map, unit->map_size);
+    unit->map = NULL;
+    return -1;
+  }
+
+  unit->write_protected = (access(filename, W_OK) != 0);
+  unit->directory = true;
+  unit->dirty = false;
+  snprintf(unit->filename, PATH_MAX, "%s", filename);
+  return 0;
+}
+
+
+
+/* Attach an image or host directory as the next unit, the card appears in
+   slot 5 with the first one. */
+int smartport_attach(a2c_machine_t *machine, const char *filename)
+{
+  smartport_t *smartport = &machine->smartport;
+  smartport_unit_t *unit;
+  struct stat st;
+
+  if (smartport->units >= SMARTPORT_UNITS) {
+    return -2;
+  }
+  unit = &smartport->unit[smartport->units];
+  if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+    if (smartport_unit_directory(unit, filename) != 0) {
+      return -1;
+    }
+  } else if (smartport_unit_map(unit, filename) != 0) {
+    return -1;
+  }
+  smartport->units++;
+  smartport->machine = machine;
+  smartport->sched = &machine->sched;
+  sched_event_init(&smartport->flush, smartport_flush, smartport);
+
+  memcpy(smartport->rom, smartport_rom_header, sizeof(smartport_rom_header));
+  smartport->rom[SMARTPORT_PRODOS_ENTRY & 0xFF] = 0x60; /* RTS */
+  smartport->rom[SMARTPORT_ENTRY & 0xFF] = 0x60; /* RTS */
+  smartport->rom[0xFC] = 0x00; /* Blocks from the status call. */
+  smartport->rom[0xFD] = 0x00;
+  smartport->rom[0xFE] = (smartport->units > 1) ? 0x1F : 0x0F;
+  smartport->rom[0xFF] = SMARTPORT_PRODOS_ENTRY & 0xFF;
+
+  mem_slot_rom_set(&machine->mem, SMARTPORT_SLOT, smartport->rom);
+  machine->stop[SMARTPORT_BOOT_ENTRY] |= MACHINE_STOP_TRAP;
+  machine->stop[SMARTPORT_PRODOS_ENTRY] |= MACHINE_STOP_TRAP;
+  machine->stop[SMARTPORT_ENTRY] |= MACHINE_STOP_TRAP;
+  return 0;
+}
+
+
+
+void smartport_exit(smartport_t *smartport)
+{
+  const char *skipped;
+  int i;
+
+  if (smartport->sched != NULL) {
+    sched_remove(smartport->sched, &smartport->flush);
+  }
+  skipped = smartport_sync(smartport);
+  if (skipped != NULL) {
+    fprintf(stderr, "Host file '%s' changed, not written back!\n", skipped);
+  }
+  for (i = 0; i < smartport->units; i++) {
+    if (smartport->unit[i].hostfs != NULL) {
+      hostfs_exit(smartport->unit[i].hostfs);
+      free(smartport->unit[i].hostfs);
+      smartport->unit[i].hostfs = NULL;
+    }
+    if (smartport->unit[i].map != NULL) {
+      if (! smartport->unit[i].write_protected &&
+          ! smartport->unit[i].directory) {
+        msync(smartport->unit[i].map, smartport->unit[i].map_size, MS_SYNC);
+      }
+      munmap(smartport->unit[i].map, smartport->unit[i].map_size);
+      smartport->unit[i].map = NULL;
+    }
+  }
+  smartport->units = 0;
+}
@@ -0,0 +1,49 @@
+#ifndef _SMARTPORT_H
+#define _SMARTPORT_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "hostfs.h"
+#include "sched.h"
+
+#define SMARTPORT_SLOT 5
+#define SMARTPORT_UNITS 4
+#define SMARTPORT_BLOCK_SIZE 512
+#define SMARTPORT_BLOCKS_MAX 0xFFFF /* 32MB, the most ProDOS can use. */
+#define SMARTPORT_FLUSH_CYCLES 1023000 /* Host directory sync after writes. */
+
+/* Entry points in the card ROM, served by traps. */
+#define SMARTPORT_BOOT_ENTRY   0xC508
+#define SMARTPORT_PRODOS_ENTRY 0xC520
+#define SMARTPORT_ENTRY        0xC523 /* ProDOS entry + 3, by convention. */
+
+typedef struct smartport_unit_s {
+  char filename[PATH_MAX];
+  uint8_t *map;  /* Image file, mapped shared when writable. */
+  size_t map_size;
+  uint8_t *data; /* Blocks, after any 2MG header. */
+  uint32_t blocks;
+  bool write_protected;
+  bool directory;   /* Volume built from a host directory. */
+  hostfs_t *hostfs; /* The files it was built from, for a directory. */
+  bool dirty;       /* Written since the last host directory sync. */
+} smartport_unit_t;
+
+struct a2c_machine_s;
+
+typedef struct smartport_s {
+  smartport_unit_t unit[SMARTPORT_UNITS];
+  int units;
+  uint8_t rom[0x100]; /* Card ROM at $C500. */
+  struct a2c_machine_s *machine;
+  sched_t *sched;
+  sched_event_t flush;
+} smartport_t;
+
+int smartport_attach(struct a2c_machine_s *machine, const char *filename);
+bool smartport_trap(struct a2c_machine_s *machine);
+void smartport_exit(smartport_t *smartport);
+
+#endif /* _SMARTPORT_H */
@@ -5,8 +5,10 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "machine.h"
 #include "mem.h"
 #include "panic.h"
+#include "w65c02_trace.h"
 
 
 
@@ -22,42 +24,49 @@ static inline uint8_t bin_to_dec(uint8_t value)
 
 
 
-static inline void flag_zero_other(w65c02_t *cpu, uint8_t value)
+/* Operand bytes are fetched by the dispatcher before the handler is called,
+   and are consumed here in the same order as they are found in memory. */
+static inline uint8_t operand_fetch(w65c02_t *cpu)
 {
-  if (value == 0) {
-    cpu->status.z = 1;
-  } else {
-    cpu->status.z = 0;
-  }
+  uint8_t value = cpu->operand;
+  cpu->operand >>= 8;
+  cpu->pc++;
+  return value;
 }
 
-static inline void flag_negative_other(w65c02_t *cpu, uint8_t value)
+
+
+/* N and Z are not kept in the status register but derived from the last
+   result, see w65c02_status_get(). Bit 15 is a second N flag for results
+   where N does not follow from bit 7. */
+static inline void flag_negative_zero(w65c02_t *cpu, uint8_t value)
 {
-  if ((value >> 7) == 1) {
-    cpu->status.n = 1;
-  } else {
-    cpu->status.n = 0;
-  }
+  cpu->nz = value;
 }
 
-static inline void flag_zero_compare(w65c02_t *cpu, uint8_t a, uint8_t b)
+static inline void flag_negative_bit(w65c02_t *cpu, uint8_t value)
 {
-  if (a == b) {
-    cpu->status.z = 1;
-  } else {
-    cpu->status.z = 0;
-  }
+  cpu->nz = ((value & 0x80) << 8) | (value & cpu->a);
 }
 
-static inline void flag_negative_compare(w65c02_t *cpu, uint8_t a, uint8_t b)
+static inline void flag_zero_other(w65c02_t *cpu, uint8_t value)
 {
-  if (((uint8_t)(a - b) >> 7) == 1) {
-    cpu->status.n = 1;
-  } else {
-    cpu->status.n = 0;
+  cpu->nz = (cpu->nz & 0x8080) ? 0x8000 : 0;
+  if (value != 0) {
+    cpu->nz |= 1;
   }
 }
 
+static inline bool flag_negative(w65c02_t *cpu)
+{
+  return (cpu->nz & 0x8080) != 0;
+}
+
+static inline bool flag_zero(w65c02_t *cpu)
+{
+  return (cpu->nz & 0xFF) == 0;
+}
+
 static inline void flag_carry_compare(w65c02_t *cpu, uint8_t a, uint8_t b)
 {
   if (a >= b) {
@@ -138,39 +147,39 @@ static inline void flag_overflow_bit(w65c02_t *cpu, uint8_t value)
 
 #define OP_PROLOGUE_ABS \
   uint16_t absolute; \
-  absolute  = mem_read(mem, cpu->pc++); \
-  absolute += mem_read(mem, cpu->pc++) * 256;
+  absolute  = operand_fetch(cpu); \
+  absolute += operand_fetch(cpu) * 256;
 
 #define OP_PROLOGUE_ABSX \
   uint16_t absolute; \
-  absolute  = mem_read(mem, cpu->pc++); \
-  absolute += mem_read(mem, cpu->pc++) * 256; \
+  absolute  = operand_fetch(cpu); \
+  absolute += operand_fetch(cpu) * 256; \
   absolute += cpu->x;
 
 #define OP_PROLOGUE_ABSY \
   uint16_t absolute; \
-  absolute  = mem_read(mem, cpu->pc++); \
-  absolute += mem_read(mem, cpu->pc++) * 256; \
+  absolute  = operand_fetch(cpu); \
+  absolute += operand_fetch(cpu) * 256; \
   absolute += cpu->y; \
 
 #define OP_PROLOGUE_ZP \
   uint8_t zeropage; \
-  zeropage = mem_read(mem, cpu->pc++); \
+  zeropage = operand_fetch(cpu); \
 
 #define OP_PROLOGUE_ZPX \
   uint8_t zeropage; \
-  zeropage  = mem_read(mem, cpu->pc++); \
+  zeropage  = operand_fetch(cpu); \
   zeropage += cpu->x;
 
 #define OP_PROLOGUE_ZPY \
   uint8_t zeropage; \
-  zeropage  = mem_read(mem, cpu->pc++); \
+  zeropage  = operand_fetch(cpu); \
   zeropage += cpu->y;
 
 #define OP_PROLOGUE_ZPYI \
   uint8_t zeropage; \
   uint16_t absolute; \
-  zeropage  = mem_read(mem, cpu->pc++); \
+  zeropage  = operand_fetch(cpu); \
   absolute  = mem_read(mem, zeropage); \
   zeropage += 1; \
   absolute += mem_read(mem, zeropage) * 256; \
@@ -179,7 +188,7 @@ static inline void flag_overflow_bit(w65c02_t *cpu, uint8_t value)
 #define OP_PROLOGUE_ZPI \
   uint8_t zeropage; \
   uint16_t absolute; \
-  zeropage  = mem_read(mem, cpu->pc++); \
+  zeropage  = operand_fetch(cpu); \
   absolute  = mem_read(mem, zeropage); \
   zeropage += 1; \
   absolute += mem_read(mem, zeropage) * 256;
@@ -187,7 +196,7 @@ static inline void flag_overflow_bit(w65c02_t *cpu, uint8_t value)
 #define OP_PROLOGUE_ZPIX \
   uint8_t zeropage; \
   uint16_t absolute; \
-  zeropage  = mem_read(mem, cpu->pc++); \
+  zeropage  = operand_fetch(cpu); \
   zeropage += cpu->x; \
   absolute  = mem_read(mem, zeropage); \
   zeropage += 1; \
@@ -195,22 +204,22 @@ static inline void flag_overflow_bit(w65c02_t *cpu, uint8_t value)
 
 #define OP_PROLOGUE_ABSX_BOUNDARY_CHECK \
   uint16_t absolute; \
-  absolute  = mem_read(mem, cpu->pc++); \
-  absolute += mem_read(mem, cpu->pc++) * 256; \
+  absolute  = operand_fetch(cpu); \
+  absolute += operand_fetch(cpu) * 256; \
   if ((absolute & 0xFF00) != ((absolute + cpu->x) & 0xFF00)) cpu->cycles++; \
   absolute += cpu->x;
 
 #define OP_PROLOGUE_ABSY_BOUNDARY_CHECK \
   uint16_t absolute; \
-  absolute  = mem_read(mem, cpu->pc++); \
-  absolute += mem_read(mem, cpu->pc++) * 256; \
+  absolute  = operand_fetch(cpu); \
+  absolute += operand_fetch(cpu) * 256; \
   if ((absolute & 0xFF00) != ((absolute + cpu->y) & 0xFF00)) cpu->cycles++; \
   absolute += cpu->y; \
 
 #define OP_PROLOGUE_ZPYI_BOUNDARY_CHECK \
   uint8_t zeropage; \
   uint16_t absolute; \
-  zeropage  = mem_read(mem, cpu->pc++); \
+  zeropage  = operand_fetch(cpu); \
   absolute  = mem_read(mem, zeropage); \
   zeropage += 1; \
   absolute += mem_read(mem, zeropage) * 256; \
@@ -248,8 +257,7 @@ static inline void w65c02_logic_adc(w65c02_t *cpu, uint8_t value)
     } else {
       cpu->status.c = 0;
     }
-    flag_negative_other(cpu, cpu->a);
-    flag_zero_other(cpu, cpu->a);
+    flag_negative_zero(cpu, cpu->a);
     cpu->cycles++;
   } else {
     initial = cpu->a;
@@ -257,8 +265,7 @@ static inline void w65c02_logic_adc(w65c02_t *cpu, uint8_t value)
     cpu->a += value;
     cpu->a += cpu->status.c;
     flag_overflow_add(cpu, initial, value);
-    flag_negative_other(cpu, cpu->a);
-    flag_zero_other(cpu, cpu->a);
+    flag_negative_zero(cpu, cpu->a);
     cpu->status.c = bit;
   }
 }
@@ -276,8 +283,7 @@ static inline void w65c02_logic_sbc(w65c02_t *cpu, uint8_t value)
     cpu->a -= 1;
   }
   flag_overflow_sub(cpu, initial, value);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
   if (cpu->status.d == 1) {
     ah = initial;
     al = (ah & 0x0F) - (value & 0x0F) + (cpu->status.c - 1);
@@ -289,8 +295,7 @@ static inline void w65c02_logic_sbc(w65c02_t *cpu, uint8_t value)
       ah -= 0x06;
     }
     cpu->a = ah & 0xFF;
-    flag_negative_other(cpu, cpu->a);
-    flag_zero_other(cpu, cpu->a);
+    flag_negative_zero(cpu, cpu->a);
     cpu->cycles++;
   }
   cpu->status.c = bit;
@@ -300,7 +305,8 @@ static inline void w65c02_logic_sbc(w65c02_t *cpu, uint8_t value)
 
 static void op_adc_imm(w65c02_t *cpu, mem_t *mem)
 {
-  uint8_t value = mem_read(mem, cpu->pc++);
+  (void)mem;
+  uint8_t value = operand_fetch(cpu);
   w65c02_logic_adc(cpu, value);
 }
 
@@ -362,73 +368,65 @@ static void op_adc_zpix(w65c02_t *cpu, mem_t *mem)
 
 static void op_and_imm(w65c02_t *cpu, mem_t *mem)
 {
-  cpu->a &= mem_read(mem, cpu->pc++);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  (void)mem;
+  cpu->a &= operand_fetch(cpu);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_and_abs(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABS
   cpu->a &= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_and_absx(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABSX_BOUNDARY_CHECK
   cpu->a &= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_and_absy(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABSY_BOUNDARY_CHECK
   cpu->a &= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_and_zp(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   cpu->a &= mem_read(mem, zeropage);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_and_zpx(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPX
   cpu->a &= mem_read(mem, zeropage);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_and_zpyi(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPYI_BOUNDARY_CHECK
   cpu->a &= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_and_zpi(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPI
   cpu->a &= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_and_zpix(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPIX
   cpu->a &= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_asl_accu(w65c02_t *cpu, mem_t *mem)
@@ -439,8 +437,7 @@ static void op_asl_accu(w65c02_t *cpu, mem_t *mem)
   value = value << 1;
   cpu->a = value;
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_asl_abs(w65c02_t *cpu, mem_t *mem)
@@ -451,8 +448,7 @@ static void op_asl_abs(w65c02_t *cpu, mem_t *mem)
   value = value << 1;
   mem_write(mem, absolute, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_asl_absx(w65c02_t *cpu, mem_t *mem)
@@ -463,8 +459,7 @@ static void op_asl_absx(w65c02_t *cpu, mem_t *mem)
   value = value << 1;
   mem_write(mem, absolute, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_asl_zp(w65c02_t *cpu, mem_t *mem)
@@ -475,8 +470,7 @@ static void op_asl_zp(w65c02_t *cpu, mem_t *mem)
   value = value << 1;
   mem_write(mem, zeropage, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_asl_zpx(w65c02_t *cpu, mem_t *mem)
@@ -487,15 +481,14 @@ static void op_asl_zpx(w65c02_t *cpu, mem_t *mem)
   value = value << 1;
   mem_write(mem, zeropage, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_bbr0(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if ((value & 1) == 0) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -509,7 +502,7 @@ static void op_bbr1(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if (((value >> 1) & 1) == 0) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -523,7 +516,7 @@ static void op_bbr2(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if (((value >> 2) & 1) == 0) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -537,7 +530,7 @@ static void op_bbr3(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if (((value >> 3) & 1) == 0) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -551,7 +544,7 @@ static void op_bbr4(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if (((value >> 4) & 1) == 0) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -565,7 +558,7 @@ static void op_bbr5(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if (((value >> 5) & 1) == 0) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -579,7 +572,7 @@ static void op_bbr6(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if (((value >> 6) & 1) == 0) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -593,7 +586,7 @@ static void op_bbr7(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if (((value >> 7) & 1) == 0) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -607,7 +600,7 @@ static void op_bbs0(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if ((value & 1) == 1) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -621,7 +614,7 @@ static void op_bbs1(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if (((value >> 1) & 1) == 1) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -635,7 +628,7 @@ static void op_bbs2(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if (((value >> 2) & 1) == 1) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -649,7 +642,7 @@ static void op_bbs3(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if (((value >> 3) & 1) == 1) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -663,7 +656,7 @@ static void op_bbs4(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if (((value >> 4) & 1) == 1) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -677,7 +670,7 @@ static void op_bbs5(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if (((value >> 5) & 1) == 1) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -691,7 +684,7 @@ static void op_bbs6(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if (((value >> 6) & 1) == 1) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -705,9 +698,9 @@ static void op_bbs7(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  int8_t relative = mem_read(mem, cpu->pc++);
+  int8_t relative = operand_fetch(cpu);
   if (zeropage == 0xFF && relative == -1) {
-    panic("Suspicious $FF $FF $FF machine code!\n");
+    panic(mem->machine, "Suspicious $FF $FF $FF machine code!\n");
   }
   if (((value >> 7) & 1) == 1) {
     cpu->cycles++;
@@ -720,7 +713,8 @@ static void op_bbs7(w65c02_t *cpu, mem_t *mem)
 
 static void op_bcc(w65c02_t *cpu, mem_t *mem)
 {
-  int8_t relative = mem_read(mem, cpu->pc++);
+  (void)mem;
+  int8_t relative = operand_fetch(cpu);
   if (cpu->status.c == 0) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -732,7 +726,8 @@ static void op_bcc(w65c02_t *cpu, mem_t *mem)
 
 static void op_bcs(w65c02_t *cpu, mem_t *mem)
 {
-  int8_t relative = mem_read(mem, cpu->pc++);
+  (void)mem;
+  int8_t relative = operand_fetch(cpu);
   if (cpu->status.c == 1) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -744,8 +739,9 @@ static void op_bcs(w65c02_t *cpu, mem_t *mem)
 
 static void op_beq(w65c02_t *cpu, mem_t *mem)
 {
-  int8_t relative = mem_read(mem, cpu->pc++);
-  if (cpu->status.z == 1) {
+  (void)mem;
+  int8_t relative = operand_fetch(cpu);
+  if (flag_zero(cpu)) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
       cpu->cycles++; /* Crossed a page boundary. */
@@ -759,9 +755,7 @@ static void op_bit_abs(w65c02_t *cpu, mem_t *mem)
   OP_PROLOGUE_ABS
   uint8_t value = mem_read(mem, absolute);
   flag_overflow_bit(cpu, value);
-  flag_negative_other(cpu, value);
-  value &= cpu->a;
-  flag_zero_other(cpu, value);
+  flag_negative_bit(cpu, value);
 }
 
 static void op_bit_absx(w65c02_t *cpu, mem_t *mem)
@@ -769,14 +763,13 @@ static void op_bit_absx(w65c02_t *cpu, mem_t *mem)
   OP_PROLOGUE_ABSX_BOUNDARY_CHECK
   uint8_t value = mem_read(mem, absolute);
   flag_overflow_bit(cpu, value);
-  flag_negative_other(cpu, value);
-  value &= cpu->a;
-  flag_zero_other(cpu, value);
+  flag_negative_bit(cpu, value);
 }
 
 static void op_bit_imm(w65c02_t *cpu, mem_t *mem)
 {
-  uint8_t value = mem_read(mem, cpu->pc++);
+  (void)mem;
+  uint8_t value = operand_fetch(cpu);
   value &= cpu->a;
   flag_zero_other(cpu, value);
 }
@@ -786,9 +779,7 @@ static void op_bit_zp(w65c02_t *cpu, mem_t *mem)
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
   flag_overflow_bit(cpu, value);
-  flag_negative_other(cpu, value);
-  value &= cpu->a;
-  flag_zero_other(cpu, value);
+  flag_negative_bit(cpu, value);
 }
 
 static void op_bit_zpx(w65c02_t *cpu, mem_t *mem)
@@ -796,15 +787,14 @@ static void op_bit_zpx(w65c02_t *cpu, mem_t *mem)
   OP_PROLOGUE_ZPX
   uint8_t value = mem_read(mem, zeropage);
   flag_overflow_bit(cpu, value);
-  flag_negative_other(cpu, value);
-  value &= cpu->a;
-  flag_zero_other(cpu, value);
+  flag_negative_bit(cpu, value);
 }
 
 static void op_bmi(w65c02_t *cpu, mem_t *mem)
 {
-  int8_t relative = mem_read(mem, cpu->pc++);
-  if (cpu->status.n == 1) {
+  (void)mem;
+  int8_t relative = operand_fetch(cpu);
+  if (flag_negative(cpu)) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
       cpu->cycles++; /* Crossed a page boundary. */
@@ -815,8 +805,9 @@ static void op_bmi(w65c02_t *cpu, mem_t *mem)
 
 static void op_bne(w65c02_t *cpu, mem_t *mem)
 {
-  int8_t relative = mem_read(mem, cpu->pc++);
-  if (cpu->status.z == 0) {
+  (void)mem;
+  int8_t relative = operand_fetch(cpu);
+  if (! flag_zero(cpu)) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
       cpu->cycles++; /* Crossed a page boundary. */
@@ -827,8 +818,9 @@ static void op_bne(w65c02_t *cpu, mem_t *mem)
 
 static void op_bpl(w65c02_t *cpu, mem_t *mem)
 {
-  int8_t relative = mem_read(mem, cpu->pc++);
-  if (cpu->status.n == 0) {
+  (void)mem;
+  int8_t relative = operand_fetch(cpu);
+  if (! flag_negative(cpu)) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
       cpu->cycles++; /* Crossed a page boundary. */
@@ -839,7 +831,8 @@ static void op_bpl(w65c02_t *cpu, mem_t *mem)
 
 static void op_bra(w65c02_t *cpu, mem_t *mem)
 {
-  int8_t relative = mem_read(mem, cpu->pc++);
+  (void)mem;
+  int8_t relative = operand_fetch(cpu);
   cpu->cycles++;
   if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
     cpu->cycles++; /* Crossed a page boundary. */
@@ -851,7 +844,8 @@ static void op_brk(w65c02_t *cpu, mem_t *mem)
 {
   mem_write(mem, MEM_PAGE_STACK + cpu->s--, (cpu->pc + 1) / 256);
   mem_write(mem, MEM_PAGE_STACK + cpu->s--, (cpu->pc + 1) % 256);
-  mem_write(mem, MEM_PAGE_STACK + cpu->s--, cpu->p | 0x10); /* Break */
+  mem_write(mem, MEM_PAGE_STACK + cpu->s--,
+    w65c02_status_get(cpu) | 0x10); /* Break */
   cpu->status.i = 1;
   cpu->status.d = 0;
   cpu->pc  = mem_read(mem, W65C02_VECTOR_IRQ_LOW);
@@ -860,7 +854,8 @@ static void op_brk(w65c02_t *cpu, mem_t *mem)
 
 static void op_bvc(w65c02_t *cpu, mem_t *mem)
 {
-  int8_t relative = mem_read(mem, cpu->pc++);
+  (void)mem;
+  int8_t relative = operand_fetch(cpu);
   if (cpu->status.v == 0) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -872,7 +867,8 @@ static void op_bvc(w65c02_t *cpu, mem_t *mem)
 
 static void op_bvs(w65c02_t *cpu, mem_t *mem)
 {
-  int8_t relative = mem_read(mem, cpu->pc++);
+  (void)mem;
+  int8_t relative = operand_fetch(cpu);
   if (cpu->status.v == 1) {
     cpu->cycles++;
     if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
@@ -908,9 +904,9 @@ static void op_clv(w65c02_t *cpu, mem_t *mem)
 
 static void op_cmp_imm(w65c02_t *cpu, mem_t *mem)
 {
-  uint8_t value = mem_read(mem, cpu->pc++);
-  flag_negative_compare(cpu, cpu->a, value);
-  flag_zero_compare(cpu, cpu->a, value);
+  (void)mem;
+  uint8_t value = operand_fetch(cpu);
+  flag_negative_zero(cpu, cpu->a - value);
   flag_carry_compare(cpu, cpu->a, value);
 }
 
@@ -918,8 +914,7 @@ static void op_cmp_abs(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABS
   uint8_t value = mem_read(mem, absolute);
-  flag_negative_compare(cpu, cpu->a, value);
-  flag_zero_compare(cpu, cpu->a, value);
+  flag_negative_zero(cpu, cpu->a - value);
   flag_carry_compare(cpu, cpu->a, value);
 }
 
@@ -927,8 +922,7 @@ static void op_cmp_absx(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABSX_BOUNDARY_CHECK
   uint8_t value = mem_read(mem, absolute);
-  flag_negative_compare(cpu, cpu->a, value);
-  flag_zero_compare(cpu, cpu->a, value);
+  flag_negative_zero(cpu, cpu->a - value);
   flag_carry_compare(cpu, cpu->a, value);
 }
 
@@ -936,8 +930,7 @@ static void op_cmp_absy(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABSY_BOUNDARY_CHECK
   uint8_t value = mem_read(mem, absolute);
-  flag_negative_compare(cpu, cpu->a, value);
-  flag_zero_compare(cpu, cpu->a, value);
+  flag_negative_zero(cpu, cpu->a - value);
   flag_carry_compare(cpu, cpu->a, value);
 }
 
@@ -945,8 +938,7 @@ static void op_cmp_zp(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  flag_negative_compare(cpu, cpu->a, value);
-  flag_zero_compare(cpu, cpu->a, value);
+  flag_negative_zero(cpu, cpu->a - value);
   flag_carry_compare(cpu, cpu->a, value);
 }
 
@@ -954,8 +946,7 @@ static void op_cmp_zpx(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPX
   uint8_t value = mem_read(mem, zeropage);
-  flag_negative_compare(cpu, cpu->a, value);
-  flag_zero_compare(cpu, cpu->a, value);
+  flag_negative_zero(cpu, cpu->a - value);
   flag_carry_compare(cpu, cpu->a, value);
 }
 
@@ -963,8 +954,7 @@ static void op_cmp_zpyi(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPYI_BOUNDARY_CHECK
   uint8_t value = mem_read(mem, absolute);
-  flag_negative_compare(cpu, cpu->a, value);
-  flag_zero_compare(cpu, cpu->a, value);
+  flag_negative_zero(cpu, cpu->a - value);
   flag_carry_compare(cpu, cpu->a, value);
 }
 
@@ -972,8 +962,7 @@ static void op_cmp_zpi(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPI
   uint8_t value = mem_read(mem, absolute);
-  flag_negative_compare(cpu, cpu->a, value);
-  flag_zero_compare(cpu, cpu->a, value);
+  flag_negative_zero(cpu, cpu->a - value);
   flag_carry_compare(cpu, cpu->a, value);
 }
 
@@ -981,16 +970,15 @@ static void op_cmp_zpix(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPIX
   uint8_t value = mem_read(mem, absolute);
-  flag_negative_compare(cpu, cpu->a, value);
-  flag_zero_compare(cpu, cpu->a, value);
+  flag_negative_zero(cpu, cpu->a - value);
   flag_carry_compare(cpu, cpu->a, value);
 }
 
 static void op_cpx_imm(w65c02_t *cpu, mem_t *mem)
 {
-  uint8_t value = mem_read(mem, cpu->pc++);
-  flag_negative_compare(cpu, cpu->x, value);
-  flag_zero_compare(cpu, cpu->x, value);
+  (void)mem;
+  uint8_t value = operand_fetch(cpu);
+  flag_negative_zero(cpu, cpu->x - value);
   flag_carry_compare(cpu, cpu->x, value);
 }
 
@@ -998,8 +986,7 @@ static void op_cpx_abs(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABS
   uint8_t value = mem_read(mem, absolute);
-  flag_negative_compare(cpu, cpu->x, value);
-  flag_zero_compare(cpu, cpu->x, value);
+  flag_negative_zero(cpu, cpu->x - value);
   flag_carry_compare(cpu, cpu->x, value);
 }
 
@@ -1007,16 +994,15 @@ static void op_cpx_zp(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  flag_negative_compare(cpu, cpu->x, value);
-  flag_zero_compare(cpu, cpu->x, value);
+  flag_negative_zero(cpu, cpu->x - value);
   flag_carry_compare(cpu, cpu->x, value);
 }
 
 static void op_cpy_imm(w65c02_t *cpu, mem_t *mem)
 {
-  uint8_t value = mem_read(mem, cpu->pc++);
-  flag_negative_compare(cpu, cpu->y, value);
-  flag_zero_compare(cpu, cpu->y, value);
+  (void)mem;
+  uint8_t value = operand_fetch(cpu);
+  flag_negative_zero(cpu, cpu->y - value);
   flag_carry_compare(cpu, cpu->y, value);
 }
 
@@ -1024,8 +1010,7 @@ static void op_cpy_abs(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABS
   uint8_t value = mem_read(mem, absolute);
-  flag_negative_compare(cpu, cpu->y, value);
-  flag_zero_compare(cpu, cpu->y, value);
+  flag_negative_zero(cpu, cpu->y - value);
   flag_carry_compare(cpu, cpu->y, value);
 }
 
@@ -1033,8 +1018,7 @@ static void op_cpy_zp(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   uint8_t value = mem_read(mem, zeropage);
-  flag_negative_compare(cpu, cpu->y, value);
-  flag_zero_compare(cpu, cpu->y, value);
+  flag_negative_zero(cpu, cpu->y - value);
   flag_carry_compare(cpu, cpu->y, value);
 }
 
@@ -1042,8 +1026,7 @@ static void op_dec(w65c02_t *cpu, mem_t *mem)
 {
   (void)mem;
   cpu->a--;
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_dec_abs(w65c02_t *cpu, mem_t *mem)
@@ -1052,8 +1035,7 @@ static void op_dec_abs(w65c02_t *cpu, mem_t *mem)
   uint8_t value = mem_read(mem, absolute);
   value -= 1;
   mem_write(mem, absolute, value);
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_dec_absx(w65c02_t *cpu, mem_t *mem)
@@ -1062,8 +1044,7 @@ static void op_dec_absx(w65c02_t *cpu, mem_t *mem)
   uint8_t value = mem_read(mem, absolute);
   value -= 1;
   mem_write(mem, absolute, value);
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_dec_zp(w65c02_t *cpu, mem_t *mem)
@@ -1072,8 +1053,7 @@ static void op_dec_zp(w65c02_t *cpu, mem_t *mem)
   uint8_t value = mem_read(mem, zeropage);
   value -= 1;
   mem_write(mem, zeropage, value);
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_dec_zpx(w65c02_t *cpu, mem_t *mem)
@@ -1082,103 +1062,91 @@ static void op_dec_zpx(w65c02_t *cpu, mem_t *mem)
   uint8_t value = mem_read(mem, zeropage);
   value -= 1;
   mem_write(mem, zeropage, value);
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_dex(w65c02_t *cpu, mem_t *mem)
 {
   (void)mem;
   cpu->x--;
-  flag_negative_other(cpu, cpu->x);
-  flag_zero_other(cpu, cpu->x);
+  flag_negative_zero(cpu, cpu->x);
 }
 
 static void op_dey(w65c02_t *cpu, mem_t *mem)
 {
   (void)mem;
   cpu->y--;
-  flag_negative_other(cpu, cpu->y);
-  flag_zero_other(cpu, cpu->y);
+  flag_negative_zero(cpu, cpu->y);
 }
 
 static void op_eor_imm(w65c02_t *cpu, mem_t *mem)
 {
-  cpu->a ^= mem_read(mem, cpu->pc++);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  (void)mem;
+  cpu->a ^= operand_fetch(cpu);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_eor_abs(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABS
   cpu->a ^= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_eor_absx(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABSX_BOUNDARY_CHECK
   cpu->a ^= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_eor_absy(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABSY_BOUNDARY_CHECK
   cpu->a ^= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_eor_zp(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   cpu->a ^= mem_read(mem, zeropage);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_eor_zpx(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPX
   cpu->a ^= mem_read(mem, zeropage);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_eor_zpyi(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPYI_BOUNDARY_CHECK
   cpu->a ^= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_eor_zpi(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPI
   cpu->a ^= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_eor_zpix(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPIX
   cpu->a ^= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_inc(w65c02_t *cpu, mem_t *mem)
 {
   (void)mem;
   cpu->a++;
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_inc_abs(w65c02_t *cpu, mem_t *mem)
@@ -1187,8 +1155,7 @@ static void op_inc_abs(w65c02_t *cpu, mem_t *mem)
   uint8_t value = mem_read(mem, absolute);
   value += 1;
   mem_write(mem, absolute, value);
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_inc_absx(w65c02_t *cpu, mem_t *mem)
@@ -1197,8 +1164,7 @@ static void op_inc_absx(w65c02_t *cpu, mem_t *mem)
   uint8_t value = mem_read(mem, absolute);
   value += 1;
   mem_write(mem, absolute, value);
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_inc_zp(w65c02_t *cpu, mem_t *mem)
@@ -1207,8 +1173,7 @@ static void op_inc_zp(w65c02_t *cpu, mem_t *mem)
   uint8_t value = mem_read(mem, zeropage);
   value += 1;
   mem_write(mem, zeropage, value);
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_inc_zpx(w65c02_t *cpu, mem_t *mem)
@@ -1217,28 +1182,26 @@ static void op_inc_zpx(w65c02_t *cpu, mem_t *mem)
   uint8_t value = mem_read(mem, zeropage);
   value += 1;
   mem_write(mem, zeropage, value);
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_inx(w65c02_t *cpu, mem_t *mem)
 {
   (void)mem;
   cpu->x++;
-  flag_negative_other(cpu, cpu->x);
-  flag_zero_other(cpu, cpu->x);
+  flag_negative_zero(cpu, cpu->x);
 }
 
 static void op_iny(w65c02_t *cpu, mem_t *mem)
 {
   (void)mem;
   cpu->y++;
-  flag_negative_other(cpu, cpu->y);
-  flag_zero_other(cpu, cpu->y);
+  flag_negative_zero(cpu, cpu->y);
 }
 
 static void op_jmp_abs(w65c02_t *cpu, mem_t *mem)
 {
+  (void)mem;
   OP_PROLOGUE_ABS
   cpu->pc = absolute;
 }
@@ -1272,151 +1235,135 @@ static void op_jsr(w65c02_t *cpu, mem_t *mem)
 
 static void op_lda_imm(w65c02_t *cpu, mem_t *mem)
 {
-  cpu->a = mem_read(mem, cpu->pc++);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  (void)mem;
+  cpu->a = operand_fetch(cpu);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_lda_abs(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABS
   cpu->a = mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_lda_absx(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABSX_BOUNDARY_CHECK
   cpu->a = mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_lda_absy(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABSY_BOUNDARY_CHECK
   cpu->a = mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_lda_zp(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   cpu->a = mem_read(mem, zeropage);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_lda_zpx(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPX
   cpu->a = mem_read(mem, zeropage);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_lda_zpyi(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPYI_BOUNDARY_CHECK
   cpu->a = mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_lda_zpi(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPI
   cpu->a = mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_lda_zpix(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPIX
   cpu->a = mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_ldx_imm(w65c02_t *cpu, mem_t *mem)
 {
-  cpu->x = mem_read(mem, cpu->pc++);
-  flag_negative_other(cpu, cpu->x);
-  flag_zero_other(cpu, cpu->x);
+  (void)mem;
+  cpu->x = operand_fetch(cpu);
+  flag_negative_zero(cpu, cpu->x);
 }
 
 static void op_ldx_abs(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABS
   cpu->x = mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->x);
-  flag_zero_other(cpu, cpu->x);
+  flag_negative_zero(cpu, cpu->x);
 }
 
 static void op_ldx_absy(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABSY_BOUNDARY_CHECK
   cpu->x = mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->x);
-  flag_zero_other(cpu, cpu->x);
+  flag_negative_zero(cpu, cpu->x);
 }
 
 static void op_ldx_zp(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   cpu->x = mem_read(mem, zeropage);
-  flag_negative_other(cpu, cpu->x);
-  flag_zero_other(cpu, cpu->x);
+  flag_negative_zero(cpu, cpu->x);
 }
 
 static void op_ldx_zpy(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPY
   cpu->x = mem_read(mem, zeropage);
-  flag_negative_other(cpu, cpu->x);
-  flag_zero_other(cpu, cpu->x);
+  flag_negative_zero(cpu, cpu->x);
 }
 
 static void op_ldy_imm(w65c02_t *cpu, mem_t *mem)
 {
-  cpu->y = mem_read(mem, cpu->pc++);
-  flag_negative_other(cpu, cpu->y);
-  flag_zero_other(cpu, cpu->y);
+  (void)mem;
+  cpu->y = operand_fetch(cpu);
+  flag_negative_zero(cpu, cpu->y);
 }
 
 static void op_ldy_abs(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABS
   cpu->y = mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->y);
-  flag_zero_other(cpu, cpu->y);
+  flag_negative_zero(cpu, cpu->y);
 }
 
 static void op_ldy_absx(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABSX_BOUNDARY_CHECK
   cpu->y = mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->y);
-  flag_zero_other(cpu, cpu->y);
+  flag_negative_zero(cpu, cpu->y);
 }
 
 static void op_ldy_zp(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   cpu->y = mem_read(mem, zeropage);
-  flag_negative_other(cpu, cpu->y);
-  flag_zero_other(cpu, cpu->y);
+  flag_negative_zero(cpu, cpu->y);
 }
 
 static void op_ldy_zpx(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPX
   cpu->y = mem_read(mem, zeropage);
-  flag_negative_other(cpu, cpu->y);
-  flag_zero_other(cpu, cpu->y);
+  flag_negative_zero(cpu, cpu->y);
 }
 
 static void op_lsr_accu(w65c02_t *cpu, mem_t *mem)
@@ -1427,8 +1374,7 @@ static void op_lsr_accu(w65c02_t *cpu, mem_t *mem)
   value = value >> 1;
   cpu->a = value;
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_lsr_abs(w65c02_t *cpu, mem_t *mem)
@@ -1439,8 +1385,7 @@ static void op_lsr_abs(w65c02_t *cpu, mem_t *mem)
   value = value >> 1;
   mem_write(mem, absolute, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_lsr_absx(w65c02_t *cpu, mem_t *mem)
@@ -1451,8 +1396,7 @@ static void op_lsr_absx(w65c02_t *cpu, mem_t *mem)
   value = value >> 1;
   mem_write(mem, absolute, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_lsr_zp(w65c02_t *cpu, mem_t *mem)
@@ -1463,8 +1407,7 @@ static void op_lsr_zp(w65c02_t *cpu, mem_t *mem)
   value = value >> 1;
   mem_write(mem, zeropage, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_lsr_zpx(w65c02_t *cpu, mem_t *mem)
@@ -1475,8 +1418,7 @@ static void op_lsr_zpx(w65c02_t *cpu, mem_t *mem)
   value = value >> 1;
   mem_write(mem, zeropage, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_nop(w65c02_t *cpu, mem_t *mem)
@@ -1487,7 +1429,8 @@ static void op_nop(w65c02_t *cpu, mem_t *mem)
 
 static void op_nop_imm(w65c02_t *cpu, mem_t *mem)
 {
-  (void)mem_read(mem, cpu->pc++);
+  (void)mem;
+  (void)operand_fetch(cpu);
 }
 
 static void op_nop_abs(w65c02_t *cpu, mem_t *mem)
@@ -1510,73 +1453,65 @@ static void op_nop_zpx(w65c02_t *cpu, mem_t *mem)
 
 static void op_ora_imm(w65c02_t *cpu, mem_t *mem)
 {
-  cpu->a |= mem_read(mem, cpu->pc++);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  (void)mem;
+  cpu->a |= operand_fetch(cpu);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_ora_abs(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABS
   cpu->a |= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_ora_absx(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABSX_BOUNDARY_CHECK
   cpu->a |= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_ora_absy(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ABSY_BOUNDARY_CHECK
   cpu->a |= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_ora_zp(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZP
   cpu->a |= mem_read(mem, zeropage);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_ora_zpx(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPX
   cpu->a |= mem_read(mem, zeropage);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_ora_zpyi(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPYI_BOUNDARY_CHECK
   cpu->a |= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_ora_zpi(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPI
   cpu->a |= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_ora_zpix(w65c02_t *cpu, mem_t *mem)
 {
   OP_PROLOGUE_ZPIX
   cpu->a |= mem_read(mem, absolute);
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_pha(w65c02_t *cpu, mem_t *mem)
@@ -1596,34 +1531,32 @@ static void op_phy(w65c02_t *cpu, mem_t *mem)
 
 static void op_php(w65c02_t *cpu, mem_t *mem)
 {
-  mem_write(mem, MEM_PAGE_STACK + cpu->s--, cpu->p | 0x10); /* Break */
+  mem_write(mem, MEM_PAGE_STACK + cpu->s--,
+    w65c02_status_get(cpu) | 0x10); /* Break */
 }
 
 static void op_pla(w65c02_t *cpu, mem_t *mem)
 {
   cpu->a = mem_read(mem, MEM_PAGE_STACK + (++cpu->s));
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_plx(w65c02_t *cpu, mem_t *mem)
 {
   cpu->x = mem_read(mem, MEM_PAGE_STACK + (++cpu->s));
-  flag_negative_other(cpu, cpu->x);
-  flag_zero_other(cpu, cpu->x);
+  flag_negative_zero(cpu, cpu->x);
 }
 
 static void op_ply(w65c02_t *cpu, mem_t *mem)
 {
   cpu->y = mem_read(mem, MEM_PAGE_STACK + (++cpu->s));
-  flag_negative_other(cpu, cpu->y);
-  flag_zero_other(cpu, cpu->y);
+  flag_negative_zero(cpu, cpu->y);
 }
 
 static void op_plp(w65c02_t *cpu, mem_t *mem)
 {
-  cpu->p = (mem_read(mem, MEM_PAGE_STACK + (++cpu->s)) & ~0x30) |
-           (cpu->p & 0x30);
+  w65c02_status_set(cpu, (mem_read(mem, MEM_PAGE_STACK + (++cpu->s)) &
+    ~0x30) | (cpu->p & 0x30));
 }
 
 static void op_rmb0(w65c02_t *cpu, mem_t *mem)
@@ -1701,8 +1634,7 @@ static void op_rol_accu(w65c02_t *cpu, mem_t *mem)
   }
   cpu->a = value;
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_rol_abs(w65c02_t *cpu, mem_t *mem)
@@ -1716,8 +1648,7 @@ static void op_rol_abs(w65c02_t *cpu, mem_t *mem)
   }
   mem_write(mem, absolute, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_rol_absx(w65c02_t *cpu, mem_t *mem)
@@ -1731,8 +1662,7 @@ static void op_rol_absx(w65c02_t *cpu, mem_t *mem)
   }
   mem_write(mem, absolute, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_rol_zp(w65c02_t *cpu, mem_t *mem)
@@ -1746,8 +1676,7 @@ static void op_rol_zp(w65c02_t *cpu, mem_t *mem)
   }
   mem_write(mem, zeropage, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_rol_zpx(w65c02_t *cpu, mem_t *mem)
@@ -1761,8 +1690,7 @@ static void op_rol_zpx(w65c02_t *cpu, mem_t *mem)
   }
   mem_write(mem, zeropage, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_ror_accu(w65c02_t *cpu, mem_t *mem)
@@ -1776,8 +1704,7 @@ static void op_ror_accu(w65c02_t *cpu, mem_t *mem)
   }
   cpu->a = value;
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_ror_abs(w65c02_t *cpu, mem_t *mem)
@@ -1791,8 +1718,7 @@ static void op_ror_abs(w65c02_t *cpu, mem_t *mem)
   }
   mem_write(mem, absolute, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_ror_absx(w65c02_t *cpu, mem_t *mem)
@@ -1806,8 +1732,7 @@ static void op_ror_absx(w65c02_t *cpu, mem_t *mem)
   }
   mem_write(mem, absolute, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_ror_zp(w65c02_t *cpu, mem_t *mem)
@@ -1821,8 +1746,7 @@ static void op_ror_zp(w65c02_t *cpu, mem_t *mem)
   }
   mem_write(mem, zeropage, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_ror_zpx(w65c02_t *cpu, mem_t *mem)
@@ -1836,14 +1760,13 @@ static void op_ror_zpx(w65c02_t *cpu, mem_t *mem)
   }
   mem_write(mem, zeropage, value);
   cpu->status.c = bit;
-  flag_negative_other(cpu, value);
-  flag_zero_other(cpu, value);
+  flag_negative_zero(cpu, value);
 }
 
 static void op_rti(w65c02_t *cpu, mem_t *mem)
 {
-  cpu->p = (mem_read(mem, MEM_PAGE_STACK + (++cpu->s)) & ~0x30) |
-           (cpu->p & 0x30);
+  w65c02_status_set(cpu, (mem_read(mem, MEM_PAGE_STACK + (++cpu->s)) &
+    ~0x30) | (cpu->p & 0x30));
   cpu->pc  = mem_read(mem, MEM_PAGE_STACK + (++cpu->s));
   cpu->pc += mem_read(mem, MEM_PAGE_STACK + (++cpu->s)) * 256;
 }
@@ -1857,7 +1780,8 @@ static void op_rts(w65c02_t *cpu, mem_t *mem)
 
 static void op_sbc_imm(w65c02_t *cpu, mem_t *mem)
 {
-  uint8_t value = mem_read(mem, cpu->pc++);
+  (void)mem;
+  uint8_t value = operand_fetch(cpu);
   w65c02_logic_sbc(cpu, value);
 }
 
@@ -2051,7 +1975,7 @@ static void op_stp(w65c02_t *cpu, mem_t *mem)
 {
   (void)cpu;
   (void)mem;
-  panic("STP instruction not implemented!\n");
+  panic(mem->machine, "STP instruction not implemented!\n");
 }
 
 static void op_stx_abs(w65c02_t *cpu, mem_t *mem)
@@ -2118,16 +2042,14 @@ static void op_tax(w65c02_t *cpu, mem_t *mem)
 {
   (void)mem;
   cpu->x = cpu->a;
-  flag_negative_other(cpu, cpu->x);
-  flag_zero_other(cpu, cpu->x);
+  flag_negative_zero(cpu, cpu->x);
 }
 
 static void op_tay(w65c02_t *cpu, mem_t *mem)
 {
   (void)mem;
   cpu->y = cpu->a;
-  flag_negative_other(cpu, cpu->y);
-  flag_zero_other(cpu, cpu->y);
+  flag_negative_zero(cpu, cpu->y);
 }
 
 static void op_trb_abs(w65c02_t *cpu, mem_t *mem)
@@ -2170,16 +2092,14 @@ static void op_tsx(w65c02_t *cpu, mem_t *mem)
 {
   (void)mem;
   cpu->x = cpu->s;
-  flag_negative_other(cpu, cpu->x);
-  flag_zero_other(cpu, cpu->x);
+  flag_negative_zero(cpu, cpu->x);
 }
 
 static void op_txa(w65c02_t *cpu, mem_t *mem)
 {
   (void)mem;
   cpu->a = cpu->x;
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_txs(w65c02_t *cpu, mem_t *mem)
@@ -2192,22 +2112,19 @@ static void op_tya(w65c02_t *cpu, mem_t *mem)
 {
   (void)mem;
   cpu->a = cpu->y;
-  flag_negative_other(cpu, cpu->a);
-  flag_zero_other(cpu, cpu->a);
+  flag_negative_zero(cpu, cpu->a);
 }
 
 static void op_wai(w65c02_t *cpu, mem_t *mem)
 {
   (void)cpu;
   (void)mem;
-  panic("WAI instruction not implemented!\n");
+  panic(mem->machine, "WAI instruction not implemented!\n");
 }
 
 
 
-typedef void (*w65c02_operation_func_t)(w65c02_t *, mem_t *);
-
-static w65c02_operation_func_t opcode_function[UINT8_MAX + 1] = {
+static const w65c02_operation_func_t opcode_function[UINT8_MAX + 1] = {
   op_brk,      op_ora_zpix, op_nop_imm,  op_nop,  /* 0x00 -> 0x03 */
   op_tsb_zp,   op_ora_zp,   op_asl_zp,   op_rmb0, /* 0x04 -> 0x07 */
   op_php,      op_ora_imm,  op_asl_accu, op_nop,  /* 0x08 -> 0x0B */
@@ -2277,7 +2194,7 @@ static w65c02_operation_func_t opcode_function[UINT8_MAX + 1] = {
 
 
 /* Base cycles when page boundary crossing is not considered. */
-static uint8_t opcode_cycles[UINT8_MAX + 1] = {
+static const uint8_t opcode_cycles[UINT8_MAX + 1] = {
 /* -0 -1 -2 -3 -4 -5 -6 -7 -8 -9 -A -B -C -D -E -F */
     7, 6, 2, 1, 5, 3, 5, 5, 3, 2, 2, 1, 6, 4, 6, 5, /* 0x0- */
     2, 5, 5, 1, 5, 4, 6, 5, 2, 4, 2, 1, 6, 4, 6, 5, /* 0x1- */
@@ -2299,16 +2216,237 @@ static uint8_t opcode_cycles[UINT8_MAX + 1] = {
 
 
 
+/* Instruction length in bytes, including the opcode. */
+static const uint8_t opcode_length[UINT8_MAX + 1] = {
+/* -0 -1 -2 -3 -4 -5 -6 -7 -8 -9 -A -B -C -D -E -F */
+    1, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3, /* 0x0- */
+    2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3, /* 0x1- */
+    3, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3, /* 0x2- */
+    2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3, /* 0x3- */
+    1, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3, /* 0x4- */
+    2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3, /* 0x5- */
+    1, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3, /* 0x6- */
+    2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3, /* 0x7- */
+    2, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3, /* 0x8- */
+    2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3, /* 0x9- */
+    2, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3, /* 0xA- */
+    2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3, /* 0xB- */
+    2, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3, /* 0xC- */
+    2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3, /* 0xD- */
+    2, 2, 2, 1, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 3, /* 0xE- */
+    2, 2, 2, 1, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 3, /* 0xF- */
+};
+
+
+
+/* Dispatch engine used by w65c02_run(), selected at build time. */
+#if defined(W65C02_DISPATCH_THREADED) && !defined(__GNUC__)
+#undef W65C02_DISPATCH_THREADED
+#define W65C02_DISPATCH_SWITCH /* Computed goto needs a GNU C compiler. */
+#endif
+
+/* Expand a macro once for every opcode, in numerical order. */
+#define OPCODE_EXPAND_16(m, h) \
+  m(h##0) m(h##1) m(h##2) m(h##3) m(h##4) m(h##5) m(h##6) m(h##7) \
+  m(h##8) m(h##9) m(h##A) m(h##B) m(h##C) m(h##D) m(h##E) m(h##F)
+
+#define OPCODE_EXPAND(m) \
+  OPCODE_EXPAND_16(m, 0x0) OPCODE_EXPAND_16(m, 0x1) \
+  OPCODE_EXPAND_16(m, 0x2) OPCODE_EXPAND_16(m, 0x3) \
+  OPCODE_EXPAND_16(m, 0x4) OPCODE_EXPAND_16(m, 0x5) \
+  OPCODE_EXPAND_16(m, 0x6) OPCODE_EXPAND_16(m, 0x7) \
+  OPCODE_EXPAND_16(m, 0x8) OPCODE_EXPAND_16(m, 0x9) \
+  OPCODE_EXPAND_16(m, 0xA) OPCODE_EXPAND_16(m, 0xB) \
+  OPCODE_EXPAND_16(m, 0xC) OPCODE_EXPAND_16(m, 0xD) \
+  OPCODE_EXPAND_16(m, 0xE) OPCODE_EXPAND_16(m, 0xF)
+
+
+
+/* Conditions that end a w65c02_run() early, checked after each instruction. */
+#define RUN_STOP(machine, cpu, mem) \
+  ((machine)->debugger_break || (mem)->io_event || \
+   (machine)->stop[(cpu).pc])
+
+
+
+/* Read the opcode and operand at PC, and fill in the decode cache entry if
+   the instruction lies within a single cached page. */
+static uint8_t w65c02_decode(w65c02_t *cpu, mem_t *mem, mem_decode_t *decode)
+{
+  uint8_t opcode;
+  uint8_t length;
+
+  opcode = mem_read(mem, cpu->pc);
+  length = opcode_length[opcode];
+  cpu->operand = 0;
+  if (length > 1) {
+    cpu->operand = mem_read(mem, cpu->pc + 1);
+  }
+  if (length > 2) {
+    cpu->operand += mem_read(mem, cpu->pc + 2) * 256;
+  }
+
+  if (decode != NULL && (cpu->pc & 0xFF) + length <= 0x100) {
+    decode->opcode = opcode;
+    decode->cycles = opcode_cycles[opcode];
+    decode->operand = cpu->operand;
+    mem_code_watch(mem, mem->read_page[cpu->pc >> 8], true);
+  }
+
+  cpu->pc++;
+  return opcode;
+}
+
+
+
+/* Fetch the next instruction, from the decode cache if possible. Sets the
+   operand and base cycles in the CPU and returns the opcode. */
+static inline uint8_t w65c02_fetch(w65c02_t *cpu, mem_t *mem)
+{
+  mem_decode_t *decode = mem->decode_page[cpu->pc >> 8];
+  uint8_t opcode;
+
+  if (decode != NULL) {
+    decode += cpu->pc & 0xFF;
+    if (decode->cycles != 0) {
+      cpu->pc++;
+      cpu->operand = decode->operand;
+      cpu->cycles = decode->cycles;
+      return decode->opcode;
+    }
+  }
+  opcode = w65c02_decode(cpu, mem, decode);
+  cpu->cycles = opcode_cycles[opcode];
+  return opcode;
+}
+
+
+
 void w65c02_execute(w65c02_t *cpu, mem_t *mem)
 {
   uint8_t opcode;
-  opcode = mem_read(mem, cpu->pc++);
+  uint8_t cycles = cpu->cycles;
+  opcode = w65c02_decode(cpu, mem, NULL);
   cpu->cycles += opcode_cycles[opcode];
   (opcode_function[opcode])(cpu, mem);
+  cpu->cycle_count += (uint8_t)(cpu->cycles - cycles);
 }
 
 
 
+#if defined(W65C02_DISPATCH_THREADED)
+/* Direct threaded: every handler ends with its own fetch and indirect jump,
+   and the registers live in a local copy that never leaves this function.
+   Since the function table is constant, each call below is resolved at
+   compile time and the handler is inlined into its label. GCSE is turned
+   off as recommended by the GCC manual for computed gotos, otherwise the
+   compile time explodes. */
+__attribute__((optimize("no-gcse")))
+int w65c02_run(w65c02_t *cpu, mem_t *mem, int budget)
+{
+  a2c_machine_t *machine = mem->machine;
+  w65c02_t local = *cpu;
+  uint64_t end = cpu->cycle_count + budget;
+  int consumed;
+  uint8_t opcode;
+
+  mem->cycle_count = &local.cycle_count;
+
+#define OPCODE_LABEL_ADDRESS(n) &&opcode_##n,
+  static void *const opcode_label[UINT8_MAX + 1] = {
+    OPCODE_EXPAND(OPCODE_LABEL_ADDRESS)
+  };
+
+#define DISPATCH() \
+  if (local.trace) { \
+    *cpu = local; \
+    w65c02_trace_add(cpu->trace, cpu, mem); \
+  } \
+  opcode = w65c02_fetch(&local, mem); \
+  goto *opcode_label[opcode];
+
+#define OPCODE_LABEL(n) \
+  opcode_##n: \
+    (opcode_function[n])(&local, mem); \
+    local.cycle_count += local.cycles; \
+    if (local.cycle_count >= end || RUN_STOP(machine, local, mem)) goto done; \
+    DISPATCH()
+
+  DISPATCH()
+  OPCODE_EXPAND(OPCODE_LABEL)
+
+done:
+  local.cycles = cpu->cycles;
+  consumed = local.cycle_count - cpu->cycle_count;
+  *cpu = local;
+  mem->cycle_count = &cpu->cycle_count;
+  return consumed;
+}
+
+#elif defined(W65C02_DISPATCH_SWITCH)
+/* Portable alternative with the same local register copy, but a single
+   shared dispatch point. */
+int w65c02_run(w65c02_t *cpu, mem_t *mem, int budget)
+{
+  a2c_machine_t *machine = mem->machine;
+  w65c02_t local = *cpu;
+  uint64_t end = cpu->cycle_count + budget;
+  int consumed;
+  uint8_t opcode;
+
+  mem->cycle_count = &local.cycle_count;
+
+#define OPCODE_CASE(n) \
+  case n: \
+    (opcode_function[n])(&local, mem); \
+    break;
+
+  do {
+    if (local.trace) {
+      *cpu = local;
+      w65c02_trace_add(cpu->trace, cpu, mem);
+    }
+    opcode = w65c02_fetch(&local, mem);
+    switch (opcode) {
+      OPCODE_EXPAND(OPCODE_CASE)
+    }
+    local.cycle_count += local.cycles;
+  } while (local.cycle_count < end && ! RUN_STOP(machine, local, mem));
+
+  local.cycles = cpu->cycles;
+  consumed = local.cycle_count - cpu->cycle_count;
+  *cpu = local;
+  mem->cycle_count = &cpu->cycle_count;
+  return consumed;
+}
+
+#else
+/* Plain function table, like calling w65c02_execute() in a loop. */
+int w65c02_run(w65c02_t *cpu, mem_t *mem, int budget)
+{
+  a2c_machine_t *machine = mem->machine;
+  uint8_t pending = cpu->cycles;
+  uint64_t start = cpu->cycle_count;
+  uint64_t end = start + budget;
+  uint8_t opcode;
+
+  mem->cycle_count = &cpu->cycle_count;
+  do {
+    if (cpu->trace) {
+      w65c02_trace_add(cpu->trace, cpu, mem);
+    }
+    opcode = w65c02_fetch(cpu, mem);
+    (opcode_function[opcode])(cpu, mem);
+    cpu->cycle_count += cpu->cycles;
+  } while (cpu->cycle_count < end && ! RUN_STOP(machine, *cpu, mem));
+
+  cpu->cycles = pending;
+  return cpu->cycle_count - start;
+}
+#endif
+
+
+
 void w65c02_reset(w65c02_t *cpu, mem_t *mem)
 {
   cpu->pc  = mem_read(mem, W65C02_VECTOR_RESET_LOW);
@@ -2324,6 +2462,7 @@ void w65c02_reset(w65c02_t *cpu, mem_t *mem)
   cpu->status.i = 1;
   cpu->status.z = 0;
   cpu->status.c = 0;
+  cpu->nz = 1; /* Neither N nor Z. */
   cpu->cycles = 0;
 }
 
@@ -2333,7 +2472,7 @@ void w65c02_nmi(w65c02_t *cpu, mem_t *mem)
 {
   mem_write(mem, MEM_PAGE_STACK + cpu->s--, cpu->pc / 256);
   mem_write(mem, MEM_PAGE_STACK + cpu->s--, cpu->pc % 256);
-  mem_write(mem, MEM_PAGE_STACK + cpu->s--, cpu->p);
+  mem_write(mem, MEM_PAGE_STACK + cpu->s--, w65c02_status_get(cpu));
   cpu->status.i = 1;
   cpu->pc  = mem_read(mem, W65C02_VECTOR_NMI_LOW);
   cpu->pc += mem_read(mem, W65C02_VECTOR_NMI_HIGH) * 256;
@@ -2348,7 +2487,7 @@ void w65c02_irq(w65c02_t *cpu, mem_t *mem)
   }
   mem_write(mem, MEM_PAGE_STACK + cpu->s--, cpu->pc / 256);
   mem_write(mem, MEM_PAGE_STACK + cpu->s--, cpu->pc % 256);
-  mem_write(mem, MEM_PAGE_STACK + cpu->s--, cpu->p);
+  mem_write(mem, MEM_PAGE_STACK + cpu->s--, w65c02_status_get(cpu));
   cpu->status.i = 1;
   cpu->pc  = mem_read(mem, W65C02_VECTOR_IRQ_LOW);
   cpu->pc += mem_read(mem, W65C02_VECTOR_IRQ_HIGH) * 256;
@@ -2356,3 +2495,42 @@ void w65c02_irq(w65c02_t *cpu, mem_t *mem)
 
 
 
+w65c02_operation_func_t w65c02_opcode_function(uint8_t opcode)
+{
+  return opcode_function[opcode];
+}
+
+
+
+uint8_t w65c02_opcode_cycles(uint8_t opcode)
+{
+  return opcode_cycles[opcode];
+}
+
+
+
+uint8_t w65c02_opcode_length(uint8_t opcode)
+{
+  return opcode_length[opcode];
+}
+
+
+
+/* Bring N and Z in the status register up to date with the last result. */
+uint8_t w65c02_status_get(w65c02_t *cpu)
+{
+  cpu->status.n = flag_negative(cpu);
+  cpu->status.z = flag_zero(cpu);
+  return cpu->p;
+}
+
+
+
+void w65c02_status_set(w65c02_t *cpu, uint8_t p)
+{
+  cpu->p = p;
+  cpu->nz = (p & 0x80) << 8;
+  if ((p & 0x02) == 0) {
+    cpu->nz |= 1;
+  }
+}
@@ -5,6 +5,8 @@
 #include <stdint.h>
 #include "mem.h"
 
+struct w65c02_trace_s;
+
 typedef struct w65c02_s {
   uint16_t pc; /* Program Counter */
   uint8_t a;   /* Accumulator */
@@ -26,9 +28,15 @@ typedef struct w65c02_s {
     uint8_t p; /* Processor Status */
   };
 
-  uint8_t cycles;     /* Internal Cycle Counter */
+  uint8_t cycles;       /* Internal Cycle Counter */
+  uint64_t cycle_count; /* Running Cycle Counter */
+  struct w65c02_trace_s *trace; /* Buffer to record instructions in. */
+  uint16_t operand;     /* Operand bytes not yet consumed by the handler. */
+  uint16_t nz;          /* Last result, N and Z in p are only set on demand. */
 } w65c02_t;
 
+typedef void (*w65c02_operation_func_t)(w65c02_t *, mem_t *);
+
 #define W65C02_VECTOR_NMI_LOW    0xFFFA
 #define W65C02_VECTOR_NMI_HIGH   0xFFFB
 #define W65C02_VECTOR_RESET_LOW  0xFFFC
@@ -37,8 +45,14 @@ typedef struct w65c02_s {
 #define W65C02_VECTOR_IRQ_HIGH   0xFFFF
 
 void w65c02_execute(w65c02_t *cpu, mem_t *mem);
+int w65c02_run(w65c02_t *cpu, mem_t *mem, int budget);
 void w65c02_reset(w65c02_t *cpu, mem_t *mem);
 void w65c02_nmi(w65c02_t *cpu, mem_t *mem);
 void w65c02_irq(w65c02_t *cpu, mem_t *mem);
+uint8_t w65c02_status_get(w65c02_t *cpu);
+void w65c02_status_set(w65c02_t *cpu, uint8_t p);
+w65c02_operation_func_t w65c02_opcode_function(uint8_t opcode);
+uint8_t w65c02_opcode_cycles(uint8_t opcode);
+uint8_t w65c02_opcode_length(uint8_t opcode);
 
 #endif /* _W65C02_H */
@@ -0,0 +1,1270 @@
+#include "w65c02_jit.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#define W65C02_JIT_X86_64
+#endif
+
+#include "machine.h"
+#include "mem.h"
+#include "w65c02.h"
+
+#define JIT_CODE_SIZE 0x400000 /* Executable buffer. */
+#define JIT_BLOCK_CODE_MAX 0x2000 /* Worst case native code for one block. */
+#define JIT_BLOCK_INSTRUCTIONS 64
+#define JIT_HOT 32 /* Block entries before it is translated. */
+#define JIT_PAGE_FLUSH_MAX 16 /* Invalidations before a page is left alone. */
+
+/* Native code register usage:
+   RBX = cpu, R12 = mem, R13 = cycles consumed, R14 = budget, R15 = jit */
+#define CPU_OFFSET(field) ((uint8_t)offsetof(w65c02_t, field))
+#define MEM_OFFSET(field) ((uint32_t)offsetof(mem_t, field))
+#define JIT_OFFSET(field) ((uint32_t)offsetof(w65c02_jit_t, field))
+
+/* Offsets of the fixed code every block starts with. */
+#define JIT_EPILOGUE 26
+#define JIT_BODY     39
+
+/* Status register bits, N and Z are kept in the CPU nz field instead. */
+#define FLAG_C 0x01
+#define FLAG_D 0x08
+#define FLAG_V 0x40
+
+
+
+static bool jit_ends_block(uint8_t opcode)
+{
+  switch (opcode) {
+  case 0x00: /* BRK */
+  case 0x20: /* JSR */
+  case 0x40: /* RTI */
+  case 0x4C: /* JMP a */
+  case 0x60: /* RTS */
+  case 0x6C: /* JMP (a) */
+  case 0x7C: /* JMP (a,x) */
+  case 0x80: /* BRA */
+  case 0xCB: /* WAI */
+  case 0xDB: /* STP */
+    return true;
+
+  default:
+    /* Conditional branches, BBR and BBS. */
+    return ((opcode & 0x1F) == 0x10) || ((opcode & 0x0F) == 0x0F);
+  }
+}
+
+
+
+/* Single step up to the end of a block that is not translated (yet). */
+static int jit_interpret(w65c02_t *cpu, mem_t *mem, int budget)
+{
+  int consumed = 0;
+  uint8_t *page;
+  bool last;
+
+  do {
+    page = mem->read_page[cpu->pc >> 8];
+    last = (page == NULL) || jit_ends_block(page[cpu->pc & 0xFF]);
+    consumed += w65c02_run(cpu, mem, 1);
+  } while (! last && consumed < budget &&
+    ! mem->machine->debugger_break && ! mem->io_event &&
+    ! mem->machine->stop[cpu->pc]);
+
+  return consumed;
+}
+
+
+
+#ifdef W65C02_JIT_X86_64
+static void emit8(w65c02_jit_t *jit, uint8_t value)
+{
+  jit->code[jit->code_used++] = value;
+}
+
+
+
+static void emit16(w65c02_jit_t *jit, uint16_t value)
+{
+  emit8(jit, value);
+  emit8(jit, value >> 8);
+}
+
+
+
+static void emit32(w65c02_jit_t *jit, uint32_t value)
+{
+  emit16(jit, value);
+  emit16(jit, value >> 16);
+}
+
+
+
+static void emit64(w65c02_jit_t *jit, uint64_t value)
+{
+  emit32(jit, value);
+  emit32(jit, value >> 32);
+}
+
+
+
+/* Relative 32-bit jump to an offset in the current block, 'cc' is the second
+   byte of a Jcc or 0 for JMP. */
+static void emit_jump(w65c02_jit_t *jit, uint8_t cc, size_t target)
+{
+  if (cc == 0) {
+    emit8(jit, 0xE9);
+  } else {
+    emit8(jit, 0x0F);
+    emit8(jit, cc);
+  }
+  emit32(jit, (jit->code_block + target) - (jit->code_used + 4));
+}
+
+
+
+/* Short forward jump, patched by emit_label(). */
+static size_t emit_jump_short(w65c02_jit_t *jit, uint8_t opcode)
+{
+  emit8(jit, opcode);
+  emit8(jit, 0);
+  return jit->code_used - 1;
+}
+
+
+
+static void emit_label(w65c02_jit_t *jit, size_t fixup)
+{
+  jit->code[fixup] = jit->code_used - (fixup + 1);
+}
+
+
+
+static void emit_call(w65c02_jit_t *jit, void *func)
+{
+  emit8(jit, 0x48); /* MOV RAX, imm64 */
+  emit8(jit, 0xB8);
+  emit64(jit, (uintptr_t)func);
+  emit8(jit, 0xFF); /* CALL RAX */
+  emit8(jit, 0xD0);
+}
+
+
+
+static void emit_set_pc(w65c02_jit_t *jit, uint16_t pc)
+{
+  emit8(jit, 0x66); /* MOV WORD [RBX+pc], imm16 */
+  emit8(jit, 0xC7);
+  emit8(jit, 0x43);
+  emit8(jit, CPU_OFFSET(pc));
+  emit16(jit, pc);
+}
+
+
+
+static void emit_add_cycles(w65c02_jit_t *jit, uint8_t cycles)
+{
+  emit8(jit, 0x41); /* ADD R13D, imm8 */
+  emit8(jit, 0x83);
+  emit8(jit, 0xC5);
+  emit8(jit, cycles);
+}
+
+
+
+/* EAX = register */
+static void emit_load_register(w65c02_jit_t *jit, uint8_t offset)
+{
+  emit8(jit, 0x0F); /* MOVZX EAX, BYTE [RBX+offset] */
+  emit8(jit, 0xB6);
+  emit8(jit, 0x43);
+  emit8(jit, offset);
+}
+
+
+
+/* Register = AL */
+static void emit_store_register(w65c02_jit_t *jit, uint8_t offset)
+{
+  emit8(jit, 0x88); /* MOV [RBX+offset], AL */
+  emit8(jit, 0x43);
+  emit8(jit, offset);
+}
+
+
+
+/* Set N and Z from the result in EAX. */
+static void emit_flags_nz(w65c02_jit_t *jit)
+{
+  emit8(jit, 0x66); /* MOV [RBX+nz], AX */
+  emit8(jit, 0x89);
+  emit8(jit, 0x43);
+  emit8(jit, CPU_OFFSET(nz));
+}
+
+
+
+/* EAX = memory at a fixed address outside the I/O page. The page pointer
+   is used without a NULL check, since mem_page_update() only leaves it NULL
+   for page $C0. emit_native() does not translate absolute operands there,
+   and zero page operands are always in RAM. */
+static void emit_read(w65c02_jit_t *jit, uint16_t address)
+{
+  emit8(jit, 0x49); /* MOV RCX, [R12+read_page] */
+  emit8(jit, 0x8B);
+  emit8(jit, 0x8C);
+  emit8(jit, 0x24);
+  emit32(jit, MEM_OFFSET(read_page) + (address >> 8) * sizeof(uint8_t *));
+  emit8(jit, 0x0F); /* MOVZX EAX, BYTE [RCX+offset] */
+  emit8(jit, 0xB6);
+  emit8(jit, 0x81);
+  emit32(jit, address & 0xFF);
+}
+
+
+
+/* Slow path accesses may hit I/O hooks, bank switches or cached code, so
+   always end the block after the instruction. */
+static uint8_t jit_read(w65c02_jit_t *jit, mem_t *mem, uint16_t address)
+{
+  jit->exit = true;
+  return mem_read_slow(mem, address);
+}
+
+
+
+static void jit_write(w65c02_jit_t *jit, mem_t *mem, uint16_t address,
+  uint8_t value)
+{
+  jit->exit = true;
+  mem_write_slow(mem, address, value);
+}
+
+
+
+/* Memory at a fixed address outside the I/O page = AL */
+static void emit_write(w65c02_jit_t *jit, uint16_t address)
+{
+  size_t slow, done;
+
+  emit8(jit, 0x49); /* MOV RCX, [R12+write_page] */
+  emit8(jit, 0x8B);
+  emit8(jit, 0x8C);
+  emit8(jit, 0x24);
+  emit32(jit, MEM_OFFSET(write_page) + (address >> 8) * sizeof(uint8_t *));
+  emit8(jit, 0x48); /* TEST RCX, RCX */
+  emit8(jit, 0x85);
+  emit8(jit, 0xC9);
+  slow = emit_jump_short(jit, 0x74); /* JZ */
+  emit8(jit, 0x88); /* MOV [RCX+offset], AL */
+  emit8(jit, 0x81);
+  emit32(jit, address & 0xFF);
+  done = emit_jump_short(jit, 0xEB); /* JMP */
+
+  emit_label(jit, slow);
+  emit8(jit, 0x4C); /* MOV RDI, R15 */
+  emit8(jit, 0x89);
+  emit8(jit, 0xFF);
+  emit8(jit, 0x4C); /* MOV RSI, R12 */
+  emit8(jit, 0x89);
+  emit8(jit, 0xE6);
+  emit8(jit, 0xBA); /* MOV EDX, imm32 */
+  emit32(jit, address);
+  emit8(jit, 0x0F); /* MOVZX ECX, AL */
+  emit8(jit, 0xB6);
+  emit8(jit, 0xC8);
+  emit_call(jit, jit_write);
+  emit_label(jit, done);
+}
+
+
+
+/* ECX = base address + index register, adding a cycle on page crossing. */
+static void emit_address_indexed(w65c02_jit_t *jit, uint16_t base,
+  uint8_t offset, bool boundary_check)
+{
+  emit8(jit, 0x0F); /* MOVZX ECX, BYTE [RBX+offset] */
+  emit8(jit, 0xB6);
+  emit8(jit, 0x4B);
+  emit8(jit, offset);
+  if (boundary_check) {
+    emit8(jit, 0x8D); /* LEA EDX, [RCX+base_low] */
+    emit8(jit, 0x91);
+    emit32(jit, base & 0xFF);
+    emit8(jit, 0xC1); /* SHR EDX, 8 */
+    emit8(jit, 0xEA);
+    emit8(jit, 0x08);
+    emit8(jit, 0x41); /* ADD R13D, EDX */
+    emit8(jit, 0x01);
+    emit8(jit, 0xD5);
+  }
+  emit8(jit, 0x81); /* ADD ECX, imm32 */
+  emit8(jit, 0xC1);
+  emit32(jit, base);
+  emit8(jit, 0x0F); /* MOVZX ECX, CX */
+  emit8(jit, 0xB7);
+  emit8(jit, 0xC9);
+}
+
+
+
+/* ECX = zero page pointer + Y, adding a cycle on page crossing. */
+static void emit_address_zpyi(w65c02_jit_t *jit, uint8_t zeropage,
+  bool boundary_check)
+{
+  emit8(jit, 0x49); /* MOV RCX, [R12+read_page] */
+  emit8(jit, 0x8B);
+  emit8(jit, 0x8C);
+  emit8(jit, 0x24);
+  emit32(jit, MEM_OFFSET(read_page));
+  emit8(jit, 0x0F); /* MOVZX EDX, BYTE [RCX+zeropage+1] */
+  emit8(jit, 0xB6);
+  emit8(jit, 0x91);
+  emit32(jit, (uint8_t)(zeropage + 1));
+  emit8(jit, 0x0F); /* MOVZX ECX, BYTE [RCX+zeropage] */
+  emit8(jit, 0xB6);
+  emit8(jit, 0x89);
+  emit32(jit, zeropage);
+  emit8(jit, 0xC1); /* SHL EDX, 8 */
+  emit8(jit, 0xE2);
+  emit8(jit, 0x08);
+  emit8(jit, 0x09); /* OR EDX, ECX */
+  emit8(jit, 0xCA);
+  emit8(jit, 0x0F); /* MOVZX ECX, BYTE [RBX+y] */
+  emit8(jit, 0xB6);
+  emit8(jit, 0x4B);
+  emit8(jit, CPU_OFFSET(y));
+  if (boundary_check) {
+    emit8(jit, 0x0F); /* MOVZX EAX, DL */
+    emit8(jit, 0xB6);
+    emit8(jit, 0xC2);
+    emit8(jit, 0x01); /* ADD EAX, ECX */
+    emit8(jit, 0xC8);
+    emit8(jit, 0xC1); /* SHR EAX, 8 */
+    emit8(jit, 0xE8);
+    emit8(jit, 0x08);
+    emit8(jit, 0x41); /* ADD R13D, EAX */
+    emit8(jit, 0x01);
+    emit8(jit, 0xC5);
+  }
+  emit8(jit, 0x01); /* ADD ECX, EDX */
+  emit8(jit, 0xD1);
+  emit8(jit, 0x0F); /* MOVZX ECX, CX */
+  emit8(jit, 0xB7);
+  emit8(jit, 0xC9);
+}
+
+
+
+/* Look up the page of the address in ECX, RDX = page or jump if NULL. */
+static size_t emit_page_lookup(w65c02_jit_t *jit, uint32_t table)
+{
+  emit8(jit, 0x89); /* MOV EDX, ECX */
+  emit8(jit, 0xCA);
+  emit8(jit, 0xC1); /* SHR EDX, 8 */
+  emit8(jit, 0xEA);
+  emit8(jit, 0x08);
+  emit8(jit, 0x49); /* MOV RDX, [R12+RDX*8+table] */
+  emit8(jit, 0x8B);
+  emit8(jit, 0x94);
+  emit8(jit, 0xD4);
+  emit32(jit, table);
+  emit8(jit, 0x48); /* TEST RDX, RDX */
+  emit8(jit, 0x85);
+  emit8(jit, 0xD2);
+  return emit_jump_short(jit, 0x74); /* JZ */
+}
+
+
+
+/* EAX = memory at the address in ECX. */
+static void emit_read_indexed(w65c02_jit_t *jit)
+{
+  size_t slow, done;
+
+  slow = emit_page_lookup(jit, MEM_OFFSET(read_page));
+  emit8(jit, 0x0F); /* MOVZX EAX, CL */
+  emit8(jit, 0xB6);
+  emit8(jit, 0xC1);
+  emit8(jit, 0x0F); /* MOVZX EAX, BYTE [RDX+RAX] */
+  emit8(jit, 0xB6);
+  emit8(jit, 0x04);
+  emit8(jit, 0x02);
+  done = emit_jump_short(jit, 0xEB); /* JMP */
+
+  emit_label(jit, slow);
+  emit8(jit, 0x4C); /* MOV RDI, R15 */
+  emit8(jit, 0x89);
+  emit8(jit, 0xFF);
+  emit8(jit, 0x4C); /* MOV RSI, R12 */
+  emit8(jit, 0x89);
+  emit8(jit, 0xE6);
+  emit8(jit, 0x89); /* MOV EDX, ECX */
+  emit8(jit, 0xCA);
+  emit_call(jit, jit_read);
+  emit8(jit, 0x0F); /* MOVZX EAX, AL */
+  emit8(jit, 0xB6);
+  emit8(jit, 0xC0);
+  emit_label(jit, done);
+}
+
+
+
+/* Memory at the address in ECX = AL */
+static void emit_write_indexed(w65c02_jit_t *jit)
+{
+  size_t slow, done;
+
+  slow = emit_page_lookup(jit, MEM_OFFSET(write_page));
+  emit8(jit, 0x44); /* MOVZX R8D, CL */
+  emit8(jit, 0x0F);
+  emit8(jit, 0xB6);
+  emit8(jit, 0xC1);
+  emit8(jit, 0x42); /* MOV [RDX+R8], AL */
+  emit8(jit, 0x88);
+  emit8(jit, 0x04);
+  emit8(jit, 0x02);
+  done = emit_jump_short(jit, 0xEB); /* JMP */
+
+  emit_label(jit, slow);
+  emit8(jit, 0x4C); /* MOV RDI, R15 */
+  emit8(jit, 0x89);
+  emit8(jit, 0xFF);
+  emit8(jit, 0x4C); /* MOV RSI, R12 */
+  emit8(jit, 0x89);
+  emit8(jit, 0xE6);
+  emit8(jit, 0x89); /* MOV EDX, ECX */
+  emit8(jit, 0xCA);
+  emit8(jit, 0x0F); /* MOVZX ECX, AL */
+  emit8(jit, 0xB6);
+  emit8(jit, 0xC8);
+  emit_call(jit, jit_write);
+  emit_label(jit, done);
+}
+
+
+
+/* End of a native instruction: account cycles, then leave the block with
+   the PC of the next instruction if the budget is spent or a store asked
+   for it. */
+static void emit_next(w65c02_jit_t *jit, uint8_t cycles, uint16_t next,
+  bool store)
+{
+  size_t exit = 0, cont;
+
+  emit_add_cycles(jit, cycles);
+  if (store) {
+    emit8(jit, 0x41); /* CMP BYTE [R15+exit], 0 */
+    emit8(jit, 0x80);
+    emit8(jit, 0xBF);
+    emit32(jit, JIT_OFFSET(exit));
+    emit8(jit, 0x00);
+    exit = emit_jump_short(jit, 0x75); /* JNE */
+  }
+  emit8(jit, 0x45); /* CMP R13D, R14D */
+  emit8(jit, 0x39);
+  emit8(jit, 0xF5);
+  cont = emit_jump_short(jit, 0x7C); /* JL */
+  if (store) {
+    emit_label(jit, exit);
+  }
+  emit_set_pc(jit, next);
+  emit_jump(jit, 0, JIT_EPILOGUE);
+  emit_label(jit, cont);
+}
+
+
+
+/* Leave the block at 'pc', or loop if it is the start of the block. */
+static void emit_goto(w65c02_jit_t *jit, uint16_t pc, uint16_t start)
+{
+  emit_set_pc(jit, pc);
+  if (pc == start && ! jit->mem->machine->stop[start]) {
+    emit8(jit, 0x45); /* CMP R13D, R14D */
+    emit8(jit, 0x39);
+    emit8(jit, 0xF5);
+    emit_jump(jit, 0x8C, JIT_BODY); /* JL */
+  }
+  emit_jump(jit, 0, JIT_EPILOGUE);
+}
+
+
+
+static bool jit_call(w65c02_jit_t *jit, w65c02_t *cpu, mem_t *mem,
+  uint8_t opcode)
+{
+  cpu->cycles = w65c02_opcode_cycles(opcode);
+  (w65c02_opcode_function(opcode))(cpu, mem);
+  return jit->exit || mem->machine->debugger_break || mem->io_event ||
+    mem->read_page[jit->page_index] != jit->page;
+}
+
+
+
+/* Run an instruction through the interpreter handler. */
+static void emit_interpret(w65c02_jit_t *jit, uint8_t mc[3], uint16_t pc)
+{
+  uint8_t opcode = mc[0];
+
+  emit_set_pc(jit, pc + 1);
+  emit8(jit, 0x66); /* MOV WORD [RBX+operand], imm16 */
+  emit8(jit, 0xC7);
+  emit8(jit, 0x43);
+  emit8(jit, CPU_OFFSET(operand));
+  emit16(jit, mc[1] | (mc[2] << 8));
+  emit8(jit, 0x4C); /* MOV RDI, R15 */
+  emit8(jit, 0x89);
+  emit8(jit, 0xFF);
+  emit8(jit, 0x48); /* MOV RSI, RBX */
+  emit8(jit, 0x89);
+  emit8(jit, 0xDE);
+  emit8(jit, 0x4C); /* MOV RDX, R12 */
+  emit8(jit, 0x89);
+  emit8(jit, 0xE2);
+  emit8(jit, 0xB9); /* MOV ECX, imm32 */
+  emit32(jit, opcode);
+  emit_call(jit, jit_call);
+  emit8(jit, 0x0F); /* MOVZX ECX, BYTE [RBX+cycles] */
+  emit8(jit, 0xB6);
+  emit8(jit, 0x4B);
+  emit8(jit, CPU_OFFSET(cycles));
+  emit8(jit, 0x41); /* ADD R13D, ECX */
+  emit8(jit, 0x01);
+  emit8(jit, 0xCD);
+  emit8(jit, 0x84); /* TEST AL, AL */
+  emit8(jit, 0xC0);
+  emit_jump(jit, 0x85, JIT_EPILOGUE); /* JNZ */
+  if (jit_ends_block(opcode)) {
+    emit_jump(jit, 0, JIT_EPILOGUE);
+  } else {
+    emit8(jit, 0x45); /* CMP R13D, R14D */
+    emit8(jit, 0x39);
+    emit8(jit, 0xF5);
+    emit_jump(jit, 0x8D, JIT_EPILOGUE); /* JGE */
+  }
+}
+
+
+
+static void emit_prologue(w65c02_jit_t *jit)
+{
+  emit8(jit, 0x53);       /* PUSH RBX */
+  emit8(jit, 0x41);       /* PUSH R12 */
+  emit8(jit, 0x54);
+  emit8(jit, 0x41);       /* PUSH R13 */
+  emit8(jit, 0x55);
+  emit8(jit, 0x41);       /* PUSH R14 */
+  emit8(jit, 0x56);
+  emit8(jit, 0x41);       /* PUSH R15 */
+  emit8(jit, 0x57);
+  emit8(jit, 0x48);       /* MOV RBX, RDI */
+  emit8(jit, 0x89);
+  emit8(jit, 0xFB);
+  emit8(jit, 0x49);       /* MOV R12, RSI */
+  emit8(jit, 0x89);
+  emit8(jit, 0xF4);
+  emit8(jit, 0x41);       /* MOV R13D, EDX */
+  emit8(jit, 0x89);
+  emit8(jit, 0xD5);
+  emit8(jit, 0x41);       /* MOV R14D, ECX */
+  emit8(jit, 0x89);
+  emit8(jit, 0xCE);
+  emit8(jit, 0x4D);       /* MOV R15, R8 */
+  emit8(jit, 0x89);
+  emit8(jit, 0xC7);
+  emit8(jit, 0xEB);       /* JMP body */
+  emit8(jit, JIT_BODY - JIT_EPILOGUE);
+
+  emit8(jit, 0x44);       /* MOV EAX, R13D */
+  emit8(jit, 0x89);
+  emit8(jit, 0xE8);
+  emit8(jit, 0x41);       /* POP R15 */
+  emit8(jit, 0x5F);
+  emit8(jit, 0x41);       /* POP R14 */
+  emit8(jit, 0x5E);
+  emit8(jit, 0x41);       /* POP R13 */
+  emit8(jit, 0x5D);
+  emit8(jit, 0x41);       /* POP R12 */
+  emit8(jit, 0x5C);
+  emit8(jit, 0x5B);       /* POP RBX */
+  emit8(jit, 0xC3);       /* RET */
+}
+
+
+
+/* Translate one instruction to native code, returns false if the
+   interpreter handler has to be called instead. */
+static bool emit_native(w65c02_jit_t *jit, uint8_t mc[3], uint16_t pc,
+  uint16_t start)
+{
+  uint8_t cycles = w65c02_opcode_cycles(mc[0]);
+  uint16_t next = pc + w65c02_opcode_length(mc[0]);
+  uint16_t address = mc[1] + (mc[2] * 256);
+  uint16_t target;
+  bool store = false;
+  bool binary = false;
+  size_t skip, decimal = 0, done;
+  uint8_t a = CPU_OFFSET(a);
+  uint8_t x = CPU_OFFSET(x);
+  uint8_t y = CPU_OFFSET(y);
+  uint8_t p = CPU_OFFSET(p);
+
+  /* Absolute operands in the I/O page must go through the hooks. */
+  if (w65c02_opcode_length(mc[0]) == 3 && (address >> 8) == 0xC0) {
+    return false;
+  }
+
+  /* ADC and SBC are only native in binary mode. */
+  switch (mc[0]) {
+  case 0x69:
+  case 0x65:
+  case 0x6D:
+  case 0xE9:
+  case 0xE5:
+  case 0xED:
+    emit8(jit, 0xF6); /* TEST BYTE [RBX+p], D */
+    emit8(jit, 0x43);
+    emit8(jit, p);
+    emit8(jit, FLAG_D);
+    decimal = emit_jump_short(jit, 0x75); /* JNZ */
+    binary = true;
+    break;
+  }
+
+  switch (mc[0]) {
+  case 0xA9: /* LDA # */
+  case 0xA2: /* LDX # */
+  case 0xA0: /* LDY # */
+  case 0x29: /* AND # */
+  case 0x09: /* ORA # */
+  case 0x49: /* EOR # */
+  case 0xC9: /* CMP # */
+  case 0xE0: /* CPX # */
+  case 0xC0: /* CPY # */
+  case 0x69: /* ADC # */
+  case 0xE9: /* SBC # */
+    emit8(jit, 0xB8); /* MOV EAX, imm32 */
+    emit32(jit, mc[1]);
+    break;
+
+  case 0xA5: /* LDA zp */
+  case 0xA6: /* LDX zp */
+  case 0xA4: /* LDY zp */
+  case 0x25: /* AND zp */
+  case 0x05: /* ORA zp */
+  case 0x45: /* EOR zp */
+  case 0xC5: /* CMP zp */
+  case 0xE6: /* INC zp */
+  case 0xC6: /* DEC zp */
+  case 0x65: /* ADC zp */
+  case 0xE5: /* SBC zp */
+    emit_read(jit, mc[1]);
+    break;
+
+  case 0xAD: /* LDA a */
+  case 0xAE: /* LDX a */
+  case 0xAC: /* LDY a */
+  case 0x2D: /* AND a */
+  case 0x0D: /* ORA a */
+  case 0x4D: /* EOR a */
+  case 0xCD: /* CMP a */
+  case 0xEE: /* INC a */
+  case 0xCE: /* DEC a */
+  case 0x6D: /* ADC a */
+  case 0xED: /* SBC a */
+    emit_read(jit, address);
+    break;
+
+  case 0xBD: /* LDA a,x */
+  case 0xB9: /* LDA a,y */
+  case 0xB5: /* LDA zp,x */
+  case 0xB1: /* LDA (zp),y */
+  case 0x9D: /* STA a,x */
+  case 0x99: /* STA a,y */
+  case 0x95: /* STA zp,x */
+  case 0x91: /* STA (zp),y */
+    if (mc[0] == 0xB1 || mc[0] == 0x91) {
+      emit_address_zpyi(jit, mc[1], mc[0] == 0xB1);
+    } else if (mc[0] == 0xB5 || mc[0] == 0x95) {
+      emit_address_indexed(jit, mc[1], x, false);
+      emit8(jit, 0x0F); /* MOVZX ECX, CL */
+      emit8(jit, 0xB6);
+      emit8(jit, 0xC9);
+    } else {
+      emit_address_indexed(jit, address, (mc[0] & 0x04) ? x : y,
+        (mc[0] & 0x20) != 0);
+    }
+    if (mc[0] & 0x20) {
+      emit_read_indexed(jit);
+      emit_store_register(jit, a);
+      emit_flags_nz(jit);
+    } else {
+      emit_load_register(jit, a);
+      emit_write_indexed(jit);
+    }
+    emit_next(jit, cycles, next, true);
+    return true;
+
+  case 0x0A: /* ASL A */
+  case 0x2A: /* ROL A */
+  case 0x4A: /* LSR A */
+  case 0x6A: /* ROR A */
+    emit_load_register(jit, a);
+    if (mc[0] == 0x2A || mc[0] == 0x6A) {
+      emit8(jit, 0x0F); /* MOVZX EDX, BYTE [RBX+p] */
+      emit8(jit, 0xB6);
+      emit8(jit, 0x53);
+      emit8(jit, p);
+      emit8(jit, 0x83); /* AND EDX, C */
+      emit8(jit, 0xE2);
+      emit8(jit, FLAG_C);
+    } else {
+      emit8(jit, 0x31); /* XOR EDX, EDX */
+      emit8(jit, 0xD2);
+    }
+    if (mc[0] & 0x40) { /* Right */
+      emit8(jit, 0xC1); /* SHL EDX, 8 */
+      emit8(jit, 0xE2);
+      emit8(jit, 0x08);
+      emit8(jit, 0x09); /* OR EAX, EDX */
+      emit8(jit, 0xD0);
+      emit8(jit, 0x89); /* MOV ECX, EAX */
+      emit8(jit, 0xC1);
+      emit8(jit, 0x83); /* AND ECX, 1 */
+      emit8(jit, 0xE1);
+      emit8(jit, 0x01);
+      emit8(jit, 0xD1); /* SHR EAX, 1 */
+      emit8(jit, 0xE8);
+    } else { /* Left */
+      emit8(jit, 0x01); /* ADD EAX, EAX */
+      emit8(jit, 0xC0);
+      emit8(jit, 0x09); /* OR EAX, EDX */
+      emit8(jit, 0xD0);
+      emit8(jit, 0x89); /* MOV ECX, EAX */
+      emit8(jit, 0xC1);
+      emit8(jit, 0xC1); /* SHR ECX, 8 */
+      emit8(jit, 0xE9);
+      emit8(jit, 0x08);
+      emit8(jit, 0x0F); /* MOVZX EAX, AL */
+      emit8(jit, 0xB6);
+      emit8(jit, 0xC0);
+    }
+    emit_store_register(jit, a);
+    emit_flags_nz(jit);
+    emit8(jit, 0x80); /* AND BYTE [RBX+p], ~C */
+    emit8(jit, 0x63);
+    emit8(jit, p);
+    emit8(jit, (uint8_t)~FLAG_C);
+    emit8(jit, 0x08); /* OR [RBX+p], CL */
+    emit8(jit, 0x4B);
+    emit8(jit, p);
+    emit_next(jit, cycles, next, false);
+    return true;
+
+  case 0x85: /* STA zp */
+  case 0x86: /* STX zp */
+  case 0x84: /* STY zp */
+  case 0x64: /* STZ zp */
+    address = mc[1];
+    /* Fall through. */
+  case 0x8D: /* STA a */
+  case 0x8E: /* STX a */
+  case 0x8C: /* STY a */
+  case 0x9C: /* STZ a */
+    if (mc[0] == 0x64 || mc[0] == 0x9C) {
+      emit8(jit, 0x31); /* XOR EAX, EAX */
+      emit8(jit, 0xC0);
+    } else if (mc[0] == 0x85 || mc[0] == 0x8D) {
+      emit_load_register(jit, a);
+    } else if (mc[0] == 0x86 || mc[0] == 0x8E) {
+      emit_load_register(jit, x);
+    } else {
+      emit_load_register(jit, y);
+    }
+    emit_write(jit, address);
+    emit_next(jit, cycles, next, true);
+    return true;
+
+  case 0xAA: /* TAX */
+  case 0xA8: /* TAY */
+    emit_load_register(jit, a);
+    emit_store_register(jit, (mc[0] == 0xAA) ? x : y);
+    emit_flags_nz(jit);
+    emit_next(jit, cycles, next, false);
+    return true;
+
+  case 0x8A: /* TXA */
+  case 0x98: /* TYA */
+    emit_load_register(jit, (mc[0] == 0x8A) ? x : y);
+    emit_store_register(jit, a);
+    emit_flags_nz(jit);
+    emit_next(jit, cycles, next, false);
+    return true;
+
+  case 0xE8: /* INX */
+  case 0xC8: /* INY */
+  case 0xCA: /* DEX */
+  case 0x88: /* DEY */
+    emit_load_register(jit, (mc[0] == 0xE8 || mc[0] == 0xCA) ? x : y);
+    emit8(jit, (mc[0] == 0xE8 || mc[0] == 0xC8) ? 0x04 : 0x2C); /* ADD/SUB */
+    emit8(jit, 0x01);
+    emit_store_register(jit, (mc[0] == 0xE8 || mc[0] == 0xCA) ? x : y);
+    emit_flags_nz(jit);
+    emit_next(jit, cycles, next, false);
+    return true;
+
+  case 0x18: /* CLC */
+  case 0xB8: /* CLV */
+    emit8(jit, 0x80); /* AND BYTE [RBX+p], imm8 */
+    emit8(jit, 0x63);
+    emit8(jit, p);
+    emit8(jit, (uint8_t)~((mc[0] == 0x18) ? FLAG_C : FLAG_V));
+    emit_next(jit, cycles, next, false);
+    return true;
+
+  case 0x38: /* SEC */
+    emit8(jit, 0x80); /* OR BYTE [RBX+p], imm8 */
+    emit8(jit, 0x4B);
+    emit8(jit, p);
+    emit8(jit, FLAG_C);
+    emit_next(jit, cycles, next, false);
+    return true;
+
+  case 0xEA: /* NOP */
+    emit_next(jit, cycles, next, false);
+    return true;
+
+  case 0x4C: /* JMP a */
+    emit_add_cycles(jit, cycles);
+    emit_goto(jit, address, start);
+    return true;
+
+  case 0x10: /* BPL */
+  case 0x30: /* BMI */
+  case 0x50: /* BVC */
+  case 0x70: /* BVS */
+  case 0x90: /* BCC */
+  case 0xB0: /* BCS */
+  case 0xD0: /* BNE */
+  case 0xF0: /* BEQ */
+  case 0x80: /* BRA */
+    target = next + (int8_t)mc[1];
+    skip = 0;
+    if (mc[0] != 0x80) {
+      switch (mc[0] >> 6) {
+      case 0:
+        emit8(jit, 0x66); /* TEST WORD [RBX+nz], 0x8080 */
+        emit8(jit, 0xF7);
+        emit8(jit, 0x43);
+        emit8(jit, CPU_OFFSET(nz));
+        emit16(jit, 0x8080);
+        break;
+      case 1:
+      case 2:
+        emit8(jit, 0xF6); /* TEST BYTE [RBX+p], imm8 */
+        emit8(jit, 0x43);
+        emit8(jit, p);
+        emit8(jit, (mc[0] >> 6 == 1) ? FLAG_V : FLAG_C);
+        break;
+      default:
+        emit8(jit, 0x80); /* CMP BYTE [RBX+nz], 0 */
+        emit8(jit, 0x7B);
+        emit8(jit, CPU_OFFSET(nz));
+        emit8(jit, 0x00);
+        break;
+      }
+      /* Skip the taken path with JZ if branching on a set flag, where a
+         set Z flag is the result comparing equal to 0. */
+      if ((mc[0] >> 6) == 3) {
+        skip = emit_jump_short(jit, (mc[0] & 0x20) ? 0x75 : 0x74);
+      } else {
+        skip = emit_jump_short(jit, (mc[0] & 0x20) ? 0x74 : 0x75);
+      }
+    }
+    emit_add_cycles(jit, cycles + 1 +
+      (((next & 0xFF00) != (target & 0xFF00)) ? 1 : 0));
+    emit_goto(jit, target, start);
+    if (mc[0] != 0x80) {
+      emit_label(jit, skip);
+      emit_add_cycles(jit, cycles);
+      emit_goto(jit, next, start);
+    }
+    return true;
+
+  default:
+    return false;
+  }
+
+  /* Operand is in EAX, finish the instruction. */
+  switch (mc[0]) {
+  case 0xA9:
+  case 0xA5:
+  case 0xAD:
+    emit_store_register(jit, a);
+    emit_flags_nz(jit);
+    break;
+
+  case 0xA2:
+  case 0xA6:
+  case 0xAE:
+    emit_store_register(jit, x);
+    emit_flags_nz(jit);
+    break;
+
+  case 0xA0:
+  case 0xA4:
+  case 0xAC:
+    emit_store_register(jit, y);
+    emit_flags_nz(jit);
+    break;
+
+  case 0x29:
+  case 0x25:
+  case 0x2D:
+  case 0x09:
+  case 0x05:
+  case 0x0D:
+  case 0x49:
+  case 0x45:
+  case 0x4D:
+    switch (mc[0] & 0xF0) {
+    case 0x20:
+      emit8(jit, 0x22); /* AND AL, [RBX+a] */
+      break;
+    case 0x00:
+      emit8(jit, 0x0A); /* OR AL, [RBX+a] */
+      break;
+    default:
+      emit8(jit, 0x32); /* XOR AL, [RBX+a] */
+      break;
+    }
+    emit8(jit, 0x43);
+    emit8(jit, a);
+    emit_store_register(jit, a);
+    emit_flags_nz(jit);
+    break;
+
+  case 0xC9:
+  case 0xC5:
+  case 0xCD:
+  case 0xE0:
+  case 0xC0:
+    emit8(jit, 0x0F); /* MOVZX EDX, BYTE [RBX+register] */
+    emit8(jit, 0xB6);
+    emit8(jit, 0x53);
+    emit8(jit, (mc[0] == 0xE0) ? x : ((mc[0] == 0xC0) ? y : a));
+    emit8(jit, 0x29); /* SUB EDX, EAX */
+    emit8(jit, 0xC2);
+    emit8(jit, 0x0F); /* SETAE CL */
+    emit8(jit, 0x93);
+    emit8(jit, 0xC1);
+    emit8(jit, 0x0F); /* MOVZX EAX, DL */
+    emit8(jit, 0xB6);
+    emit8(jit, 0xC2);
+    emit_flags_nz(jit);
+    emit8(jit, 0x80); /* AND BYTE [RBX+p], ~C */
+    emit8(jit, 0x63);
+    emit8(jit, p);
+    emit8(jit, (uint8_t)~FLAG_C);
+    emit8(jit, 0x08); /* OR [RBX+p], CL */
+    emit8(jit, 0x4B);
+    emit8(jit, p);
+    break;
+
+  case 0xE6:
+  case 0xEE:
+  case 0xC6:
+  case 0xCE:
+    emit8(jit, (mc[0] & 0x20) ? 0x04 : 0x2C); /* ADD/SUB AL, 1 */
+    emit8(jit, 0x01);
+    emit_flags_nz(jit);
+    emit_write(jit, (mc[0] & 0x08) ? address : mc[1]);
+    store = true;
+    break;
+
+  case 0x69:
+  case 0x65:
+  case 0x6D:
+  case 0xE9:
+  case 0xE5:
+  case 0xED:
+    if (mc[0] & 0x80) {
+      emit8(jit, 0x34); /* XOR AL, 0xFF */
+      emit8(jit, 0xFF);
+    }
+    emit8(jit, 0x0F); /* MOVZX EDX, BYTE [RBX+a] */
+    emit8(jit, 0xB6);
+    emit8(jit, 0x53);
+    emit8(jit, a);
+    emit8(jit, 0x0F); /* MOVZX ECX, BYTE [RBX+p] */
+    emit8(jit, 0xB6);
+    emit8(jit, 0x4B);
+    emit8(jit, p);
+    emit8(jit, 0x83); /* AND ECX, C */
+    emit8(jit, 0xE1);
+    emit8(jit, FLAG_C);
+    emit8(jit, 0x01); /* ADD ECX, EAX */
+    emit8(jit, 0xC1);
+    emit8(jit, 0x01); /* ADD ECX, EDX */
+    emit8(jit, 0xD1);
+    emit8(jit, 0x31); /* XOR EDX, ECX */
+    emit8(jit, 0xCA);
+    emit8(jit, 0x31); /* XOR EAX, ECX */
+    emit8(jit, 0xC8);
+    emit8(jit, 0x21); /* AND EAX, EDX */
+    emit8(jit, 0xD0);
+    emit8(jit, 0xD1); /* SHR EAX, 1 */
+    emit8(jit, 0xE8);
+    emit8(jit, 0x83); /* AND EAX, V */
+    emit8(jit, 0xE0);
+    emit8(jit, FLAG_V);
+    emit8(jit, 0x89); /* MOV EDX, ECX */
+    emit8(jit, 0xCA);
+    emit8(jit, 0xC1); /* SHR EDX, 8 */
+    emit8(jit, 0xEA);
+    emit8(jit, 0x08);
+    emit8(jit, 0x09); /* OR EAX, EDX */
+    emit8(jit, 0xD0);
+    emit8(jit, 0x80); /* AND BYTE [RBX+p], ~(V|C) */
+    emit8(jit, 0x63);
+    emit8(jit, p);
+    emit8(jit, (uint8_t)~(FLAG_V | FLAG_C));
+    emit8(jit, 0x08); /* OR [RBX+p], AL */
+    emit8(jit, 0x43);
+    emit8(jit, p);
+    emit8(jit, 0x0F); /* MOVZX EAX, CL */
+    emit8(jit, 0xB6);
+    emit8(jit, 0xC1);
+    emit_store_register(jit, a);
+    emit_flags_nz(jit);
+    break;
+  }
+
+  emit_next(jit, cycles, next, store);
+
+  if (binary) {
+    done = emit_jump_short(jit, 0xEB); /* JMP */
+    emit_label(jit, decimal);
+    emit_interpret(jit, mc, pc);
+    emit_label(jit, done);
+  }
+  return true;
+}
+#endif /* W65C02_JIT_X86_64 */
+
+
+
+static void jit_flush(w65c02_jit_t *jit, mem_t *mem)
+{
+  int host;
+
+  for (host = 0; host < MEM_HOST_PAGE_MAX; host++) {
+    if (jit->page_block[host] != NULL) {
+      mem_code_watch(mem, jit->page_block[host]->page, false);
+      jit->page_block[host] = NULL;
+    }
+  }
+  memset(jit->lookup, 0, sizeof(jit->lookup));
+  jit->block_used = 0;
+  jit->code_used = 0;
+}
+
+
+
+static w65c02_jit_block_t *jit_translate(w65c02_jit_t *jit, mem_t *mem,
+  uint16_t pc)
+{
+#ifdef W65C02_JIT_X86_64
+  w65c02_jit_block_t *block;
+  uint8_t *page;
+  uint8_t mc[3];
+  uint16_t address;
+  int host, i, length;
+
+  page = mem->read_page[pc >> 8];
+  if (page == NULL) {
+    return NULL;
+  }
+  host = mem_host_page(mem, page);
+  if (host >= 0 && jit->page_flush[host] >= JIT_PAGE_FLUSH_MAX) {
+    return NULL; /* Too much self-modifying code, keep interpreting. */
+  }
+  if (((pc & 0xFF) + w65c02_opcode_length(page[pc & 0xFF])) > 0x100) {
+    return NULL; /* First instruction crosses the page. */
+  }
+
+  if (jit->block_used >= W65C02_JIT_BLOCK_MAX ||
+    jit->code_used + JIT_BLOCK_CODE_MAX > JIT_CODE_SIZE) {
+    jit_flush(jit, mem);
+  }
+
+  jit->code_block = jit->code_used;
+  emit_prologue(jit);
+
+  address = pc;
+  for (i = 0; i < JIT_BLOCK_INSTRUCTIONS; i++) {
+    mc[0] = page[address & 0xFF];
+    length = w65c02_opcode_length(mc[0]);
+    if (i > 0 && (address & 0xFF) + length > 0x100) {
+      emit_set_pc(jit, address); /* Continues on the next page. */
+      emit_jump(jit, 0, JIT_EPILOGUE);
+      break;
+    }
+    if (i > 0 && mem->machine->stop[address]) {
+      emit_set_pc(jit, address); /* Trap, handled outside of the JIT. */
+      emit_jump(jit, 0, JIT_EPILOGUE);
+      break;
+    }
+    mc[1] = (length > 1) ? page[(address + 1) & 0xFF] : 0;
+    mc[2] = (length > 2) ? page[(address + 2) & 0xFF] : 0;
+
+    if (! emit_native(jit, mc, address, pc)) {
+      emit_interpret(jit, mc, address);
+    }
+    address += length;
+
+    if (jit_ends_block(mc[0])) {
+      break;
+    }
+    if (i == JIT_BLOCK_INSTRUCTIONS - 1 || (address & 0xFF) == 0) {
+      emit_set_pc(jit, address);
+      emit_jump(jit, 0, JIT_EPILOGUE);
+      break;
+    }
+  }
+
+  block = &jit->block[jit->block_used++];
+  block->pc = pc;
+  block->page = page;
+  block->entry = (w65c02_jit_entry_t)(void *)&jit->code[jit->code_block];
+  if (host >= 0) {
+    block->page_next = jit->page_block[host];
+    jit->page_block[host] = block;
+    mem_code_watch(mem, page, true);
+  } else {
+    block->page_next = NULL;
+  }
+  jit->lookup[pc] = block;
+  return block;
+#else
+  (void)jit;
+  (void)mem;
+  (void)pc;
+  return NULL;
+#endif /* W65C02_JIT_X86_64 */
+}
+
+
+
+/* Called by the memory system on the first write to a page with blocks. */
+static void jit_code_write(void *cookie, uint8_t *page)
+{
+  w65c02_jit_t *jit = cookie;
+  w65c02_jit_block_t *block;
+  int host;
+
+  host = mem_host_page(jit->mem, page);
+  if (jit->page_block[host] == NULL) {
+    return; /* Only watched for the decode cache. */
+  }
+  for (block = jit->page_block[host]; block != NULL;
+    block = block->page_next) {
+    if (jit->lookup[block->pc] == block) {
+      jit->lookup[block->pc] = NULL;
+    }
+  }
+  jit->page_block[host] = NULL;
+  if (jit->page_flush[host] < JIT_PAGE_FLUSH_MAX) {
+    jit->page_flush[host]++;
+  }
+  jit->exit = true;
+}
+
+
+
+int w65c02_jit_init(w65c02_jit_t *jit, mem_t *mem)
+{
+  memset(jit, 0, sizeof(w65c02_jit_t));
+  jit->mem = mem;
+  jit->code = NULL;
+
+#ifdef W65C02_JIT_X86_64
+  jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->code == MAP_FAILED) {
+    jit->code = NULL;
+    return -1;
+  }
+#else
+  return -1; /* Only x86-64 code generation is available. */
+#endif /* W65C02_JIT_X86_64 */
+
+  mem->code_write.func = jit_code_write;
+  mem->code_write.cookie = jit;
+  return 0;
+}
+
+
+
+void w65c02_jit_exit(w65c02_jit_t *jit)
+{
+  jit_flush(jit, jit->mem);
+  jit->mem->code_write.func = NULL;
+  jit->mem->code_write.cookie = NULL;
+#ifdef W65C02_JIT_X86_64
+  if (jit->code != NULL) {
+    munmap(jit->code, JIT_CODE_SIZE);
+    jit->code = NULL;
+  }
+#endif /* W65C02_JIT_X86_64 */
+}
+
+
+
+int w65c02_jit_run(w65c02_jit_t *jit, w65c02_t *cpu, mem_t *mem, int budget)
+{
+  w65c02_jit_block_t *block;
+  uint8_t pending = cpu->cycles;
+  int consumed = 0;
+  int before;
+
+  /* Breakpoints and the trace buffer need every instruction. */
+  if (jit->code == NULL || cpu->trace ||
+    mem->machine->debugger_breakpoint >= 0) {
+    return w65c02_run(cpu, mem, budget);
+  }
+
+  do {
+    block = jit->lookup[cpu->pc];
+    if (block != NULL && block->page != mem->read_page[cpu->pc >> 8]) {
+      block = NULL; /* Translated from another bank. */
+    }
+    if (block == NULL) {
+      if (jit->count[cpu->pc] < JIT_HOT) {
+        jit->count[cpu->pc]++;
+      } else {
+        jit->count[cpu->pc] = 0;
+        block = jit_translate(jit, mem, cpu->pc);
+      }
+    }
+
+    if (block != NULL) {
+      jit->exit = false;
+      jit->page = block->page;
+      jit->page_index = block->pc >> 8;
+      before = consumed;
+      consumed = (block->entry)(cpu, mem, consumed, budget, jit);
+      cpu->cycle_count += consumed - before;
+    } else {
+      consumed += jit_interpret(cpu, mem, budget - consumed);
+    }
+  } while (consumed < budget && ! mem->machine->debugger_break &&
+    ! mem->io_event && ! mem->machine->stop[cpu->pc]);
+
+  cpu->cycles = pending;
+  return consumed;
+}
@@ -0,0 +1,47 @@
+#ifndef _W65C02_JIT_H
+#define _W65C02_JIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "mem.h"
+#include "w65c02.h"
+
+#define W65C02_JIT_BLOCK_MAX 16384
+
+struct w65c02_jit_s;
+
+typedef int (*w65c02_jit_entry_t)(w65c02_t *, mem_t *, int, int,
+  struct w65c02_jit_s *);
+
+typedef struct w65c02_jit_block_s {
+  uint16_t pc;              /* Guest address of the first instruction. */
+  uint8_t *page;            /* Host page the block was translated from. */
+  w65c02_jit_entry_t entry; /* Native code. */
+  struct w65c02_jit_block_s *page_next; /* Next block in the same page. */
+} w65c02_jit_block_t;
+
+typedef struct w65c02_jit_s {
+  /* Accessed by native code: */
+  bool exit;          /* End the running block after this instruction. */
+  uint8_t *page;      /* Host page of the running block. */
+  uint8_t page_index; /* Guest page of the running block. */
+
+  mem_t *mem;
+  uint8_t *code;    /* Executable buffer, NULL if the JIT is unavailable. */
+  size_t code_used;
+  size_t code_block; /* Start of the block being translated. */
+  w65c02_jit_block_t block[W65C02_JIT_BLOCK_MAX];
+  int block_used;
+
+  w65c02_jit_block_t *lookup[UINT16_MAX + 1]; /* Latest block by guest PC. */
+  uint8_t count[UINT16_MAX + 1]; /* Block entries by guest PC. */
+  w65c02_jit_block_t *page_block[MEM_HOST_PAGE_MAX]; /* Blocks in RAM pages. */
+  uint8_t page_flush[MEM_HOST_PAGE_MAX]; /* Invalidations per RAM page. */
+} w65c02_jit_t;
+
+int w65c02_jit_init(w65c02_jit_t *jit, mem_t *mem);
+void w65c02_jit_exit(w65c02_jit_t *jit);
+int w65c02_jit_run(w65c02_jit_t *jit, w65c02_t *cpu, mem_t *mem, int budget);
+
+#endif /* _W65C02_JIT_H */
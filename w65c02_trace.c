@@ -10,8 +10,6 @@
 
 
 
-#define W65C02_TRACE_BUFFER_SIZE 256
-
 typedef enum {
   AM_ACCU, /* A      - Accumulator */
   AM_IMPL, /* i      - Implied */
@@ -31,11 +29,6 @@ typedef enum {
   AM_ZPI,  /* (zp)   - Zero Page Indirect */
 } w65c02_address_mode_t;
 
-typedef struct w65c02_trace_s {
-  w65c02_t cpu;
-  uint8_t mc[3];
-} w65c02_trace_t;
-
 
 
 static w65c02_address_mode_t opcode_address_mode[UINT8_MAX + 1] = {
@@ -112,11 +105,6 @@ static char *opcode_mnemonic[UINT8_MAX + 1] = {
 
 
 
-static w65c02_trace_t w65c02_trace_buffer[W65C02_TRACE_BUFFER_SIZE];
-static int w65c02_trace_index = 0;
-
-
-
 static void w65c02_disassemble(FILE *fh, uint16_t pc, uint8_t mc[3])
 {
   uint16_t address;
@@ -254,47 +242,42 @@ static void w65c02_register_dump(FILE *fh, w65c02_t *cpu, uint8_t mc[3])
 
 
 
-void w65c02_trace_init(void)
+void w65c02_trace_init(w65c02_trace_t *trace)
 {
-  memset(w65c02_trace_buffer, 0,
-    W65C02_TRACE_BUFFER_SIZE * sizeof(w65c02_trace_t));
+  memset(trace, 0, sizeof(w65c02_trace_t));
 }
 
 
 
-void w65c02_trace_dump(FILE *fh)
+void w65c02_trace_dump(w65c02_trace_t *trace, FILE *fh)
 {
   int i;
 
   for (i = 0; i < W65C02_TRACE_BUFFER_SIZE; i++) {
-    w65c02_trace_index++;
-    if (w65c02_trace_index >= W65C02_TRACE_BUFFER_SIZE) {
-      w65c02_trace_index = 0;
+    trace->index++;
+    if (trace->index >= W65C02_TRACE_BUFFER_SIZE) {
+      trace->index = 0;
     }
-    w65c02_register_dump(fh, &w65c02_trace_buffer[w65c02_trace_index].cpu,
-                              w65c02_trace_buffer[w65c02_trace_index].mc);
+    w65c02_register_dump(fh, &trace->buffer[trace->index].cpu,
+                              trace->buffer[trace->index].mc);
   }
 }
 
 
 
-void w65c02_trace_add(w65c02_t *cpu, mem_t *mem)
+void w65c02_trace_add(w65c02_trace_t *trace, w65c02_t *cpu, mem_t *mem)
 {
   uint8_t mc[3];
 
-  w65c02_trace_index++;
-  if (w65c02_trace_index >= W65C02_TRACE_BUFFER_SIZE) {
-    w65c02_trace_index = 0;
+  trace->index++;
+  if (trace->index >= W65C02_TRACE_BUFFER_SIZE) {
+    trace->index = 0;
   }
 
-  memcpy(&w65c02_trace_buffer[w65c02_trace_index].cpu,
-    cpu, sizeof(w65c02_t));
+  memcpy(&trace->buffer[trace->index].cpu, cpu, sizeof(w65c02_t));
+  trace->buffer[trace->index].cpu.p = w65c02_status_get(cpu);
   mc[0] = mem_read(mem, cpu->pc);
   mc[1] = mem_read(mem, cpu->pc + 1);
   mc[2] = mem_read(mem, cpu->pc + 2);
-  memcpy(&w65c02_trace_buffer[w65c02_trace_index].mc,
-    mc, sizeof(uint8_t) * 3);
+  memcpy(&trace->buffer[trace->index].mc, mc, sizeof(uint8_t) * 3);
 }
-
-
-
@@ -1,12 +1,25 @@
 #ifndef _W65C02_TRACE_H
 #define _W65C02_TRACE_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include "w65c02.h"
 #include "mem.h"
 
-void w65c02_trace_init(void);
-void w65c02_trace_add(w65c02_t *cpu, mem_t *mem);
-void w65c02_trace_dump(FILE *fh);
+#define W65C02_TRACE_BUFFER_SIZE 256
+
+typedef struct w65c02_trace_entry_s {
+  w65c02_t cpu;
+  uint8_t mc[3];
+} w65c02_trace_entry_t;
+
+typedef struct w65c02_trace_s {
+  w65c02_trace_entry_t buffer[W65C02_TRACE_BUFFER_SIZE];
+  int index;
+} w65c02_trace_t;
+
+void w65c02_trace_init(w65c02_trace_t *trace);
+void w65c02_trace_add(w65c02_trace_t *trace, w65c02_t *cpu, mem_t *mem);
+void w65c02_trace_dump(w65c02_trace_t *trace, FILE *fh);
 
 #endif /* _W65C02_TRACE_H */
@@ -0,0 +1,330 @@
+#include "woz.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WOZ_HEADER_SIZE 12
+#define WOZ_CHUNK_HEADER_SIZE 8
+#define WOZ_BLOCK_SIZE 512
+
+#define WOZ1_TRACK_SIZE 6656 /* Bit stream and trailer of a TRKS entry. */
+#define WOZ1_BITS_SIZE 6646  /* Start of the trailer. */
+#define WOZ2_TRK_SIZE 8 /* TRK entry, with the bit stream elsewhere. */
+
+#define WOZ_ZEROS_MAX 48 /* Leading zeros to skip with one window. */
+
+
+
+static uint16_t woz_le16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+
+
+static uint32_t woz_le32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+
+static bool woz_bit(const uint8_t *bits, uint32_t n)
+{
+  return (bits[n >> 3] >> (7 - (n & 7))) & 1;
+}
+
+
+
+/* 64 bits of the track starting at bit n, with the first one in the most
+   significant bit. At least 57 of them are valid. */
+static uint64_t woz_window(const uint8_t *bits, uint32_t n)
+{
+  uint64_t window;
+
+  memcpy(&window, &bits[n >> 3], sizeof(window));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  window = __builtin_bswap64(window);
+#endif
+  return window << (n & 7);
+}
+
+
+
+bool woz_detect(const uint8_t data[])
+{
+  return (memcmp(data, "WOZ1", 4) == 0 || memcmp(data, "WOZ2", 4) == 0) &&
+    data[4] == 0xFF && data[5] == 0x0A && data[6] == 0x0D && data[7] == 0x0A;
+}
+
+
+
+/* Copy a bit stream into the next free part of bits[], followed by a copy
+   of its first 64 bits, so a window can be read from any position without
+   wrapping around. Tracks too short for that are left out. */
+static int woz_track_load(woz_t *woz, const uint8_t *image, size_t size,
+  uint32_t start, int track_no, uint32_t *used, uint32_t bit_count)
+{
+  woz_track_t *track = &woz->track[track_no];
+  uint32_t offset = *used;
+  uint32_t bytes = (bit_count + 7) / 8;
+  uint8_t *bits;
+  int i;
+
+  if (bit_count < 64) {
+    return 0;
+  }
+  if (offset + bytes + WOZ_TRACK_PAD > WOZ_BITS_SIZE ||
+      start > size || bytes > size - start) {
+    return -1;
+  }
+  if (offset + bytes + WOZ_TRACK_PAD > woz->bits_size) {
+    bits = realloc(woz->bits, offset + bytes + WOZ_TRACK_PAD);
+    if (bits == NULL) {
+      return -1;
+    }
+    woz->bits = bits;
+    woz->bits_size = offset + bytes + WOZ_TRACK_PAD;
+  }
+  memcpy(&woz->bits[offset], &image[start], bytes);
+  memset(&woz->bits[offset + bytes], 0, WOZ_TRACK_PAD);
+
+  for (i = 0; i < 64; i++) {
+    if (woz_bit(&woz->bits[offset], i)) {
+      woz->bits[offset + ((bit_count + i) >> 3)] |=
+        0x80 >> ((bit_count + i) & 7);
+    } else {
+      woz->bits[offset + ((bit_count + i) >> 3)] &=
+        ~(0x80 >> ((bit_count + i) & 7));
+    }
+  }
+
+  track->offset = offset;
+  track->bit_count = bit_count;
+  if (track_no >= woz->track_count) {
+    woz->track_count = track_no + 1;
+  }
+  *used += bytes + WOZ_TRACK_PAD;
+  return 0;
+}
+
+
+
+/* Load a WOZ 1 or WOZ 2 image of a 5.25" disk. Only the INFO, TMAP and
+   TRKS chunks are used, the CRC is not checked. */
+int woz_load(woz_t *woz, const uint8_t *image, size_t size)
+{
+  const uint8_t *chunk;
+  uint32_t chunk_size;
+  size_t n;
+  uint32_t used = 0;
+  uint32_t start;
+  bool woz2;
+  int i;
+
+  memset(woz->tmap, 0xFF, sizeof(woz->tmap));
+  memset(woz->track, 0, sizeof(woz->track));
+  woz->track_count = 0;
+  woz->write_protected = false;
+  woz->current = NULL;
+  woz->bit_n = 0;
+  woz->noise = 0x1234567;
+
+  if (size < WOZ_HEADER_SIZE || ! woz_detect(image)) {
+    return -1;
+  }
+  woz2 = (image[3] == '2');
+
+  for (n = WOZ_HEADER_SIZE; n + WOZ_CHUNK_HEADER_SIZE <= size;
+    n += WOZ_CHUNK_HEADER_SIZE + chunk_size) {
+    chunk = &image[n];
+    chunk_size = woz_le32(&chunk[4]);
+    if (chunk_size > size - n - WOZ_CHUNK_HEADER_SIZE) {
+      return -1;
+    }
+    start = n + WOZ_CHUNK_HEADER_SIZE;
+
+    if (memcmp(chunk, "INFO", 4) == 0) {
+      if (chunk_size < 3 || image[start + 1] != 1) {
+        return -1; /* Not a 5.25" disk. */
+      }
+      woz->write_protected = (image[start + 2] != 0);
+
+    } else if (memcmp(chunk, "TMAP", 4) == 0) {
+      if (chunk_size < WOZ_QUARTER_TRACKS) {
+        return -1;
+      }
+      memcpy(woz->tmap, &image[start], WOZ_QUARTER_TRACKS);
+
+    } else if (memcmp(chunk, "TRKS", 4) == 0 && ! woz2) {
+      /* Fixed size entries with the bit stream inline. */
+      for (i = 0; i < (int)(chunk_size / WOZ1_TRACK_SIZE) &&
+        i < WOZ_QUARTER_TRACKS; i++) {
+        if (woz_track_load(woz, image, size, start, i, &used,
+          woz_le16(&image[start + WOZ1_BITS_SIZE + 2])) != 0) {
+          return -1;
+        }
+        start += WOZ1_TRACK_SIZE;
+      }
+
+    } else if (memcmp(chunk, "TRKS", 4) == 0 && woz2) {
+      /* Entries pointing to bit streams in 512 byte blocks of the file. */
+      if (chunk_size < WOZ_QUARTER_TRACKS * WOZ2_TRK_SIZE) {
+        return -1;
+      }
+      for (i = 0; i < WOZ_QUARTER_TRACKS; i++) {
+        if (woz_le16(&image[start + (i * WOZ2_TRK_SIZE)]) == 0) {
+          continue; /* Unused entry. */
+        }
+        if (woz_track_load(woz, image, size,
+          woz_le16(&image[start + (i * WOZ2_TRK_SIZE)]) * WOZ_BLOCK_SIZE,
+          i, &used, woz_le32(&image[start + (i * WOZ2_TRK_SIZE) + 4])) != 0) {
+          return -1;
+        }
+      }
+    }
+  }
+
+  /* Drop references to tracks that are not in the image. */
+  for (i = 0; i < WOZ_QUARTER_TRACKS; i++) {
+    if (woz->tmap[i] >= woz->track_count ||
+        woz->track[woz->tmap[i]].bit_count == 0) {
+      woz->tmap[i] = 0xFF;
+    }
+  }
+
+  woz_seek(woz, 0);
+  return 0;
+}
+
+
+
+void woz_free(woz_t *woz)
+{
+  free(woz->bits);
+  woz->bits = NULL;
+  woz->bits_size = 0;
+  woz->current = NULL;
+}
+
+
+
+/* Move the head to another quarter track, keeping its angular position
+   since the tracks may hold a different number of bits. */
+void woz_seek(woz_t *woz, int quarter_track)
+{
+  woz_track_t *track = NULL;
+
+  if (quarter_track >= 0 && quarter_track < WOZ_QUARTER_TRACKS &&
+      woz->tmap[quarter_track] != 0xFF) {
+    track = &woz->track[woz->tmap[quarter_track]];
+  }
+  if (track == woz->current) {
+    return;
+  }
+
+  if (woz->current != NULL && track != NULL) {
+    woz->bit_n = ((uint64_t)woz->bit_n * track->bit_count) /
+      woz->current->bit_count;
+  } else {
+    woz->bit_n = 0;
+  }
+  woz->current = track;
+}
+
+
+
+/* Find the next byte from the head, which starts with the first one bit,
+   and return the bit cells up to its end. Leading zeros, like the ones after
+   each self-sync byte, are skipped a window at a time. */
+static uint32_t woz_next(woz_t *woz, uint8_t *byte)
+{
+  woz_track_t *track = woz->current;
+  const uint8_t *bits;
+  uint64_t window;
+  uint32_t skipped = 0;
+  uint32_t bit_n;
+  int zeros;
+
+  if (track == NULL) {
+    /* Nothing but noise from the drive, read as random bytes. */
+    woz->noise ^= woz->noise << 13;
+    woz->noise ^= woz->noise >> 17;
+    woz->noise ^= woz->noise << 5;
+    *byte = woz->noise | 0x80;
+    return 8;
+  }
+
+  bits = &woz->bits[track->offset];
+  bit_n = woz->bit_n;
+  for (;;) {
+    window = woz_window(bits, bit_n);
+    zeros = (window == 0) ? 64 : __builtin_clzll(window);
+    if (zeros <= WOZ_ZEROS_MAX) {
+      break;
+    }
+    bit_n += WOZ_ZEROS_MAX;
+    if (bit_n >= track->bit_count) {
+      bit_n -= track->bit_count;
+    }
+    skipped += WOZ_ZEROS_MAX;
+    if (skipped > track->bit_count) {
+      woz->current = NULL; /* No flux transitions at all. */
+      return woz_next(woz, byte);
+    }
+  }
+
+  *byte = (window << zeros) >> 56;
+  return skipped + zeros + 8;
+}
+
+
+
+static void woz_advance(woz_t *woz, uint32_t cells)
+{
+  if (woz->current != NULL) {
+    woz->bit_n = (woz->bit_n + cells) % woz->current->bit_count;
+  }
+}
+
+
+
+/* Shift bits from the track into the data register until it holds a full
+   byte. Reads are paced by the software, like with the nibblized sector
+   images in fast disk mode. */
+uint8_t woz_read(woz_t *woz)
+{
+  uint8_t byte;
+
+  woz_advance(woz, woz_next(woz, &byte));
+  woz->cells = 0;
+  return byte;
+}
+
+
+
+/* Let bit cells pass under the head and return the last byte completed in
+   that time, or -1 if the data register is still shifting in the next one.
+   The bytes before it are lost, like with software reading too slowly. */
+int woz_read_timed(woz_t *woz, uint32_t cells)
+{
+  uint32_t length;
+  uint8_t byte;
+  int value = -1;
+
+  woz->cells += cells;
+  if (woz->cells > WOZ_CELLS_MAX) {
+    woz->cells = WOZ_CELLS_MAX; /* After a long wait. */
+  }
+  for (;;) {
+    length = woz_next(woz, &byte);
+    if (woz->cells < length) {
+      return value;
+    }
+    woz->cells -= length;
+    woz_advance(woz, length);
+    value = byte;
+  }
+}
@@ -0,0 +1,39 @@
+#ifndef _WOZ_H
+#define _WOZ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WOZ_QUARTER_TRACKS 160
+#define WOZ_TRACK_PAD 16 /* Bytes after each bit stream. */
+#define WOZ_BITS_SIZE (WOZ_QUARTER_TRACKS * 8192) /* Limit for bits[]. */
+#define WOZ_CELLS_MAX 131072 /* Two turns of the longest track. */
+
+typedef struct woz_track_s {
+  uint32_t offset; /* First byte of the bit stream in bits[]. */
+  uint32_t bit_count;
+} woz_track_t;
+
+typedef struct woz_s {
+  bool write_protected;
+  uint8_t tmap[WOZ_QUARTER_TRACKS]; /* Track for each quarter track. */
+  woz_track_t track[WOZ_QUARTER_TRACKS];
+  int track_count;
+  uint8_t *bits; /* Bit streams of all tracks, grown as they are loaded. */
+  uint32_t bits_size;
+
+  woz_track_t *current; /* Track under the head, NULL if unformatted. */
+  uint32_t bit_n;       /* Head position on the current track. */
+  uint32_t cells;       /* Passed under the head but not shifted in yet. */
+  uint32_t noise;       /* Random bits read from unformatted tracks. */
+} woz_t;
+
+bool woz_detect(const uint8_t data[]);
+int woz_load(woz_t *woz, const uint8_t *image, size_t size);
+void woz_free(woz_t *woz);
+void woz_seek(woz_t *woz, int quarter_track);
+uint8_t woz_read(woz_t *woz);
+int woz_read_timed(woz_t *woz, uint32_t cells);
+
+#endif /* _WOZ_H */